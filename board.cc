@@ -15,6 +15,40 @@ Position Part::padAbsPos(const Pad &p) const {
              pos.y + p.pos.x * sin(a) + p.pos.y * cos(a) };
 }
 
+// Check if the pads rotated by 90 degrees ("quarter_turns" times) all land
+// on a pad of the same size.
+static bool PadsRotationInvariant(const std::vector<Pad> &pads,
+                                  int quarter_turns) {
+    const float kEpsilon = 0.01;
+    for (const Pad &p : pads) {
+        Position pos = p.pos;
+        Dimension size = p.size;
+        for (int i = 0; i < quarter_turns; ++i) {
+            pos = Position(-pos.y, pos.x);
+            size = Dimension(size.h, size.w);
+        }
+        bool found = false;
+        for (const Pad &other : pads) {
+            if (fabsf(other.pos.x - pos.x) < kEpsilon
+                && fabsf(other.pos.y - pos.y) < kEpsilon
+                && fabsf(other.size.w - size.w) < kEpsilon
+                && fabsf(other.size.h - size.h) < kEpsilon) {
+                found = true;
+                break;
+            }
+        }
+        if (!found) return false;
+    }
+    return true;
+}
+
+int Part::PadSymmetry() const {
+    if (pads.empty()) return 360;
+    if (PadsRotationInvariant(pads, 1)) return 90;
+    if (PadsRotationInvariant(pads, 2)) return 180;
+    return 360;
+}
+
 namespace {
     // Helper class to read file from parse events.
     // Collect the parts from parse events.
@@ -34,6 +34,11 @@ struct Part {
     // Given the pad, that is relative to the part and its angle on the board,
     // Return the absolute center coordinate of the pad relative to the board.
     Position padAbsPos(const Pad &p) const;
+
+    // Rotational symmetry of the pad geometry around pos in degrees: 90, 180
+    // or 360 (no symmetry). Does not know about polarity, so pads of a
+    // diode look symmetric.
+    int PadSymmetry() const;
 };
 
 // Representation of the board and its components.
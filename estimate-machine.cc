@@ -0,0 +1,98 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) h.zeller@acm.org. Free Software. GNU Public License v3.0 and above
+ */
+
+#include "machine.h"
+
+#include <math.h>
+
+#include "motion-simulator.h"
+#include "output-sink.h"
+
+TimeEstimateMachine::TimeEstimateMachine(OutputSink *output,
+                                         float init_ms, float area_ms)
+    : output_(output), simulator_(NULL),
+      gcode_([this](const char *str, size_t len) {
+              simulator_->ProcessLine(str, len);
+          }, init_ms, area_ms),
+      picks_(0), dispense_count_(0) {}
+
+TimeEstimateMachine::~TimeEstimateMachine() {
+    delete simulator_;
+}
+
+bool TimeEstimateMachine::Init(const PnPConfig *config,
+                               const std::string &init_comment,
+                               const Dimension &dimension) {
+    delete simulator_;
+    simulator_ = new MotionSimulator(config);
+    picks_ = dispense_count_ = 0;
+    output_->Printf("# %s\n", init_comment.c_str());
+    return gcode_.Init(config, init_comment, dimension);
+}
+
+void TimeEstimateMachine::PickPart(const Part &part, const Tape *tape,
+                                   int nozzle) {
+    if (tape) ++picks_;
+    gcode_.PickPart(part, tape, nozzle);
+}
+
+void TimeEstimateMachine::PlacePart(const Part &part, const Tape *tape,
+                                    int nozzle) {
+    gcode_.PlacePart(part, tape, nozzle);
+}
+
+void TimeEstimateMachine::Dispense(const Part &part, const Pad &pad) {
+    ++dispense_count_;
+    gcode_.Dispense(part, pad);
+}
+
+void TimeEstimateMachine::DispenseStroke(const Part &part,
+                                         const std::vector<const Pad *> &row) {
+    dispense_count_ += row.size();
+    gcode_.DispenseStroke(part, row);
+}
+
+void TimeEstimateMachine::Execute(const MachineOp *ops, size_t count) {
+    for (const MachineOp *op = ops; op < ops + count; ++op) {
+        switch (op->type) {
+        case MachineOp::PICK:
+            if (op->tape) ++picks_;
+            break;
+        case MachineOp::DISPENSE:
+            ++dispense_count_;
+            break;
+        case MachineOp::DISPENSE_STROKE:
+            dispense_count_ += op->row->size();
+            break;
+        default:
+            break;
+        }
+    }
+    gcode_.Execute(ops, count);
+}
+
+void TimeEstimateMachine::Finish() {
+    gcode_.Finish();
+    simulator_->Flush();
+    const double total = simulator_->total_time();
+    const long seconds = lround(total);
+    output_->Printf("Estimated time: %8.1fs (%ld:%02ld min)\n", total,
+                    seconds / 60, seconds % 60);
+    for (int p = 0; p < MotionSimulator::NUM_PHASES; ++p) {
+        const MotionSimulator::Phase phase = (MotionSimulator::Phase) p;
+        const double t = simulator_->time(phase);
+        output_->Printf("  %-10s %8.1fs %5.1f%%\n",
+                        MotionSimulator::PhaseName(phase), t,
+                        total > 0 ? 100.0 * t / total : 0.0);
+    }
+    if (picks_ > 0) {
+        output_->Printf("%d parts; %.2fs per part.\n",
+                        picks_, total / picks_);
+    }
+    if (dispense_count_ > 0) {
+        output_->Printf("%d pads; %.3fs per pad.\n",
+                        dispense_count_, total / dispense_count_);
+    }
+    output_->Sync();
+}
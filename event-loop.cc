@@ -0,0 +1,83 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) h.zeller@acm.org. Free Software. GNU Public License v3.0 and above
+ */
+
+#include "event-loop.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+EventLoop::EventLoop()
+    : epoll_fd_(epoll_create1(EPOLL_CLOEXEC)),
+      timer_fd_(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)),
+      event_count_(0) {
+    if (epoll_fd_ < 0 || timer_fd_ < 0) {
+        perror("Creating event loop");
+        return;
+    }
+    Watch(timer_fd_, EPOLLIN);
+}
+
+EventLoop::~EventLoop() {
+    if (timer_fd_ >= 0) close(timer_fd_);
+    if (epoll_fd_ >= 0) close(epoll_fd_);
+}
+
+bool EventLoop::Watch(int fd, uint32_t events) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.fd = fd;
+    if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev) == 0)
+        return true;
+    if (errno == EEXIST && epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, fd, &ev) == 0)
+        return true;
+    perror("Watching file descriptor");
+    return false;
+}
+
+void EventLoop::Unwatch(int fd) {
+    epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, NULL);
+}
+
+int EventLoop::WaitMicros(int64_t timeout_us) {
+    event_count_ = 0;
+    int epoll_timeout = -1;
+    if (timeout_us == 0) {
+        epoll_timeout = 0;   // Just look; a timerfd can't do zero.
+    } else if (timeout_us > 0) {
+        struct itimerspec spec;
+        memset(&spec, 0, sizeof(spec));
+        spec.it_value.tv_sec = timeout_us / 1000000;
+        spec.it_value.tv_nsec = (timeout_us % 1000000) * 1000;
+        timerfd_settime(timer_fd_, 0, &spec, NULL);
+    }
+
+    const int count = epoll_wait(epoll_fd_, events_, kMaxEvents,
+                                 epoll_timeout);
+    if (timeout_us > 0) {
+        const struct itimerspec disarm = {};
+        timerfd_settime(timer_fd_, 0, &disarm, NULL);
+        uint64_t expirations;
+        read(timer_fd_, &expirations, sizeof(expirations));
+    }
+    if (count < 0)
+        return errno == EINTR ? 0 : -1;
+
+    bool anything_ready = false;
+    for (int i = 0; i < count; ++i) {
+        if (events_[i].data.fd != timer_fd_) anything_ready = true;
+    }
+    event_count_ = count;
+    return anything_ready ? 1 : 0;
+}
+
+uint32_t EventLoop::ready(int fd) const {
+    for (int i = 0; i < event_count_; ++i) {
+        if (events_[i].data.fd == fd) return events_[i].events;
+    }
+    return 0;
+}
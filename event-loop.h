@@ -0,0 +1,51 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) h.zeller@acm.org. Free Software. GNU Public License v3.0 and above
+ *
+ * Waiting for file descriptors.
+ */
+
+#ifndef PNP_EVENT_LOOP_H
+#define PNP_EVENT_LOOP_H
+
+#include <stdint.h>
+#include <sys/epoll.h>
+
+// Waits for a set of non-blocking file descriptors (serial lines, sockets,
+// eventfds) to become ready, based on epoll. Timeouts are measured with a
+// timerfd in the same epoll set.
+class EventLoop {
+public:
+    EventLoop();
+    ~EventLoop();
+
+    // Watch "fd" for "events" (EPOLLIN, EPOLLOUT); replaces the events
+    // if it is watched already. Returns 'false' on error.
+    bool Watch(int fd, uint32_t events);
+
+    // Stop watching "fd".
+    void Unwatch(int fd);
+
+    // Wait until any of the watched descriptors is ready, at most
+    // "timeout_ms", or forever with -1.
+    // Returns 1 if something is ready, 0 on timeout or interrupt, -1 on
+    // error.
+    int Wait(int timeout_ms) {
+        return WaitMicros(timeout_ms < 0 ? -1 : (int64_t) timeout_ms * 1000);
+    }
+
+    // Same, with the timeout in microseconds.
+    int WaitMicros(int64_t timeout_us);
+
+    // After Wait(): the events "fd" is ready for; 0 if none.
+    uint32_t ready(int fd) const;
+
+private:
+    static const int kMaxEvents = 8;
+
+    const int epoll_fd_;
+    const int timer_fd_;
+    struct epoll_event events_[kMaxEvents];
+    int event_count_;
+};
+
+#endif  // PNP_EVENT_LOOP_H
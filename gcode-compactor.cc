@@ -0,0 +1,221 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) h.zeller@acm.org. Free Software. GNU Public License v3.0 and above
+ */
+
+#include "gcode-compactor.h"
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Commands that don't have any effect on positions or the distance mode.
+static bool IsStatelessCommand(char letter, int code) {
+    if (letter == 'G') return code == 4;
+    switch (code) {
+    case 42:    // set pin
+    case 106:   // fan (our dispense solenoid) on
+    case 107:   // .. and off
+    case 201:   // max acceleration
+    case 203:   // max feedrate
+    case 204:   // acceleration
+    case 302:   // cold extrusion
+    case 400:   // wait for moves
+        return true;
+    }
+    return false;
+}
+
+// Commands with a string argument; these we don't touch at all.
+static bool HasStringArgument(const char *line, size_t len) {
+    while (len && isspace(*line)) { ++line; --len; }
+    if (len < 2 || toupper(line[0]) != 'M') return false;
+    int code = 0;
+    for (size_t i = 1; i < len && isdigit(line[i]); ++i)
+        code = 10 * code + (line[i] - '0');
+    switch (code) {
+    case 23: case 28: case 30: case 32:    // SD card file names
+    case 117: case 118: case 928:          // Messages and logging
+        return true;
+    }
+    return false;
+}
+
+// Shorten a number in place: remove trailing zeros after the decimal point
+// and the negative sign of zero. Returns new length.
+static size_t ShortenNumber(char *number, size_t len) {
+    if (memchr(number, '.', len) != NULL) {
+        while (len > 0 && number[len - 1] == '0') --len;
+        if (len > 0 && number[len - 1] == '.') --len;
+    }
+    const bool negative = (len > 0 && number[0] == '-');
+    const char *digits = number + (negative ? 1 : 0);
+    const size_t digit_len = len - (negative ? 1 : 0);
+    if (digit_len == 0 || strspn(digits, "0.") >= digit_len) {
+        number[0] = '0';   // Empty or -0
+        return 1;
+    }
+    return len;
+}
+
+GCodeCompactor::GCodeCompactor() : bytes_in_(0), bytes_out_(0) {
+    Reset();
+}
+
+void GCodeCompactor::Reset() {
+    distance_mode_ = MODE_UNKNOWN;
+    metric_known_ = false;
+    ForgetPositions();
+}
+
+void GCodeCompactor::ForgetPositions() {
+    feedrate_.clear();
+    for (std::string &p : position_) p.clear();
+}
+
+bool GCodeCompactor::ParseWords(const char *line, size_t len) {
+    clean_.clear();
+    words_.clear();
+    const char *const end = line + len;
+    const char *pos = line;
+    while (pos < end) {
+        const char c = *pos;
+        if (c == ';' || c == '\n' || c == '\r') break;  // Rest is comment.
+        if (c == '(') {
+            // Our comments can contain parenthesized part names.
+            int depth = 0;
+            do {
+                if (*pos == '(') ++depth;
+                else if (*pos == ')') --depth;
+                ++pos;
+            } while (depth > 0 && pos < end);
+            continue;
+        }
+        if (isspace(c)) {
+            ++pos;
+            continue;
+        }
+        if (!isalpha(c)) return false;
+        Word w;
+        w.letter = toupper(c);
+        w.drop = false;
+        w.value_offset = clean_.size();
+        ++pos;
+        while (pos < end && isspace(*pos)) ++pos;
+        while (pos < end && (isdigit(*pos) || *pos == '.'
+                             || *pos == '-' || *pos == '+')) {
+            clean_.push_back(*pos++);
+        }
+        w.value_len = clean_.size() - w.value_offset;
+        if (w.value_len == 0) return false;   // Letter without number.
+        w.value_len = ShortenNumber(&clean_[w.value_offset], w.value_len);
+        clean_.resize(w.value_offset + w.value_len);
+        words_.push_back(w);
+    }
+    return true;
+}
+
+bool GCodeCompactor::Compact(const char *line, size_t len, std::string *out) {
+    bytes_in_ += len;
+    out->clear();
+    if (HasStringArgument(line, len)) {
+        out->append(line, len);
+        if (out->empty() || (*out)[out->size() - 1] != '\n')
+            out->push_back('\n');
+        bytes_out_ += out->size();
+        return true;
+    }
+    if (!ParseWords(line, len)) {
+        // Don't understand, so send unmodified and forget what we know.
+        out->append(line, len);
+        if (out->empty() || (*out)[out->size() - 1] != '\n')
+            out->push_back('\n');
+        Reset();
+        bytes_out_ += out->size();
+        return true;
+    }
+    if (words_.empty())
+        return false;   // Only comments.
+
+    // Find the command. With multiple commands in one line, we don't try to
+    // be smart, as their order matters.
+    int commands = 0;
+    const Word *command = NULL;
+    int code = -1;
+    for (const Word &w : words_) {
+        if (w.letter == 'G' || w.letter == 'M' || w.letter == 'T') {
+            ++commands;
+            command = &w;
+        }
+    }
+    if (commands == 1) {
+        const std::string value(clean_, command->value_offset,
+                                command->value_len);
+        if (value.find('.') == std::string::npos)
+            code = atoi(value.c_str());
+    }
+    const char letter = commands == 1 ? command->letter : 0;
+
+    bool is_move = false;
+    if (letter == 'G' && (code == 0 || code == 1)) {
+        is_move = true;
+        for (Word &w : words_) {
+            const std::string value(clean_, w.value_offset, w.value_len);
+            if (w.letter == 'F') {
+                if (value == feedrate_) w.drop = true;
+                feedrate_ = value;
+            }
+            else if (w.letter >= 'A' && w.letter <= 'Z' && w.letter != 'G') {
+                std::string &pos = position_[w.letter - 'A'];
+                if (distance_mode_ == MODE_ABSOLUTE) {
+                    if (value == pos) w.drop = true;
+                    pos = value;
+                } else {
+                    pos.clear();   // relative or unknown: don't know.
+                }
+            }
+        }
+    }
+    else if (letter == 'G' && (code == 90 || code == 91)
+             && words_.size() == 1) {
+        const DistanceMode mode = code == 90 ? MODE_ABSOLUTE : MODE_RELATIVE;
+        if (mode == distance_mode_)
+            return false;
+        distance_mode_ = mode;
+    }
+    else if (letter == 'G' && code == 21 && words_.size() == 1) {
+        if (metric_known_)
+            return false;
+        metric_known_ = true;
+    }
+    else if (letter == 'G' && code == 92 && words_.size() > 1) {
+        // Setting positions: now we know these axes exactly.
+        for (const Word &w : words_) {
+            if (w.letter == 'G' || w.letter < 'A' || w.letter > 'Z') continue;
+            position_[w.letter - 'A'].assign(clean_, w.value_offset,
+                                             w.value_len);
+        }
+    }
+    else if (commands == 1 && IsStatelessCommand(letter, code)) {
+        // Nothing to do.
+    }
+    else {
+        // Homing, multiple commands, unit or tool changes, unknown...
+        Reset();
+    }
+
+    size_t remaining = 0;
+    for (const Word &w : words_) {
+        if (w.drop) continue;
+        if (!out->empty()) out->push_back(' ');
+        out->push_back(w.letter);
+        out->append(clean_, w.value_offset, w.value_len);
+        ++remaining;
+    }
+    if (is_move && remaining == 1) {
+        out->clear();    // Only the G0/G1 left: not moving anywhere.
+        return false;
+    }
+    out->push_back('\n');
+    bytes_out_ += out->size();
+    return true;
+}
@@ -0,0 +1,72 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) h.zeller@acm.org. Free Software. GNU Public License v3.0 and above
+ *
+ * Reduce the number of bytes of G-Code by keeping track of the modal state.
+ */
+
+#ifndef PNP_GCODE_COMPACTOR_H
+#define PNP_GCODE_COMPACTOR_H
+
+#include <stddef.h>
+
+#include <string>
+#include <vector>
+
+// Compacts G-Code line by line, keeping track of the modal state of the
+// machine:
+//   - comments and superfluous whitespace are removed.
+//   - numbers lose trailing zeros ("10.000" -> "10").
+//   - F words are dropped if the feedrate did not change.
+//   - axis words of G0/G1 are dropped if the axis is already there.
+//   - G90/G91/G21 are dropped if that mode is already active.
+// Lines that have no effect anymore are dropped altogether.
+//
+// This is conservative: after anything not understood (e.g. homing, multiple
+// G-words in one line, tool change) the state is forgotten.
+class GCodeCompactor {
+public:
+    GCodeCompactor();
+
+    // Forget all the state; e.g. when starting to talk to a machine.
+    void Reset();
+
+    // Compact "line" of length "len" (with or without newline) and write
+    // the result, including newline, to "out". Returns false if the line
+    // doesn't have any effect and should not be sent.
+    bool Compact(const char *line, size_t len, std::string *out);
+
+    // Statistics: bytes given to Compact() and bytes it emitted.
+    size_t bytes_in() const { return bytes_in_; }
+    size_t bytes_out() const { return bytes_out_; }
+
+private:
+    enum DistanceMode { MODE_UNKNOWN, MODE_ABSOLUTE, MODE_RELATIVE };
+    static const int kLetters = 26;
+
+    struct Word {
+        char letter;
+        size_t value_offset, value_len;   // Number in clean_.
+        bool drop;
+    };
+
+    // Split the line without comments into words_. Returns false if it does
+    // not look like simple letter/number words.
+    bool ParseWords(const char *line, size_t len);
+    void ForgetPositions();
+
+    // Modal state. Axis positions and feedrate are kept in the shortened
+    // textual form as emitted; empty if unknown.
+    DistanceMode distance_mode_;
+    bool metric_known_;
+    std::string feedrate_;
+    std::string position_[kLetters];
+
+    // Re-used between calls.
+    std::string clean_;
+    std::vector<Word> words_;
+
+    size_t bytes_in_;
+    size_t bytes_out_;
+};
+
+#endif  // PNP_GCODE_COMPACTOR_H
@@ -35,16 +35,19 @@
 
 #include <assert.h>
 #include <math.h>
-#include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 
+#include <algorithm>
+
 #include "tape.h"
 #include "board.h"
 
+#include "gcode-streamer.h"
+#include "gcode-template.h"
 #include "pnp-config.h"
-#include "machine-connection.h"
+#include "output-sink.h"
 
 // TODO: most of these constants should be configurable or deduced from board/
 // configuration.
@@ -58,91 +61,159 @@
 // Ultimately, we want the placement operation be a bit spring-loaded.
 #define PNP_TAPE_THICK 0.0
 
+// Clearance above the touch-down position; the fast approach ends here
+// and the final slow descent starts.
+#define PNP_Z_CLEARANCE 1.0
+
 // Multiplication to get 360 degrees mapped to one turn. This is specific to
 // our stepper motor.
 #define PNP_ANGLE_FACTOR (50.34965 / 360)
 
-// Speeds in mm/s
-#define PNP_TO_TAPE_SPEED 1000      // moving needle to tape
-#define PNP_TO_BOARD_SPEED 100      // moving component from tape to board
-
-#define DISP_MOVE_SPEED 400         // move dispensing unit to next pad
-#define DISP_DISPENSE_SPEED 100     // speed when doing the dispensing down/up
-
 #define DISP_Z_DISPENSING_ABOVE 0.3      // Above board when dispensing
 #define DISP_Z_HOVER_ABOVE 2             // Above board when moving around
 #define DISP_Z_SEPARATE_DROPLET_ABOVE 5  // Above board right after dispensing.
 
-// All templates should be in a separate file somewhere so that we don't
-// have to compile.
-
-// TODO: The positional arguments are pretty fragile.
-
-// param: moving needle up.
-static const char *const gcode_preamble_safe_state = R"(
+// The G-Code templates for each step. Each template has a fixed set of
+// parameters that can be used as {name} placeholders in the text (see
+// gcode-template.h for formatting options). These are the built-in defaults;
+// they can be replaced by loading a template file, e.g. for a machine that
+// needs different commands.
+// Templates are compiled once, so sending them is cheap.
+enum TemplateId {
+    TEMPLATE_COMMENT,
+    TEMPLATE_PREAMBLE_SAFE_STATE,
+    TEMPLATE_PREAMBLE_HOMING,
+    TEMPLATE_PREAMBLE_DEFAULTS,
+    TEMPLATE_SET_ACCELERATION,
+    TEMPLATE_SET_Z_ACCELERATION,
+    TEMPLATE_PICK,
+    TEMPLATE_PLACE,
+    TEMPLATE_INIT_NOZZLE,
+    TEMPLATE_NOZZLE_VACUUM_OFF,
+    TEMPLATE_DISPENSE_MOVE,
+    TEMPLATE_DISPENSE_PASTE,
+    TEMPLATE_DISPENSE_STROKE,
+    TEMPLATE_FINISH,
+    TEMPLATE_QUICK_STOP,
+    NUM_TEMPLATES
+};
+
+struct TemplateDefinition {
+    const char *name;    // Section name in the template file.
+    const char *params;  // Parameters, in the order we pass them.
+    const char *text;    // Built-in default.
+};
+
+// Same order as TemplateId.
+static const TemplateDefinition kTemplates[NUM_TEMPLATES] = {
+    { "comment", "comment", "( {comment} )\n" },
+
+    { "preamble-safe-state", "", R"(
 M107       (turn off dispensing solenoid)
 M42 P6 S0  (turn off pnp vacuum)
-)";
+)" },
 
-static const char *const gcode_preamble_homing = R"(
+    { "preamble-homing", "", R"(
 G28 Y0     (Home y - away from holding bracket)
 G91 G1 Y-10 G90 (Printrbot simple specific, otherwise z-probe will not work)
 G28 X0     (Safe to home X now)
 G28 Z0     (.. and z)
-)";
+)" },
 
-static const char *const gcode_preamble_defaults = R"(
+    // z: height to move the needle out of the way.
+    { "preamble-defaults", "z", R"(
 G21        (set to mm)
 T1         (Use E1 extruder, our 'A' axis for PnP component rotation)
 M302       (cold extrusion override - because it is not actually an extruder)
 G90        (Use absolute positions in general)
 G92 E0     ('home' E axis)
 
-G1 Z%.1f E0 (Move needle out of way)
-)";
-
-// param: name, move-speed, x, y, zup, zdown, a, zup
-static const char *const gcode_pick = R"(
-( -- Pick %s -- )
-G0 F%d X%.3f Y%.3f Z%.3f E%.3f (Move over component to pick.)
-G1 Z%-6.2f   F4000 (move down on tape)
-G4                 (flush buffer)
-M42 P6 S255        (turn on suckage)
-G1 Z%-6.3f         (Move up a bit for travelling)
-)";
-
-// param: name, place-speed, x, y, zup, a, zdown, zup
-static const char *const gcode_place = R"(
-( -- Place %s -- )
-G0 F%d X%.3f Y%.3f Z%.3f E%.3f (Move component to place on board.)
-G1 Z%-6.3f F4000 (move down over board thickness)
-G4               (flush buffer.)
-M42 P6 S0        (turn off suckage)
-G4               (flush buffer.)
-M42 P8 S255      (blow)
+G1 Z{z:.1} E0 (Move needle out of way)
+)" },
+
+    // Acceleration of the motion profile; emitted whenever it changes.
+    { "set-acceleration", "acceleration",
+      "M204 S{acceleration:.0}     (Acceleration)\n" },
+    { "set-z-acceleration", "acceleration",
+      "M201 Z{acceleration:.0}     (Max Z-acceleration)\n" },
+
+    // The approach to the tape and board is blended into two moves the
+    // firmware planner can join without coming to a full stop: travel
+    // towards the target at travel height, then go down to a short
+    // clearance above it; vertically, or with Glide-Down configured,
+    // diagonally from start_x/start_y. Only the final touch-down is slow.
+    // The G4
+    // (wait for moves to finish) is only where the vacuum must not switch
+    // before we are all the way down.
+    // Positions are of the head, so that the chosen nozzle is at the target.
+    // The rotation "a" is already in units of the rotation axis.
+    { "pick",
+      "name nozzle feed start_x start_y z_axis z_travel a_axis a x y "
+      "z_clearance z_down z_feed vacuum_pin",
+      R"(
+( -- Pick {name} with nozzle {nozzle} -- )
+G0 F{feed} X{start_x:.3} Y{start_y:.3} {z_axis}{z_travel:.3} {a_axis}{a:.3} (Move towards component to pick.)
+G0 X{x:.3} Y{y:.3} {z_axis}{z_clearance:-6.3} (Down to right above component.)
+G1 {z_axis}{z_down:-6.2}   F{z_feed} (touch down on tape)
+G4                 (flush buffer: suck only when down)
+M42 P{vacuum_pin} S255        (turn on suckage)
+G1 {z_axis}{z_travel:-6.3}         (Move up a bit for travelling)
+)" },
+
+    { "place",
+      "name nozzle feed start_x start_y z_axis z_travel a_axis a x y "
+      "z_clearance z_down z_feed vacuum_pin blow_pin",
+      R"(
+( -- Place {name} with nozzle {nozzle} -- )
+G0 F{feed} X{start_x:.3} Y{start_y:.3} {z_axis}{z_travel:.3} {a_axis}{a:.3} (Move component towards board.)
+G0 X{x:.3} Y{y:.3} {z_axis}{z_clearance:-6.3} (Down to right above board.)
+G1 {z_axis}{z_down:-6.3} F{z_feed} (move down over board thickness)
+G4               (flush buffer: release only when down)
+M42 P{vacuum_pin} S0        (turn off suckage)
+M42 P{blow_pin} S255      (blow)
 G4 P40           (.. for 40ms)
-M42 P8 S0        (done.)
-G1 Z%-6.2f       (Move up)
-)";
-
-// move to new position, above board.
-// param: component-name, pad-name, x, y, hover-z
-static const char *const gcode_dispense_move = R"(
-( -- component %s, pad %s -- )
-G0 F%d X%.3f Y%.3f Z%.3f (move there)
-)";
-
-// Dispense paste.
-// param: z-dispense-height, wait-time-ms, area, z-separate-droplet
-static const char *const gcode_dispense_paste =
-    R"(G1 F%d Z%.2f  (Go down to dispense)
+M42 P{blow_pin} S0        (done.)
+G1 {z_axis}{z_travel:-6.2}       (Move up)
+)" },
+
+    // Additional nozzles or axes different from the E and Z of the preamble.
+    { "init-nozzle", "a_axis nozzle vacuum_pin z_axis z",
+      R"(G92 {a_axis}0     ('home' rotation of nozzle {nozzle})
+M42 P{vacuum_pin} S0  (turn off vacuum)
+G1 {z_axis}{z:.1}   (Move needle out of way)
+)" },
+
+    { "nozzle-vacuum-off", "vacuum_pin",
+      "M42 P{vacuum_pin} S0  (turn off vacuum)\n" },
+
+    // Move to new position, above board.
+    { "dispense-move", "component pad feed x y z", R"(
+( -- component {component}, pad {pad} -- )
+G0 F{feed} X{x:.3} Y{y:.3} Z{z:.3} (move there)
+)" },
+
+    // Dispense paste; we are above the pad.
+    { "dispense-paste", "z_feed z_dispense time_ms area z_separate",
+      R"(G1 F{z_feed} Z{z_dispense:.2}  (Go down to dispense)
 M106            (switch on fan=solenoid)
-G4 P%-5.1f       (Wait time dependent on area %.2f mm^2)
+G4 P{time_ms:-5.1}       (Wait time dependent on area {area:.2} mm^2)
 M107            (switch off solenoid)
-G1 Z%.2f        (high above to have paste separated)
-)";
+G1 Z{z_separate:.2}        (high above to have paste separated)
+)" },
+
+    // Dispense paste in a continuous stroke along a row of pads. We arrive
+    // above the first pad with dispense-move.
+    { "dispense-stroke",
+      "z_feed z_dispense time_ms stroke_feed x y pads z_separate",
+      R"(G1 F{z_feed} Z{z_dispense:.2}  (Go down to dispense)
+M106            (switch on fan=solenoid)
+G4 P{time_ms:-5.1}       (Wait to build up pressure)
+G1 F{stroke_feed} X{x:.3} Y{y:.3} (Stroke along {pads} pads)
+M107            (switch off solenoid)
+G1 Z{z_separate:.2}        (high above to have paste separated)
+)" },
 
-static const char *const gcode_finish = R"(
+    { "finish", "", R"(
 M107       (turn off dispensing solenoid)
 M42 P6 S0  (turn off pnp vacuum)
 G91        (we want to move z relative)
@@ -150,29 +221,158 @@ G1 Z10     (move above any obstacles)
 G90        (back to sane absolute position default)
 G28 X0 Y0  (Home x/y, but leave z clear)
 M84        (stop motors)
-)";
+)" },
+
+    // When interrupted: sent to the machine ahead of everything queued; the
+    // firmware needs to handle it right away (Marlin: EMERGENCY_PARSER).
+    // Followed by preamble-safe-state. Empty with grbl, see kGrblStop.
+    { "quick-stop", "", R"(
+M410       (quick stop: discard all planned moves)
+)" },
+};
+
+// How grbl stops right away: feed hold, then soft reset, which discards
+// everything received and planned. Realtime commands: no newline, no "ok".
+static const char kGrblStop[] = "!\x18";
+
+// Firmware macros (Marlin GCODE_MACROS): M810 to M819, each up to 50
+// characters with the commands separated by '|'.
+static const int kMaxMacroSlots = 10;
+static const size_t kMacroSize = 50;
+
+// The parameters of templates that change with every operation. Lines of
+// these templates that use none of them only depend on tape, nozzle or
+// configuration, so they are the same for many operations and can be sent
+// as firmware macro.
+static const struct {
+    TemplateId id;
+    const char *varying;
+} kMacroTemplates[] = {
+    { TEMPLATE_PICK, "name nozzle feed start_x start_y a x y" },
+    { TEMPLATE_PLACE, "name nozzle feed start_x start_y a x y" },
+    { TEMPLATE_DISPENSE_PASTE, "time_ms area" },
+    { TEMPLATE_DISPENSE_STROKE, "time_ms stroke_feed x y pads" },
+};
+
+// Bitmask of the "names" in the space separated list of "params".
+static uint64_t ParamMask(const char *params, const char *names) {
+    uint64_t mask = 0;
+    int index = 0;
+    for (const char *p = params; *p; /**/) {
+        const size_t len = strcspn(p, " ");
+        if (len) {
+            for (const char *n = names; *n; /**/) {
+                const size_t n_len = strcspn(n, " ");
+                if (n_len == len && strncmp(n, p, len) == 0)
+                    mask |= uint64_t(1) << index;
+                n += n_len;
+                n += strspn(n, " ");
+            }
+            ++index;
+        }
+        p += len;
+        p += strspn(p, " ");
+    }
+    return mask;
+}
+
+// Bitmask of the parameters of template "id" that change with every
+// operation; 0 if the template is not sent as macros.
+static uint64_t VaryingParams(int id) {
+    static const std::vector<uint64_t> masks = [] {
+        std::vector<uint64_t> result(NUM_TEMPLATES, 0);
+        for (const auto &m : kMacroTemplates) {
+            result[m.id] = ParamMask(kTemplates[m.id].params, m.varying);
+        }
+        return result;
+    }();
+    return masks[id];
+}
+
+// G-Code feedrate in mm/min for the given motion phase.
+static int FeedRate(const MotionProfile::Phase &phase) {
+    return roundf(60 * phase.speed);
+}
+
+// Rotational symmetry in degrees to be assumed for the part on that tape.
+static int SymmetryFor(const Part &part, const Tape *tape) {
+    return tape->symmetry() == Tape::kSymmetryAuto
+        ? part.PadSymmetry()
+        : tape->symmetry();
+}
+
+// Out of all the angles in [0..360) that are equivalent to "angle" given the
+// rotational "symmetry", choose the one closest to "reference" to minimize
+// rotation travel.
+static float ClosestEquivalentAngle(float angle, int symmetry,
+                                    float reference) {
+    float best = fmod(fmod(angle, 360.0) + 360.0, 360.0);
+    for (int step = symmetry; step < 360; step += symmetry) {
+        const float candidate = fmod(best + step, 360.0);
+        if (fabsf(candidate - reference) < fabsf(best - reference))
+            best = candidate;
+    }
+    return best;
+}
 
 GCodeMachine::GCodeMachine(
     std::function<void(const char *str, size_t len)> write_line,
     float init_ms, float area_ms)
-    : write_line_(std::move(write_line)), init_ms_(init_ms), area_ms_(area_ms),
-      config_(NULL), do_homing_(true) {}
+    : write_line_(std::move(write_line)), sink_(NULL), streamer_(NULL),
+      init_ms_(init_ms), area_ms_(area_ms), config_(NULL), do_homing_(true),
+      dry_run_(false), grbl_(false), failed_(false), compact_(false), templates_(NUM_TEMPLATES),
+      macro_run_lines_(0), macro_clock_(0), macro_calls_(0),
+      macro_lines_(0) {
+    for (int i = 0; i < NUM_TEMPLATES; ++i) {
+        const bool success = templates_[i].Compile(kTemplates[i].text,
+                                                   kTemplates[i].params);
+        assert(success);  // Error in built-in templates above.
+        (void) success;
+    }
+}
 
-GCodeMachine::GCodeMachine(FILE *output, float init_ms, float area_ms)
+GCodeMachine::GCodeMachine(
+    const GCodeMachine &prototype,
+    std::function<void(const char *str, size_t len)> write_line)
+    : write_line_(std::move(write_line)), sink_(NULL), streamer_(NULL),
+      init_ms_(prototype.init_ms_), area_ms_(prototype.area_ms_),
+      config_(NULL), do_homing_(prototype.do_homing_),
+      dry_run_(false), grbl_(prototype.grbl_), failed_(false),
+      compact_(prototype.compact_),
+      templates_(prototype.templates_), macros_(prototype.macros_.size()),
+      macro_run_lines_(0), macro_clock_(0), macro_calls_(0),
+      macro_lines_(0) {}
+
+GCodeMachine::GCodeMachine(OutputSink *output, float init_ms, float area_ms)
     : GCodeMachine([output](const char *str, size_t len) {
-            fwrite(str, 1, len, output);
-            fflush(output);
-        }, init_ms, area_ms) {}
+            output->Write(str, len);
+        }, init_ms, area_ms) {
+    sink_ = output;
+}
 
 
-GCodeMachine::GCodeMachine(int input_fd, int output_fd,
+GCodeMachine::GCodeMachine(GCodeStreamer *streamer,
                            float init_ms, float area_ms)
-    : GCodeMachine([input_fd, output_fd](const char *str, size_t len) {
+    : GCodeMachine([this, streamer](const char *str, size_t len) {
             if (len == 0 || *str == '\n' || *str == ';' || *str == '(')
                 return;  // Ignore empty lines or all-comment lines.
-            write(output_fd, str, len);
-            WaitForOkAck(input_fd);
+            if (!streamer->Send(str, len) && !streamer->interrupted())
+                failed_ = true;
         }, init_ms, area_ms) {
+    streamer_ = streamer;
+    compact_ = true;  // Every byte over the serial line costs time.
+}
+
+void GCodeMachine::set_macro_slots(int slots) {
+    macros_.assign(std::max(0, std::min(slots, kMaxMacroSlots)), Macro());
+    macro_candidates_.clear();
+}
+
+void GCodeMachine::set_grbl(bool grbl) {
+    grbl_ = grbl;
+    templates_[TEMPLATE_QUICK_STOP].Compile(
+        grbl ? "" : kTemplates[TEMPLATE_QUICK_STOP].text,
+        kTemplates[TEMPLATE_QUICK_STOP].params);
 }
 
 bool GCodeMachine::Init(const PnPConfig *config,
@@ -184,100 +384,454 @@ bool GCodeMachine::Init(const PnPConfig *config,
         fprintf(stderr, "Need configuration\n");
         return false;
     }
-    fprintf(stderr, "Board-thickness = %.1fmm\n",
-            config_->board.top - config_->bed_level);
-    SendFormattedCommands("( %s )\n", init_comment.c_str());
+    if (!dry_run_) {
+        fprintf(stderr, "Board-thickness = %.1fmm\n",
+                config_->board.top - config_->bed_level);
+    }
+    compactor_.Reset();
+    SendFormattedCommands(TEMPLATE_COMMENT, init_comment.c_str());
     float highest_tape = config_->board.top;
-    for (const auto &t : config_->tape_for_component) {
-        highest_tape = std::max(highest_tape, t.second->height());
+    for (const auto &tapes : config_->tape_for_component) {
+        for (const Tape *t : tapes.second) {
+            highest_tape = std::max(highest_tape, t->height());
+        }
     }
-    SendFormattedCommands(gcode_preamble_safe_state);
-    if (do_homing_) SendFormattedCommands(gcode_preamble_homing);
-    SendFormattedCommands(gcode_preamble_defaults, highest_tape + 10);
+    SendFormattedCommands(TEMPLATE_PREAMBLE_SAFE_STATE);
+    if (do_homing_) SendFormattedCommands(TEMPLATE_PREAMBLE_HOMING);
+    SendFormattedCommands(TEMPLATE_PREAMBLE_DEFAULTS, highest_tape + 10);
+    const NozzleConfig default_nozzle;
+    for (size_t i = 0; i < config_->nozzles.size(); ++i) {
+        const NozzleConfig &n = config_->nozzles[i];
+        if (i == 0 && n.rotation_axis == default_nozzle.rotation_axis
+            && n.z_axis == default_nozzle.z_axis
+            && n.vacuum_pin == default_nozzle.vacuum_pin)
+            continue;  // Already taken care of in preamble.
+        SendFormattedCommands(TEMPLATE_INIT_NOZZLE, n.rotation_axis.c_str(),
+                              (int)i, n.vacuum_pin, n.z_axis.c_str(),
+                              highest_tape + 10);
+    }
+    state_ = State();
+    state_.current_angle.assign(config_->nozzles.size(), 0);
+    state_.last_pos_known = false;  // Homing might move anywhere.
     return true;
 }
 
-void GCodeMachine::PickPart(const Part &part, const Tape *tape) {
+void GCodeMachine::Resume(const PnPConfig *config, const State &state) {
+    config_ = config;
+    state_ = state;
+    compactor_.Reset();
+}
+
+struct GCodeMachine::RunConstants {
+    float board_thick;
+    float dispense_hover_z;      // Absolute heights while dispensing.
+    float dispense_z;
+    float dispense_separate_z;
+    const MotionProfile *dispense_profile;
+    int dispense_travel_feed;
+    int dispense_descent_feed;
+    int dispense_max_stroke_feed;
+};
+
+GCodeMachine::RunConstants GCodeMachine::ComputeRunConstants() const {
+    RunConstants c;
+    c.board_thick = config_->board.top - config_->bed_level;
+    c.dispense_hover_z = config_->board.top + DISP_Z_HOVER_ABOVE;
+    c.dispense_z = config_->board.top + DISP_Z_DISPENSING_ABOVE;
+    c.dispense_separate_z = config_->board.top + DISP_Z_SEPARATE_DROPLET_ABOVE;
+    c.dispense_profile = &config_->dispense_profile();
+    c.dispense_travel_feed = FeedRate(c.dispense_profile->travel);
+    c.dispense_descent_feed = FeedRate(c.dispense_profile->descent);
+    c.dispense_max_stroke_feed = FeedRate(c.dispense_profile->loaded);
+    return c;
+}
+
+const char *GCodeMachine::PrintName(const Part &part) {
+    name_buffer_.assign(part.component_name);
+    name_buffer_.append(" (").append(part.footprint)
+        .append("@").append(part.value).append(")");
+    return name_buffer_.c_str();
+}
+
+void GCodeMachine::PickPart(const Part &part, const Tape *tape, int nozzle) {
+    EmitPick(ComputeRunConstants(), part, tape, nozzle);
+}
+
+void GCodeMachine::PlacePart(const Part &part, const Tape *tape, int nozzle) {
+    EmitPlace(ComputeRunConstants(), part, tape, nozzle);
+}
+
+void GCodeMachine::Dispense(const Part &part, const Pad &pad) {
+    EmitDispense(ComputeRunConstants(), part, pad);
+}
+
+void GCodeMachine::DispenseStroke(const Part &part,
+                                  const std::vector<const Pad *> &row) {
+    EmitDispenseStroke(ComputeRunConstants(), part, row);
+}
+
+void GCodeMachine::Execute(const MachineOp *ops, size_t count) {
+    const RunConstants c = ComputeRunConstants();
+    for (const MachineOp *op = ops; op < ops + count; ++op) {
+        switch (op->type) {
+        case MachineOp::PICK:
+            EmitPick(c, *op->part, op->tape, op->nozzle);
+            break;
+        case MachineOp::PLACE:
+            EmitPlace(c, *op->part, op->tape, op->nozzle);
+            break;
+        case MachineOp::DISPENSE:
+            EmitDispense(c, *op->part, *op->pad);
+            break;
+        case MachineOp::DISPENSE_STROKE:
+            EmitDispenseStroke(c, *op->part, *op->row);
+            break;
+        }
+    }
+}
+
+void GCodeMachine::EmitPick(const RunConstants &c,
+                            const Part &part, const Tape *tape, int nozzle) {
     if (tape == NULL) return;
     float px, py;
     if (!tape->GetPos(&px, &py)) {
-        fprintf(stderr, "We are out of components for %s %s\n",
+        if (!dry_run_) fprintf(stderr, "We are out of components for %s %s\n",
                 part.footprint.c_str(), part.value.c_str());
         return;
     }
+    assert(nozzle >= 0 && nozzle < (int)config_->nozzles.size());
+    const NozzleConfig &n = config_->nozzles[nozzle];
+
+    const float travel_height = tape->height() + c.board_thick + PNP_Z_HOVERING;
 
-    const float board_thick = config_->board.top - config_->bed_level;
-    const float travel_height = tape->height() + board_thick + PNP_Z_HOVERING;
-    const std::string print_name = part.component_name + " ("
-        + part.footprint + "@" + part.value + ")";
+    const float pick_angle = ClosestEquivalentAngle(
+        tape->angle(), SymmetryFor(part, tape), state_.current_angle[nozzle]);
+    state_.current_angle[nozzle] = pick_angle;
 
-    // param: name, x, y, zdown, a, zup
+    const MotionProfile &profile = ProfileFor(tape);
+    SetAcceleration(profile.travel, profile.descent);
+
+    const Position head_pos = Position(px, py) - n.offset;
+    const Position descent_start = DescentStart(head_pos);
+    state_.last_pos = head_pos;
+    state_.last_pos_known = true;
+
+    if (dry_run_) return;   // Only the state matters.
+    const char *z = n.z_axis.c_str();
     SendFormattedCommands(
-        gcode_pick,
-        print_name.c_str(),
-        60 * PNP_TO_TAPE_SPEED,
-        px, py, tape->height() + PNP_Z_HOVERING,     // component pos.
-        PNP_ANGLE_FACTOR * fmod(tape->angle(), 360.0),   // pickup angle
+        TEMPLATE_PICK,
+        PrintName(part), nozzle,
+        FeedRate(profile.travel),
+        descent_start.x, descent_start.y, z, travel_height,
+        n.rotation_axis.c_str(), PNP_ANGLE_FACTOR * pick_angle,
+        head_pos.x, head_pos.y,                      // component pos.
+        tape->height() + PNP_Z_CLEARANCE,
         tape->height(),                              // down to component
-        travel_height);                              // up for travel.
+        FeedRate(profile.descent),
+        n.vacuum_pin);
 }
 
-void GCodeMachine::PlacePart(const Part &part, const Tape *tape) {
+void GCodeMachine::EmitPlace(const RunConstants &c,
+                             const Part &part, const Tape *tape, int nozzle) {
     if (tape == NULL) return;
-    const float board_thick = config_->board.top - config_->bed_level;
-    const float travel_height = tape->height() + board_thick + PNP_Z_HOVERING;
-    const std::string print_name = part.component_name + " ("
-        + part.footprint + "@" + part.value + ")";
-
-    // param: name, x, y, zup, a, zdown, zup
+    assert(nozzle >= 0 && nozzle < (int)config_->nozzles.size());
+    const NozzleConfig &n = config_->nozzles[nozzle];
+    const float travel_height = tape->height() + c.board_thick + PNP_Z_HOVERING;
+    const float place_angle = ClosestEquivalentAngle(
+        part.angle - tape->angle(), SymmetryFor(part, tape),
+        state_.current_angle[nozzle]);
+    state_.current_angle[nozzle] = place_angle;
+
+    const MotionProfile &profile = ProfileFor(tape);
+    SetAcceleration(profile.loaded, profile.descent);
+
+    const float place_height = tape->height() + c.board_thick - PNP_TAPE_THICK;
+    const Position head_pos = config_->board.origin + part.pos - n.offset;
+    const Position descent_start = DescentStart(head_pos);
+    state_.last_pos = head_pos;
+    state_.last_pos_known = true;
+
+    if (dry_run_) return;
+    const char *z = n.z_axis.c_str();
     SendFormattedCommands(
-        gcode_place,
-        print_name.c_str(),
-        60 * PNP_TO_BOARD_SPEED,
-        part.pos.x + config_->board.origin.x,
-        part.pos.y + config_->board.origin.y,
-        travel_height,
-        PNP_ANGLE_FACTOR * fmod(part.angle - tape->angle() + 360, 360.0),
-        tape->height() + board_thick - PNP_TAPE_THICK,
-        travel_height);
-}
-
- void GCodeMachine::Dispense(const Part &part, const Pad &pad) {
-     const Position pad_pos = config_->board.origin + part.padAbsPos(pad);
-     const float area = pad.size.w * pad.size.h;
-     SendFormattedCommands(gcode_dispense_move,
-                           part.component_name.c_str(), pad.name.c_str(),
-                           DISP_MOVE_SPEED * 60,
-                           pad_pos.x, pad_pos.y,
-                           config_->board.top + DISP_Z_HOVER_ABOVE);
-     SendFormattedCommands(gcode_dispense_paste, DISP_DISPENSE_SPEED * 60,
-                           config_->board.top + DISP_Z_DISPENSING_ABOVE,
-                           init_ms_ + area * area_ms_, area,
-                           config_->board.top + DISP_Z_SEPARATE_DROPLET_ABOVE);
+        TEMPLATE_PLACE,
+        PrintName(part), nozzle,
+        FeedRate(profile.loaded),
+        descent_start.x, descent_start.y, z, travel_height,
+        n.rotation_axis.c_str(), PNP_ANGLE_FACTOR * place_angle,
+        head_pos.x, head_pos.y,
+        place_height + PNP_Z_CLEARANCE,
+        place_height,
+        FeedRate(profile.descent),
+        n.vacuum_pin, n.blow_pin);
+}
+
+void GCodeMachine::EmitDispense(const RunConstants &c,
+                                const Part &part, const Pad &pad) {
+    const MotionProfile &profile = *c.dispense_profile;
+    SetAcceleration(profile.travel, profile.descent);
+    if (dry_run_) return;
+    const Position pad_pos = config_->board.origin + part.padAbsPos(pad);
+    const float area = pad.size.w * pad.size.h;
+    SendFormattedCommands(TEMPLATE_DISPENSE_MOVE,
+                          part.component_name.c_str(), pad.name.c_str(),
+                          c.dispense_travel_feed,
+                          pad_pos.x, pad_pos.y, c.dispense_hover_z);
+    SendFormattedCommands(TEMPLATE_DISPENSE_PASTE,
+                          c.dispense_descent_feed, c.dispense_z,
+                          init_ms_ + area * area_ms_, area,
+                          c.dispense_separate_z);
+}
+
+void GCodeMachine::EmitDispenseStroke(const RunConstants &c, const Part &part,
+                                      const std::vector<const Pad *> &row) {
+    assert(!row.empty());
+    const MotionProfile &profile = *c.dispense_profile;
+    SetAcceleration(profile.travel, profile.descent);
+    if (dry_run_) return;
+
+    const Pad &first = *row.front();
+    const Pad &last = *row.back();
+    const Position start = config_->board.origin + part.padAbsPos(first);
+    const Position end = config_->board.origin + part.padAbsPos(last);
+    const float area = first.size.w * first.size.h;
+
+    // Same amount of paste as the individual dots would get, but the
+    // initial pressure build-up is only needed once. The time to dispense
+    // all the area is spread over the length of the stroke.
+    // Without time for the area, the stroke goes as fast as it can.
+    const float stroke_ms = row.size() * area * area_ms_;
+    const float length = Distance(start, end);
+    int stroke_speed = c.dispense_max_stroke_feed;
+    if (stroke_ms > 0) {
+        const float speed = length / (stroke_ms / 60000.0);
+        if (speed < stroke_speed)
+            stroke_speed = std::max(1, (int) roundf(speed));
+    }
+
+    name_buffer_.assign(first.name).append("..").append(last.name);
+    SendFormattedCommands(TEMPLATE_DISPENSE_MOVE,
+                          part.component_name.c_str(), name_buffer_.c_str(),
+                          c.dispense_travel_feed,
+                          start.x, start.y, c.dispense_hover_z);
+    SendFormattedCommands(TEMPLATE_DISPENSE_STROKE,
+                          c.dispense_descent_feed, c.dispense_z,
+                          init_ms_, stroke_speed, end.x, end.y,
+                          (int) row.size(), c.dispense_separate_z);
+}
+
+Position GCodeMachine::DescentStart(const Position &target) const {
+    const float glide = config_->glide_distance;
+    if (glide <= 0 || !state_.last_pos_known)
+        return target;   // Descend vertically.
+    const float distance = Distance(state_.last_pos, target);
+    if (distance <= glide)
+        return state_.last_pos;
+    const float fraction = (distance - glide) / distance;
+    return Position(state_.last_pos.x + fraction * (target.x - state_.last_pos.x),
+                    state_.last_pos.y + fraction * (target.y - state_.last_pos.y));
+}
+
+const MotionProfile &GCodeMachine::ProfileFor(const Tape *tape) const {
+    return tape->motion_profile() ? *tape->motion_profile()
+                                  : config_->default_profile();
+}
+
+void GCodeMachine::SetAcceleration(const MotionProfile::Phase &xy,
+                                   const MotionProfile::Phase &z) {
+    // Phases without acceleration inherit the one of the default profile;
+    // the configuration makes sure it has one if any other phase has.
+    const MotionProfile &defaults = config_->default_profile();
+    const float xy_accel = xy.acceleration > 0
+        ? xy.acceleration : defaults.travel.acceleration;
+    const float z_accel = z.acceleration > 0
+        ? z.acceleration : defaults.descent.acceleration;
+    if (xy_accel > 0 && xy_accel != state_.current_acceleration) {
+        SendFormattedCommands(TEMPLATE_SET_ACCELERATION, xy_accel);
+        state_.current_acceleration = xy_accel;
+    }
+    if (z_accel > 0 && z_accel != state_.current_z_acceleration) {
+        SendFormattedCommands(TEMPLATE_SET_Z_ACCELERATION, z_accel);
+        state_.current_z_acceleration = z_accel;
+    }
 }
 
 void GCodeMachine::Finish() {
-    SendFormattedCommands(gcode_finish);
-}
-
-void GCodeMachine::SendFormattedCommands(const char *format, ...) {
-    char *buffer = NULL;
-    va_list ap;
-    va_start(ap, format);
-    int len = vasprintf(&buffer, format, ap);
-    va_end(ap);
-
-    // Now we have a buffer that we can send line-by-line. The write function
-    // is owned by the caller, so they can implement e.g. flow control.
-    const char *pos = buffer;
-    const char *end = buffer + len;
-    while (pos < end) {
-        const char *eol = strchrnul(pos, '\n');
-        // If a formatting string does not have a \n at the end of a line,
-        // this is not allowed as we want to send full lines to write_line_().
-        assert(*eol != '\0');  // error in templates above.
-        write_line_(pos, eol - pos + 1);
-        pos = eol + 1;
+    for (const NozzleConfig &n : config_->nozzles) {
+        if (n.vacuum_pin != NozzleConfig().vacuum_pin)
+            SendFormattedCommands(TEMPLATE_NOZZLE_VACUUM_OFF, n.vacuum_pin);
+    }
+    SendFormattedCommands(TEMPLATE_FINISH);
+    if (sink_) sink_->Sync();
+    if (streamer_) {
+        if (!failed_ && !streamer_->Flush()) {
+            if (streamer_->interrupted()) {
+                // Interrupted while the machine works off what is queued.
+                Abort();
+                return;
+            }
+            failed_ = true;
+        }
+        if (failed_) {
+            fprintf(stderr, "Sending G-Code to the machine failed; "
+                    "the job is incomplete.\n");
+            return;
+        }
+        streamer_->stats()->Print(stderr);
+    }
+    if (compact_ && compactor_.bytes_in() > 0) {
+        fprintf(stderr, "Compacted G-Code: %zu bytes instead of %zu "
+                "(%.0f%%)\n", compactor_.bytes_out(), compactor_.bytes_in(),
+                100.0 * compactor_.bytes_out() / compactor_.bytes_in());
+    }
+    if (macro_calls_ > 0) {
+        fprintf(stderr, "Firmware macros: %ld calls instead of %ld lines\n",
+                macro_calls_, macro_lines_);
+    }
+}
+
+void GCodeMachine::Abort() {
+    if (!streamer_) {
+        Finish();   // A file is complete nevertheless.
+        return;
+    }
+    std::string stop = grbl_ ? kGrblStop : "";
+    const GCodeTemplate &tmpl = templates_[TEMPLATE_QUICK_STOP];
+    for (size_t i = 0; i < tmpl.line_count(); ++i) {
+        tmpl.ExpandLine(i, NULL, &line_buffer_);
+        if (compactor_.Compact(line_buffer_.data(), line_buffer_.size(),
+                               &compact_buffer_)) {
+            stop.append(compact_buffer_);
+        }
+    }
+    streamer_->Abort(stop);
+    compactor_.Reset();   // Where the machine stopped is anyone's guess.
+    for (Macro &m : macros_) {
+        m.body.clear();   // Definitions might not have been sent.
+    }
+
+    SendFormattedCommands(TEMPLATE_PREAMBLE_SAFE_STATE);
+    for (const NozzleConfig &n : config_->nozzles) {
+        if (n.vacuum_pin != NozzleConfig().vacuum_pin)
+            SendFormattedCommands(TEMPLATE_NOZZLE_VACUUM_OFF, n.vacuum_pin);
+    }
+    if (!streamer_->Flush() && !streamer_->interrupted()) {
+        failed_ = true;
+        fprintf(stderr, "Sending G-Code to the machine failed; "
+                "it might not be in a safe state.\n");
+        return;
+    }
+    streamer_->stats()->Print(stderr);
+}
+
+bool GCodeMachine::LoadTemplates(const char *filename) {
+    return ReadTemplateFile(
+        filename, [this, filename](const std::string &name,
+                                   const std::string &text) {
+            for (int i = 0; i < NUM_TEMPLATES; ++i) {
+                if (name != kTemplates[i].name)
+                    continue;
+                if (!templates_[i].Compile(text, kTemplates[i].params)) {
+                    fprintf(stderr, "%s: Error in template [%s]\n",
+                            filename, name.c_str());
+                    return false;
+                }
+                return true;
+            }
+            fprintf(stderr, "%s: Unknown template [%s]\n",
+                    filename, name.c_str());
+            return false;
+        });
+}
+
+void GCodeMachine::PrintDefaultTemplates(FILE *out) {
+    fprintf(out, "# G-Code templates. Each starts with a [name] line, all "
+            "lines up to the next\n"
+            "# template are sent to the machine. Parameters are used as "
+            "{name} or\n"
+            "# {name:[-][width][.precision]}, e.g. {x:.3}. Templates not "
+            "given in this\n"
+            "# file keep their built-in default. Lines starting with '#' "
+            "are ignored.\n");
+    for (const TemplateDefinition &t : kTemplates) {
+        fprintf(out, "#\n# Parameters: %s\n[%s]\n%s",
+                t.params[0] ? t.params : "(none)", t.name, t.text);
+    }
+}
+
+void GCodeMachine::SendExpanded(int template_id,
+                                const GCodeTemplate::Arg *args,
+                                size_t arg_count) {
+    assert(template_id >= 0 && template_id < NUM_TEMPLATES);
+    const GCodeTemplate &tmpl = templates_[template_id];
+    assert(arg_count == tmpl.param_count());  // error in calls above.
+    if (dry_run_) return;
+    // Send line-by-line. The write function is owned by the caller, so they
+    // can implement e.g. flow control. The line buffer is re-used, so no
+    // allocation once it has grown to the longest line.
+    const uint64_t varying = (compact_ && !macros_.empty())
+        ? VaryingParams(template_id) : 0;
+    for (size_t i = 0; i < tmpl.line_count(); ++i) {
+        tmpl.ExpandLine(i, args, &line_buffer_);
+        if (!compact_) {
+            write_line_(line_buffer_.data(), line_buffer_.size());
+            continue;
+        }
+        if (!compactor_.Compact(line_buffer_.data(), line_buffer_.size(),
+                                &compact_buffer_)) {
+            continue;
+        }
+        if (varying && (tmpl.line_params(i) & varying) == 0) {
+            // Same for many operations; collect for a macro. With '|'
+            // instead of the newlines, this is the length of the body.
+            if (macro_run_lines_ > 0
+                && macro_run_.size() + compact_buffer_.size() - 1 > kMacroSize)
+                FlushMacroRun();
+            macro_run_.append(compact_buffer_);
+            ++macro_run_lines_;
+        } else {
+            FlushMacroRun();
+            write_line_(compact_buffer_.data(), compact_buffer_.size());
+        }
+    }
+    FlushMacroRun();
+}
+
+void GCodeMachine::FlushMacroRun() {
+    if (macro_run_lines_ == 0)
+        return;
+    int slot = -1;
+    if (macro_run_lines_ > 1 && macro_run_.size() - 1 <= kMacroSize) {
+        for (size_t i = 0; i < macros_.size(); ++i) {
+            if (macros_[i].body == macro_run_) slot = i;
+        }
+        // Only worth a definition if we see it again.
+        if (slot < 0 && !macro_candidates_.insert(macro_run_).second) {
+            slot = 0;   // Replace the one least recently used.
+            for (size_t i = 1; i < macros_.size(); ++i) {
+                if (macros_[i].last_use < macros_[slot].last_use) slot = i;
+            }
+            macros_[slot].body = macro_run_;
+            std::string definition = "M81" + std::to_string(slot) + " ";
+            definition.append(macro_run_, 0, macro_run_.size() - 1);
+            std::replace(definition.begin(), definition.end(), '\n', '|');
+            definition.append("\n");
+            write_line_(definition.data(), definition.size());
+        }
+    }
+    if (slot >= 0) {
+        macros_[slot].last_use = ++macro_clock_;
+        const std::string call = "M81" + std::to_string(slot) + "\n";
+        write_line_(call.data(), call.size());
+        ++macro_calls_;
+        macro_lines_ += macro_run_lines_;
+    } else {
+        for (size_t pos = 0; pos < macro_run_.size(); /**/) {
+            const size_t end = macro_run_.find('\n', pos) + 1;
+            write_line_(macro_run_.data() + pos, end - pos);
+            pos = end;
+        }
     }
-    free(buffer);
+    macro_run_.clear();
+    macro_run_lines_ = 0;
 }
@@ -0,0 +1,572 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) h.zeller@acm.org. Free Software. GNU Public License v3.0 and above
+ */
+
+#include "gcode-streamer.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <functional>
+
+#include "event-loop.h"
+#include "machine-connection.h"
+
+// Bytes of lines queued for the I/O thread.
+static const size_t kQueueSize = 1 << 16;
+
+// If the machine stays quiet that long while lines are in flight, the last
+// one might have been lost. A lost line is only noticed by the machine when
+// another one arrives, so the last one goes out once more.
+static const int kQuietMs = 2000;
+
+// Smallest line on the wire is something like "G4\n"; the ring buffer
+// needs to hold as many lines as can be in the window, plus the one waiting.
+static size_t RingSizeFor(size_t window) {
+    const size_t needed = window / 3 + 2;
+    size_t size = 16;
+    while (size < needed) size *= 2;
+    return size;
+}
+
+GCodeStreamer::GCodeStreamer(LineReader *machine, size_t window)
+    : machine_(machine), window_(window),
+      line_numbers_(false), lines_(RingSizeFor(window)),
+      first_unconfirmed_(0), next_send_(0), next_number_(0),
+      in_flight_bytes_(0), resend_from_(-1), repeats_expected_(0),
+      copied_line_(-1), skip_ok_(false), ok_(true), interrupted_(NULL),
+      ring_(NULL),
+      io_thread_(NULL),
+      io_loop_(NULL), producer_loop_(NULL),
+      work_event_(-1), progress_event_(-1), io_waiting_(false),
+      producer_waiting_(false), flush_done_(false),
+      abort_requested_(false), abort_done_(false) {}
+
+GCodeStreamer::~GCodeStreamer() {
+    if (io_thread_) {
+        if (interrupted())
+            Abort("");   // Not waiting for the queued lines to go out.
+        while (!ring_->Push(RECORD_STOP, NULL, 0))
+            AwaitIOThread(HasRoom(0));
+        Wake(work_event_, &io_waiting_);
+        io_thread_->join();
+        delete io_thread_;
+        delete io_loop_;
+        delete producer_loop_;
+        close(work_event_);
+        close(progress_event_);
+    }
+    delete ring_;
+}
+
+void GCodeStreamer::set_line_numbers(bool on) {
+    line_numbers_ = on;
+    if (on) {
+        // Start counting; this is line 0, the next one line 1.
+        static const char kResetLineNumber[] = "M110 N0\n";
+        SendNow(kResetLineNumber, strlen(kResetLineNumber));
+    }
+}
+
+bool GCodeStreamer::StartIOThread() {
+    work_event_ = eventfd(0, EFD_NONBLOCK);
+    progress_event_ = eventfd(0, EFD_NONBLOCK);
+    if (work_event_ < 0 || progress_event_ < 0) {
+        perror("eventfd()");
+        return false;
+    }
+    io_loop_ = new EventLoop();
+    io_loop_->Watch(work_event_, EPOLLIN);
+    io_loop_->Watch(machine_->fd(), EPOLLIN);
+    producer_loop_ = new EventLoop();
+    producer_loop_->Watch(progress_event_, EPOLLIN);
+    ring_ = new SpscRing(kQueueSize);
+
+    // Signals go to the producer thread; they interrupt its waiting.
+    sigset_t all_signals, previous;
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_BLOCK, &all_signals, &previous);
+    io_thread_ = new std::thread(&GCodeStreamer::IOThread, this);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    return true;
+}
+
+bool GCodeStreamer::Send(const char *line, size_t len) {
+    if (!io_thread_) return SendNow(line, len);
+    if (SpscRing::RecordSize(len) > kQueueSize) {
+        fprintf(stderr, "Line too long for the machine: %.*s",
+                (int) len, line);
+        return false;
+    }
+    while (ok_ && !ring_->Push(RECORD_LINE, line, len)) {
+        if (interrupted()) return false;
+        AwaitIOThread(HasRoom(len));
+    }
+    Wake(work_event_, &io_waiting_);
+    return ok_;
+}
+
+bool GCodeStreamer::Flush() {
+    if (!io_thread_) return FlushNow();
+    flush_done_ = false;
+    while (!ring_->Push(RECORD_FLUSH, NULL, 0)) {
+        if (interrupted()) return false;
+        AwaitIOThread(HasRoom(0));
+    }
+    Wake(work_event_, &io_waiting_);
+    while (!flush_done_ && ok_) {
+        if (interrupted()) return false;
+        AwaitIOThread([this]() { return flush_done_.load(); });
+    }
+    return ok_;
+}
+
+bool GCodeStreamer::Abort(const std::string &stop) {
+    interrupted_ = NULL;   // From now on, we wait again.
+    stop_command_ = stop;
+    if (!io_thread_) {
+        AbortNow();
+        return ok_;
+    }
+    abort_done_ = false;
+    abort_requested_ = true;
+    Wake(work_event_, &io_waiting_);
+    while (!abort_done_ && ok_)
+        AwaitIOThread([this]() { return abort_done_.load(); });
+    return ok_;
+}
+
+void GCodeStreamer::Wake(int event_fd, std::atomic<bool> *waiting) {
+    // Only if it needs it; this is a system call. The fence pairs with the
+    // one in AwaitEvent(): either we see the flag, or it sees our change.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (!waiting->load()) return;
+    const uint64_t one = 1;
+    write(event_fd, &one, sizeof(one));
+}
+
+// Wait on "loop", which watches "event_fd" and possibly "fd", with the
+// "waiting" flag set while doing so; at most "timeout_ms", or forever with
+// -1. Unless "ready" already returns true after setting the flag: the other
+// thread might have missed it. Returns 'true' if there is input on "fd".
+static bool AwaitEvent(EventLoop *loop, int event_fd, int fd,
+                       std::atomic<bool> *waiting,
+                       const std::function<bool()> &ready,
+                       int timeout_ms = -1) {
+    waiting->store(true);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    bool has_input = false;
+    if (!ready() && loop->Wait(timeout_ms) > 0) {
+        uint64_t value;
+        if (loop->ready(event_fd)) read(event_fd, &value, sizeof(value));
+        has_input = (fd >= 0 && loop->ready(fd) != 0);
+    }
+    waiting->store(false);
+    return has_input;
+}
+
+std::function<bool()> GCodeStreamer::HasRoom(size_t len) const {
+    return [this, len]() {
+        return ring_->free_space() >= SpscRing::RecordSize(len);
+    };
+}
+
+void GCodeStreamer::AwaitIOThread(const std::function<bool()> &progress) {
+    const int64_t start = LinkStats::Micros();
+    AwaitEvent(producer_loop_, progress_event_, -1, &producer_waiting_,
+               [this, &progress]() { return !ok_ || progress(); });
+    stats_.Waited(LinkStats::Micros() - start);
+}
+
+void GCodeStreamer::AwaitWork() {
+    // Everything collected needs to go out now: we don't know when the
+    // next line comes.
+    WritePending();
+    if (!ok_) io_loop_->Unwatch(machine_->fd());  // Might be hung up.
+    if (machine_->HasLine()
+        || AwaitEvent(io_loop_, work_event_, machine_->fd(), &io_waiting_,
+                      [this]() {
+                          return !ring_->empty() || abort_requested_;
+                      })) {
+        while (ReadResponse(0) > 0)
+            ;
+        TransmitLines();   // There might have been a resend request.
+        WritePending();
+    }
+}
+
+void GCodeStreamer::IOThread() {
+    uint32_t tag;
+    std::string line;
+    for (;;) {
+        if (abort_requested_) {
+            AbortNow();
+            abort_requested_ = false;
+            abort_done_ = true;
+            Wake(progress_event_, &producer_waiting_);
+            continue;
+        }
+        if (!ring_->Pop(&tag, &line)) {
+            AwaitWork();
+            continue;
+        }
+        if (tag == RECORD_STOP)
+            break;
+        if (tag == RECORD_FLUSH) {
+            FlushNow();
+            flush_done_ = true;
+            Wake(progress_event_, &producer_waiting_);
+        } else {
+            Wake(progress_event_, &producer_waiting_);  // Room in the ring.
+            SendNow(line.data(), line.size());
+        }
+    }
+}
+
+bool GCodeStreamer::SendNow(const char *line, size_t len) {
+    if (!ok_) return false;
+
+    // Take note of acknowledgements that arrived in the meantime.
+    while (in_flight_bytes_ > pending_.size() && ReadResponse(0) > 0)
+        ;
+
+    // Room in the ring buffer for one more.
+    while (next_number_ - first_unconfirmed_ >= (long) lines_.size()) {
+        if (!WritePending() || !AwaitResponse())
+            return false;
+    }
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+        --len;
+    Line(next_number_).assign(line, len);
+    ++next_number_;
+    if (!TransmitLines())
+        return false;
+
+    // If the machine is running low on things to do, don't wait any longer.
+    const size_t unacknowledged = in_flight_bytes_ - pending_.size();
+    if (unacknowledged <= window_ / 2)
+        return WritePending();
+    return true;
+}
+
+bool GCodeStreamer::FlushNow() {
+    for (;;) {
+        if (!TransmitLines() || !WritePending())
+            return false;
+        if (in_flight_.empty() && next_send_ == next_number_)
+            return ok_;
+        if (!AwaitResponse())
+            return false;
+    }
+}
+
+bool GCodeStreamer::TransmitLines() {
+    while (ok_ && next_send_ < next_number_) {
+        // After a resend request, the first line goes out on its own until
+        // the machine takes it: what is left in its receive buffer might
+        // still be rejected, and more would only overflow it.
+        if (resend_from_ >= 0 && next_send_ > resend_from_) {
+            if (!WritePending() || !AwaitResponse())
+                return false;
+            continue;
+        }
+        Encode(next_send_, &wire_buffer_);
+        // A line that doesn't fit into the window at all is sent on its own.
+        if (!in_flight_.empty()
+            && in_flight_bytes_ + wire_buffer_.size() > window_) {
+            if (!WritePending() || !AwaitResponse())
+                return false;
+            continue;  // Things might have changed with a resend request.
+        }
+        pending_.append(wire_buffer_);
+        const Transmission t = { next_send_, wire_buffer_.size(), 0 };
+        in_flight_.push_back(t);
+        in_flight_bytes_ += t.length;
+        ++next_send_;
+    }
+    return ok_;
+}
+
+void GCodeStreamer::Encode(long number, std::string *out) {
+    out->clear();
+    if (line_numbers_) {
+        char prefix[24];
+        const int len = snprintf(prefix, sizeof(prefix), "N%ld ", number);
+        out->append(prefix, len);
+    }
+    out->append(Line(number));
+    if (line_numbers_) {
+        unsigned char checksum = 0;
+        for (const char c : *out) checksum ^= c;
+        char suffix[8];
+        const int len = snprintf(suffix, sizeof(suffix), "*%d", checksum);
+        out->append(suffix, len);
+    }
+    out->push_back('\n');
+}
+
+bool GCodeStreamer::WritePending() {
+    if (!ok_ || pending_.empty()) {
+        pending_.clear();
+        return ok_;
+    }
+    if (!machine_->Write(pending_.data(), pending_.size()))
+        ok_ = false;
+
+    // The pending lines are the last ones in flight.
+    const int64_t now = LinkStats::Micros();
+    int lines = 0;
+    size_t unmarked = pending_.size();
+    for (auto it = in_flight_.rbegin(); unmarked > 0; ++it, ++lines) {
+        it->sent_us = now;
+        unmarked -= it->length;
+    }
+    stats_.Written(lines, pending_.size());
+    pending_.clear();
+    return ok_;
+}
+
+// Parse "Resend: 12" (Marlin) or "rs 12" (Repetier). Returns -1 if this
+// is not a resend request.
+static long ParseResendRequest(const char *line) {
+    if (strncasecmp(line, "Resend:", 7) == 0)
+        line += 7;
+    else if (strncmp(line, "rs ", 3) == 0)
+        line += 3;
+    else
+        return -1;
+    while (isspace(*line)) ++line;
+    if (*line == 'N') ++line;
+    if (!isdigit(*line)) return -1;
+    return strtol(line, NULL, 10);
+}
+
+int GCodeStreamer::ReadResponse(int timeout_ms) {
+    char buffer[512];
+    const int64_t start = LinkStats::Micros();
+    const int len = machine_->ReadLine(buffer, sizeof(buffer), timeout_ms);
+    const int64_t now = LinkStats::Micros();
+    if (timeout_ms != 0 && !io_thread_)
+        stats_.Waited(now - start);   // The G-Code producer waited.
+    if (len < 0) {
+        fprintf(stderr, "Lost connection to machine.\n");
+        ok_ = false;
+        return -1;
+    }
+    if (len == 0)
+        return 0;
+
+    const long resend = line_numbers_ ? ParseResendRequest(buffer) : -1;
+    if (resend >= 0)
+        HandleResend(resend);
+
+    const bool is_ok = (strncasecmp(buffer, "ok", 2) == 0);
+    // grbl answers "error:<code>" instead of "ok" for a line it rejects.
+    const bool is_error = (strncmp(buffer, "error:", 6) == 0);
+    if (strncmp(buffer, "Grbl ", 5) == 0) {
+        // grbl greets after a reset, e.g. the one of the quick stop: what
+        // it had received is gone without "ok".
+        while (in_flight_bytes_ > pending_.size()) {
+            in_flight_bytes_ -= in_flight_.front().length;
+            in_flight_.pop_front();
+        }
+    } else if (is_ok && skip_ok_) {
+        skip_ok_ = false;   // Belongs to the resend request, not to a line.
+    } else if ((is_ok || is_error) && !in_flight_.empty()) {
+        const Transmission &t = in_flight_.front();
+        if (t.number >= first_unconfirmed_)
+            first_unconfirmed_ = t.number + 1;
+        if (resend_from_ >= 0 && t.number >= resend_from_)
+            resend_from_ = -1;   // The line sent again made it.
+        stats_.Acknowledged(t.sent_us, now);
+        in_flight_bytes_ -= t.length;
+        in_flight_.pop_front();
+    }
+    // If we didn't get 'ok', it might be an important error message. Print.
+    if (!is_ok && buffer[0] != '\n' && buffer[0] != '\r') {
+        if (message_handler_)
+            message_handler_(buffer);
+        else
+            fprintf(stderr, "%s", buffer);
+        stats_.OtherResponse(resend >= 0);
+    }
+    stats_.MaybeReport(stderr);
+    return 1;
+}
+
+bool GCodeStreamer::AwaitResponse() {
+    const bool may_be_lost = line_numbers_ && pending_.empty()
+        && !in_flight_.empty();
+    if (!io_thread_) {
+        const int result = ReadResponse(may_be_lost ? kQuietMs : -1);
+        if (result == 0)
+            HandleQuiet();
+        return ok_ && result >= 0;
+    }
+    // On the I/O thread, an abort request ends the waiting as well.
+    const int64_t quiet_until = LinkStats::Micros() + kQuietMs * 1000;
+    for (;;) {
+        if (abort_requested_)
+            return false;
+        int timeout_ms = -1;
+        if (may_be_lost) {
+            timeout_ms = (quiet_until - LinkStats::Micros() + 999) / 1000;
+            if (timeout_ms <= 0) {
+                HandleQuiet();
+                return ok_;
+            }
+        }
+        if (machine_->HasLine()
+            || AwaitEvent(io_loop_, work_event_, machine_->fd(), &io_waiting_,
+                          [this]() { return abort_requested_.load(); },
+                          timeout_ms)) {
+            const int result = ReadResponse(0);
+            if (result != 0)
+                return result > 0;
+        }
+    }
+}
+
+void GCodeStreamer::DropUnwritten() {
+    size_t unwritten = pending_.size();
+    while (unwritten > 0) {
+        unwritten -= in_flight_.back().length;
+        in_flight_bytes_ -= in_flight_.back().length;
+        in_flight_.pop_back();
+    }
+    pending_.clear();
+}
+
+void GCodeStreamer::AbortNow() {
+    // Everything that is not on the wire yet is dropped.
+    uint32_t tag;
+    std::string discarded;
+    while (ring_ && ring_->Pop(&tag, &discarded))
+        ;
+    DropUnwritten();
+    next_number_ = next_send_;
+    // Lines the machine rejects from now on are not sent again.
+    first_unconfirmed_ = next_number_;
+    resend_from_ = -1;
+    if (!ok_) return;
+
+    // The stop goes out right away, without waiting for room in the window.
+    // Realtime commands without newline, such as grbl's "!", get no "ok".
+    if (!stop_command_.empty()) {
+        const int64_t now = LinkStats::Micros();
+        int lines = 0;
+        size_t end;
+        for (size_t start = 0;
+             (end = stop_command_.find('\n', start)) != std::string::npos;
+             start = end + 1, ++lines) {
+            const Transmission t = { -1, end + 1 - start, now };
+            in_flight_.push_back(t);
+            in_flight_bytes_ += t.length;
+        }
+        if (!machine_->Write(stop_command_.data(), stop_command_.size()))
+            ok_ = false;
+        stats_.Written(lines, stop_command_.size());
+    }
+
+    // Numbering continues after the lines given up. Unlike the stop, this
+    // waits for room in the window like any other line.
+    if (line_numbers_) {
+        char set_number[32];
+        snprintf(set_number, sizeof(set_number), "M110 N%ld", next_number_);
+        Line(next_number_).assign(set_number);
+        ++next_number_;
+    }
+}
+
+void GCodeStreamer::HandleResend(long number) {
+    // Each request comes with an "ok"; that doesn't confirm any line.
+    skip_ok_ = true;
+    const long copied = copied_line_;
+    copied_line_ = -1;
+    if (copied >= 0 && number == copied + 1) {
+        DropConfirmed(copied);   // The machine just stayed quiet.
+        return;
+    }
+    if (number < first_unconfirmed_) {
+        // About lines given up at an abort: they are rejected, and not sent
+        // again. No "ok" comes for them anymore.
+        for (auto it = in_flight_.begin(); it != in_flight_.end(); /**/) {
+            if (it->number >= number && it->number < first_unconfirmed_) {
+                in_flight_bytes_ -= it->length;
+                it = in_flight_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        return;
+    }
+    if (number > next_send_) {
+        fprintf(stderr, "Machine asks to resend line %ld, but we only have "
+                "lines %ld..%ld\n", number, first_unconfirmed_,
+                next_send_ - 1);
+        ok_ = false;
+        return;
+    }
+    if (number == resend_from_ && repeats_expected_ > 0) {
+        --repeats_expected_;   // Rejecting what else was in its buffer.
+        return;
+    }
+    SendAgainFrom(number);
+}
+
+void GCodeStreamer::HandleQuiet() {
+    if (in_flight_.back().number < first_unconfirmed_) {
+        // The machine has all of them; the "ok"s still missing won't come.
+        DropConfirmed(first_unconfirmed_ - 1);
+        return;
+    }
+    // If it arrived, the machine rejects the copy and asks for the line
+    // after it; otherwise it takes the copy, or asks for what got lost
+    // before. Either way, this is not waiting for an "ok" of its own.
+    copied_line_ = in_flight_.back().number;
+    Encode(copied_line_, &wire_buffer_);
+    if (!machine_->Write(wire_buffer_.data(), wire_buffer_.size()))
+        ok_ = false;
+    stats_.Written(1, wire_buffer_.size());
+}
+
+void GCodeStreamer::DropConfirmed(long last) {
+    // A line merged with one that got lost, or the stop of an abort merged
+    // with the next line, is rejected as one: there are fewer "ok"s than
+    // lines. What was sent up to "last" is not waited for anymore.
+    while (!in_flight_.empty() && in_flight_.front().number <= last) {
+        in_flight_bytes_ -= in_flight_.front().length;
+        in_flight_.pop_front();
+    }
+    first_unconfirmed_ = std::max(first_unconfirmed_, last + 1);
+    if (resend_from_ >= 0 && last >= resend_from_)
+        resend_from_ = -1;
+}
+
+void GCodeStreamer::SendAgainFrom(long number) {
+    // Lines not written yet don't need to go out anymore.
+    DropUnwritten();
+
+    // The machine got everything before "number"; those "ok"s still come.
+    // What was sent from there on is rejected, or lost, or discarded with
+    // the receive buffer: no "ok" to wait for. Each line but the first
+    // might come with the same request again.
+    repeats_expected_ = -1;
+    while (!in_flight_.empty() && in_flight_.back().number >= number) {
+        in_flight_bytes_ -= in_flight_.back().length;
+        in_flight_.pop_back();
+        ++repeats_expected_;
+    }
+    repeats_expected_ = std::max(repeats_expected_, 0);
+    first_unconfirmed_ = number;
+    next_send_ = number;
+    resend_from_ = number;
+}
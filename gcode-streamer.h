@@ -0,0 +1,211 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) h.zeller@acm.org. Free Software. GNU Public License v3.0 and above
+ *
+ * Streaming G-Code to a machine connection.
+ */
+
+#ifndef PNP_GCODE_STREAMER_H
+#define PNP_GCODE_STREAMER_H
+
+#include <signal.h>
+#include <stddef.h>
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "machine-connection.h"
+#include "spsc-ring.h"
+
+// Sends G-Code lines to a machine that acknowledges each line with "ok".
+//
+// Instead of waiting for the "ok" of each line before sending the next,
+// lines are streamed as long as all the bytes not acknowledged yet fit into
+// the "window", the receive buffer of the firmware (character counting,
+// as grbl senders do). This keeps the planner of the firmware busy. Lines
+// are collected and sent with one write() while the machine still has
+// enough to work on.
+//
+// With a window of 0, each line waits for the "ok" of the previous one.
+//
+// Optionally, all the communication happens on a separate I/O thread;
+// lines are handed to it through a lock-free queue. Formatting then never
+// stalls on the wire, and acknowledgements and resend requests are handled
+// as soon as they arrive.
+class GCodeStreamer {
+public:
+    // Talk to "machine": write lines to it and read its responses.
+    GCodeStreamer(LineReader *machine, size_t window);
+    ~GCodeStreamer();
+
+    // Send each line with line number and checksum, e.g. "N12 G1 X5*57".
+    // The firmware detects corrupted or lost lines and asks for them again
+    // ("Resend: 12"); all lines from there on are then sent again.
+    // Call before sending anything.
+    void set_line_numbers(bool on);
+
+    // Start the I/O thread; from now on, Send() and Flush() are to be
+    // called from one other thread only. Call after set_line_numbers().
+    // Returns 'false' and prints a message to stderr on error.
+    bool StartIOThread();
+
+    // Send "line" of length "len", including the newline. Blocks while the
+    // machine (or, with the I/O thread, the queue to it) has no room for it.
+    // Returns 'false' on error.
+    bool Send(const char *line, size_t len);
+
+    // Send everything and wait until all lines are acknowledged.
+    // Returns 'false' on error.
+    bool Flush();
+
+    // Send() and Flush() give up waiting once "*interrupted" is set, e.g.
+    // by a signal handler. Call Abort() then; otherwise, whatever is still
+    // queued is dropped on destruction.
+    void set_interrupt(volatile sig_atomic_t *interrupted) {
+        interrupted_ = interrupted;
+    }
+
+    // If "*interrupted" is set and Abort() was not called since.
+    bool interrupted() const { return interrupted_ && *interrupted_; }
+
+    // Stop the machine as fast as possible: lines not sent yet are dropped,
+    // and the "stop" command, e.g. "M410\n" (quick stop), goes out right
+    // away without waiting for room in the window. Realtime commands without
+    // newline, such as grbl's "!", expect no "ok". Lines already received
+    // by the machine are still executed. With line numbers, an "M110" to
+    // continue the numbering is queued like any other line. Afterwards,
+    // Send() and Flush() work again, e.g. to put the machine into a safe
+    // state.
+    // Returns 'false' on error.
+    bool Abort(const std::string &stop);
+
+    size_t window() const { return window_; }
+
+    // Responses other than "ok" are passed to "handler", on the I/O thread
+    // if there is one; by default, they are printed to stderr.
+    // Call before StartIOThread().
+    void set_message_handler(std::function<void(const char *line)> handler) {
+        message_handler_ = std::move(handler);
+    }
+
+    // Latency, throughput and time waited for the machine.
+    LinkStats *stats() { return &stats_; }
+
+private:
+    // Records in ring_.
+    enum RecordTag { RECORD_LINE, RECORD_FLUSH, RECORD_STOP };
+
+    // A line on its way to the machine, waiting for the "ok".
+    struct Transmission {
+        long number;      // Line number; -1 for the stop of an abort.
+        size_t length;    // Bytes on the wire.
+        int64_t sent_us;  // When it was written.
+    };
+
+    // Line "number", without newline, kept until it is confirmed.
+    std::string &Line(long number) {
+        return lines_[number & (lines_.size() - 1)];
+    }
+
+    // Send(), Flush() and Abort() on the thread talking to the machine.
+    bool SendNow(const char *line, size_t len);
+    bool FlushNow();
+    void AbortNow();
+
+    // The I/O thread: takes lines from ring_ and sends them.
+    void IOThread();
+
+    // I/O thread: wait until there is something to send, while handling
+    // responses that arrive.
+    void AwaitWork();
+
+    // Producer: wait until the I/O thread made "progress", or failed.
+    void AwaitIOThread(const std::function<bool()> &progress);
+
+    // Progress: there is room in the ring for a line of "len".
+    std::function<bool()> HasRoom(size_t len) const;
+
+    // Wake up the other thread if it waits on "event_fd".
+    static void Wake(int event_fd, std::atomic<bool> *waiting);
+
+    // Send all lines not sent yet; waits for room in the window as needed.
+    bool TransmitLines();
+
+    // Format line "number" as it goes on the wire into "out".
+    void Encode(long number, std::string *out);
+
+    // Write lines collected in pending_.
+    bool WritePending();
+
+    // Read and handle one response; waits at most "timeout_ms", or forever
+    // with -1. Returns 1 if a line was read, 0 on timeout, -1 on error.
+    int ReadResponse(int timeout_ms);
+
+    // Wait for a response and handle it. Returns 'false' on error or if
+    // an abort is requested.
+    bool AwaitResponse();
+
+    // The machine asks to send again from line "number".
+    void HandleResend(long number);
+
+    // Forget what is in flight from line "number" on and send it again.
+    void SendAgainFrom(long number);
+
+    // The machine stays quiet while lines are in flight: write the last
+    // one once more, to find out if some got lost.
+    void HandleQuiet();
+
+    // The machine has all the lines up to "last"; stop waiting for them.
+    void DropConfirmed(long last);
+
+    // Forget the lines collected in pending_.
+    void DropUnwritten();
+
+    LineReader *const machine_;
+    const size_t window_;
+    bool line_numbers_;
+
+    // Ring buffer of lines [first_unconfirmed_, next_number_). Lines before
+    // next_send_ are sent.
+    std::vector<std::string> lines_;
+    long first_unconfirmed_;
+    long next_send_;
+    long next_number_;
+
+    std::deque<Transmission> in_flight_;  // Without "ok" yet.
+    size_t in_flight_bytes_;
+    std::string pending_;        // Last of in_flight_; not written yet.
+    std::string wire_buffer_;
+
+    // After a resend request, the machine rejects whatever else is still
+    // in its receive buffer with the same request again, or discards it
+    // silently (Marlin). Each request is followed by an "ok" of its own.
+    long resend_from_;           // Sent again from here; -1 if confirmed.
+    int repeats_expected_;       // Requests for resend_from_ to ignore.
+    long copied_line_;           // Written again by HandleQuiet().
+    bool skip_ok_;               // The next "ok" belongs to a request.
+
+    std::atomic<bool> ok_;
+    LinkStats stats_;
+    volatile sig_atomic_t *interrupted_;
+    std::string stop_command_;
+    std::function<void(const char *line)> message_handler_;
+
+    // With I/O thread.
+    SpscRing *ring_;
+    std::thread *io_thread_;
+    EventLoop *io_loop_;                 // Machine and work_event_.
+    EventLoop *producer_loop_;           // progress_event_.
+    int work_event_;                     // eventfd: the ring has data.
+    int progress_event_;                 // eventfd: room in ring, flushed.
+    std::atomic<bool> io_waiting_;       // I/O thread waits for work_event_.
+    std::atomic<bool> producer_waiting_;
+    std::atomic<bool> flush_done_;
+    std::atomic<bool> abort_requested_;
+    std::atomic<bool> abort_done_;
+};
+
+#endif  // PNP_GCODE_STREAMER_H
@@ -0,0 +1,263 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) h.zeller@acm.org. Free Software. GNU Public License v3.0 and above
+ */
+
+#include "gcode-template.h"
+
+#include <assert.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+
+static const double kPow10[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6,
+                                 1e7, 1e8, 1e9 };
+static const int kMaxFastPrecision = 9;
+
+// Write "value" backwards, ending at "end". Returns the start.
+static char *FormatUnsignedBackwards(uint64_t value, char *end) {
+    do {
+        *--end = '0' + value % 10;
+        value /= 10;
+    } while (value);
+    return end;
+}
+
+// Format fixed-point into "buffer" of at least 64 bytes; returns length.
+// Numbers that don't fit are cut off.
+static int FormatFixedPoint(double value, int precision, char *buffer) {
+    if (precision < 0 || precision > kMaxFastPrecision
+        || !(fabs(value) < 1e15 / kPow10[precision])) {
+        // Large numbers, NaN or infinity. Not worth being fast.
+        const int len = snprintf(buffer, 64, "%.*f", precision, value);
+        return std::min(len, 63);
+    }
+    // Round the exact decimal value of "value" like printf() does. The
+    // product of the multiplication is rounded, so we need its error to
+    // decide cases that look like they are exactly in the middle.
+    const double product = value * kPow10[precision];
+    const double error = fma(value, kPow10[precision], -product);
+    double scaled = rint(product);  // Ties to even, as printf().
+    const double rest = product - scaled;  // exact.
+    if (rest == 0.5 && error > 0) scaled += 1;
+    else if (rest == -0.5 && error < 0) scaled -= 1;
+    uint64_t digits = (uint64_t) fabs(scaled);
+    char tmp[32];
+    char *const end = tmp + sizeof(tmp);
+    char *pos = end;
+    for (int i = 0; i < precision; ++i) {
+        *--pos = '0' + digits % 10;
+        digits /= 10;
+    }
+    if (precision > 0) *--pos = '.';
+    pos = FormatUnsignedBackwards(digits, pos);
+    if (signbit(scaled)) *--pos = '-';
+    const int len = end - pos;
+    memcpy(buffer, pos, len);
+    return len;
+}
+
+void AppendFixedPoint(double value, int precision, std::string *out) {
+    char buffer[64];
+    out->append(buffer, FormatFixedPoint(value, precision, buffer));
+}
+
+// Parse a decimal number at "*pos", advance "*pos" behind it. Saturates
+// at a million.
+static int ParseNumber(const char **pos) {
+    int result = 0;
+    while (**pos >= '0' && **pos <= '9') {
+        result = std::min(10 * result + (**pos - '0'), 1000000);
+        ++*pos;
+    }
+    return result;
+}
+
+bool GCodeTemplate::Compile(const std::string &text, const char *params) {
+    std::vector<std::string> names;
+    for (const char *p = params; *p; /**/) {
+        const size_t len = strcspn(p, " ");
+        if (len) names.push_back(std::string(p, len));
+        p += len;
+        p += strspn(p, " ");
+    }
+    if (names.size() > 64) {
+        fprintf(stderr, "Too many template parameters: %s\n", params);
+        return false;
+    }
+    param_count_ = names.size();
+    text_.clear();
+    segments_.clear();
+    lines_.clear();
+
+    Line line = { 0, 0, 0 };
+    int line_no = 1;
+    const char *pos = text.c_str();
+    while (*pos) {
+        if (*pos == '{' && pos[1] != '{') {
+            const char *name_start = ++pos;
+            pos += strcspn(pos, ":}\n");
+            const std::string name(name_start, pos - name_start);
+            Segment placeholder = {};
+            placeholder.kind = Segment::PLACEHOLDER;
+            placeholder.precision = 3;
+            if (*pos == ':') {
+                ++pos;
+                if (*pos == '-') {
+                    placeholder.left_align = true;
+                    ++pos;
+                }
+                placeholder.width = ParseNumber(&pos);
+                if (*pos == '.') {
+                    ++pos;
+                    placeholder.precision = ParseNumber(&pos);
+                }
+            }
+            if (placeholder.precision > kMaxFastPrecision) {
+                fprintf(stderr, "Template line %d: Precision of {%s} "
+                        "is more than %d digits\n",
+                        line_no, name.c_str(), kMaxFastPrecision);
+                return false;
+            }
+            if (*pos != '}') {
+                fprintf(stderr, "Template line %d: Invalid placeholder "
+                        "'{%s'; expected {name} or "
+                        "{name:[-][width][.precision]}\n",
+                        line_no, name.c_str());
+                return false;
+            }
+            ++pos;
+            placeholder.arg = std::find(names.begin(), names.end(), name)
+                - names.begin();
+            if (placeholder.arg == names.size()) {
+                fprintf(stderr, "Template line %d: Unknown placeholder "
+                        "{%s}. Available: %s\n",
+                        line_no, name.c_str(), params);
+                return false;
+            }
+            segments_.push_back(placeholder);
+            line.params |= uint64_t(1) << placeholder.arg;
+            continue;
+        }
+
+        // Literal text up to the next placeholder or end of line.
+        if (segments_.empty() || segments_.back().kind != Segment::LITERAL
+            || segments_.size() == line.first_segment) {
+            Segment literal = {};
+            literal.kind = Segment::LITERAL;
+            literal.offset = text_.size();
+            segments_.push_back(literal);
+        }
+        text_.push_back(*pos);
+        segments_.back().length++;
+        if (*pos == '{') ++pos;  // Skip the second '{' of '{{'.
+        if (*pos++ == '\n') {
+            line.end_segment = segments_.size();
+            lines_.push_back(line);
+            line.first_segment = line.end_segment;
+            line.params = 0;
+            ++line_no;
+        }
+    }
+    // We only send full lines; make sure the last one is terminated.
+    if (line.first_segment != segments_.size()) {
+        if (segments_.back().kind != Segment::LITERAL) {
+            Segment literal = {};
+            literal.kind = Segment::LITERAL;
+            literal.offset = text_.size();
+            segments_.push_back(literal);
+        }
+        text_.push_back('\n');
+        segments_.back().length++;
+        line.end_segment = segments_.size();
+        lines_.push_back(line);
+    }
+    return true;
+}
+
+bool ReadTemplateFile(
+    const char *filename,
+    const std::function<bool(const std::string &name,
+                             const std::string &text)> &receive) {
+    FILE *in = fopen(filename, "r");
+    if (!in) {
+        fprintf(stderr, "Can't open %s\n", filename);
+        return false;
+    }
+    bool success = true;
+    std::string name;
+    std::string text;
+    char buffer[1024];
+    int line_no = 0;
+    while (success && fgets(buffer, sizeof(buffer), in)) {
+        ++line_no;
+        if (buffer[0] == '#')
+            continue;
+        if (buffer[0] == '[') {
+            const char *end = strchr(buffer, ']');
+            if (end == NULL) {
+                fprintf(stderr, "%s:%d: Expected [name]\n", filename, line_no);
+                success = false;
+                break;
+            }
+            if (!name.empty()) success = receive(name, text);
+            name.assign(buffer + 1, end - buffer - 1);
+            text.clear();
+            continue;
+        }
+        if (name.empty()) {
+            if (strspn(buffer, " \t\r\n") == strlen(buffer))
+                continue;   // Empty lines before the first template.
+            fprintf(stderr, "%s:%d: Text outside of a [template] section\n",
+                    filename, line_no);
+            success = false;
+            break;
+        }
+        text.append(buffer);
+    }
+    if (success && !name.empty()) success = receive(name, text);
+    fclose(in);
+    return success;
+}
+
+void GCodeTemplate::ExpandLine(size_t line_index, const Arg *args,
+                               std::string *out) const {
+    assert(line_index < lines_.size());
+    const Line &line = lines_[line_index];
+    out->clear();
+    char buffer[64];
+    for (size_t i = line.first_segment; i < line.end_segment; ++i) {
+        const Segment &segment = segments_[i];
+        if (segment.kind == Segment::LITERAL) {
+            out->append(text_, segment.offset, segment.length);
+            continue;
+        }
+        const Arg &arg = args[segment.arg];
+        const char *value = buffer;
+        int len = 0;
+        switch (arg.type) {
+        case Arg::INT: {
+            char *const end = buffer + sizeof(buffer);
+            char *start = FormatUnsignedBackwards(
+                arg.i < 0 ? -(uint64_t) arg.i : arg.i, end);
+            if (arg.i < 0) *--start = '-';
+            value = start;
+            len = end - start;
+            break;
+        }
+        case Arg::FLOAT:
+            len = FormatFixedPoint(arg.f, segment.precision, buffer);
+            break;
+        case Arg::STRING:
+            value = arg.s;
+            len = strlen(arg.s);
+            break;
+        }
+        const int pad = segment.width > len ? segment.width - len : 0;
+        if (!segment.left_align) out->append(pad, ' ');
+        out->append(value, len);
+        if (segment.left_align) out->append(pad, ' ');
+    }
+}
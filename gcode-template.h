@@ -0,0 +1,109 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) h.zeller@acm.org. Free Software. GNU Public License v3.0 and above
+ *
+ * Pre-compiled G-Code templates.
+ */
+
+#ifndef PNP_GCODE_TEMPLATE_H
+#define PNP_GCODE_TEMPLATE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <functional>
+#include <string>
+#include <vector>
+
+// A G-Code template with named placeholders, e.g.
+//   "G1 X{x:.3} Y{y:.3} Z{z}\n"
+// It is compiled once into lines of literal text and placeholders, so that
+// expanding it does not have to re-parse the text, re-scan the result for
+// newlines or allocate memory.
+//
+// Placeholders are {name} or {name:format}. The format is printf()-like
+// "[-][width][.precision]" with the value right (or with '-' left) aligned
+// in a field of at least "width" characters. Floating point values are
+// formatted with "precision" digits after the decimal point (default 3,
+// at most 9).
+// A literal '{' is written as "{{".
+class GCodeTemplate {
+public:
+    // A single value for a placeholder.
+    struct Arg {
+        enum Type { INT, FLOAT, STRING };
+        Arg(int v) : type(INT), i(v) {}
+        Arg(double v) : type(FLOAT), f(v) {}
+        Arg(const char *v) : type(STRING), s(v) {}
+
+        Type type;
+        union {
+            int i;
+            double f;
+            const char *s;
+        };
+    };
+
+    GCodeTemplate() : param_count_(0) {}
+
+    // Compile the template "text". The "params" is a space separated list
+    // of the parameter names, in the order the arguments are passed to
+    // ExpandLine(). Not all of them have to be used in the text.
+    // Returns 'false' and prints a message to stderr if the text
+    // contains unknown placeholders or is otherwise invalid.
+    bool Compile(const std::string &text, const char *params);
+
+    // Number of arguments to pass.
+    size_t param_count() const { return param_count_; }
+
+    // Number of lines in this template.
+    size_t line_count() const { return lines_.size(); }
+
+    // Parameters used in line "line" as bitmask; bit i is set if the i-th
+    // parameter appears in it.
+    uint64_t line_params(size_t line) const { return lines_[line].params; }
+
+    // Expand line "line" with the given arguments (all "param_count()" of
+    // them) into "out", replacing its content. The result includes the
+    // newline. Capacity of "out" is kept, so re-using the same string for
+    // every line does not allocate once it has grown to the longest line.
+    void ExpandLine(size_t line, const Arg *args, std::string *out) const;
+
+private:
+    struct Segment {
+        enum Kind { LITERAL, PLACEHOLDER };
+        Kind kind;
+        // Literal: the text; range in text_.
+        size_t offset, length;
+        // Placeholder:
+        size_t arg;       // Index into the arguments.
+        int width;        // Minimum field width, 0 for none.
+        int precision;    // Digits after the decimal point for floats.
+        bool left_align;
+    };
+    struct Line {
+        size_t first_segment, end_segment;
+        uint64_t params;  // Bitmask of the parameters used.
+    };
+
+    std::string text_;    // Literal text of all the segments.
+    std::vector<Segment> segments_;
+    std::vector<Line> lines_;
+    size_t param_count_;
+};
+
+// Read a file with templates. Each template starts with a line "[name]";
+// all following lines up to the next such line are the template text.
+// Lines starting with '#' are comments. Calls "receive" with each name and
+// text; if that returns false, reading is aborted.
+// Returns 'false' and prints a message to stderr on error.
+bool ReadTemplateFile(
+    const char *filename,
+    const std::function<bool(const std::string &name,
+                             const std::string &text)> &receive);
+
+// Append "value" in fixed-point with "precision" digits after the decimal
+// point to "out". Same result as printf("%.*f") for the range of values
+// typically found in G-Code, but much faster.
+void AppendFixedPoint(double value, int precision, std::string *out);
+
+#endif  // PNP_GCODE_TEMPLATE_H
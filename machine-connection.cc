@@ -2,16 +2,39 @@
  * (c) h.zeller@acm.org. Free Software. GNU Public License v3.0 and above
  */
 
+#include "machine-connection.h"
+
 #include <errno.h>
 #include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
-#include <string>
+#include <strings.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
-#include <sys/time.h>
 #include <sys/types.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <functional>
+#include <string>
+
+static const int kConnectTimeoutMs = 5000;
+
+// Handshake: the machine might be booting after the port was opened, so
+// we keep asking until it answers.
+static const int kReadyTimeoutMs = 10000;
+static const int kProbeIntervalMs = 500;
+static const int kQueryTimeoutMs = 2000;
+static const int kQuietMs = 50;        // Silence before we start asking.
+static const int kDefaultReceiveBuffer = 128;  // Marlin and grbl default.
+
 static bool SetTTYParams(int fd, const char *params) {
     speed_t speed = B115200;
     if (params[0] == 'b' || params[0] == 'B')
@@ -66,39 +89,69 @@ static bool SetTTYParams(int fd, const char *params) {
     return true;
  }
 
-// Wait for input to become ready for read or timeout reached.
-// If the file-descriptor becomes readable, returns number of milli-seconds
-// left.
-// Returns 0 on timeout (i.e. no millis left and nothing to be read).
-// Returns -1 on error.
-static int AwaitReadReady(int fd, int timeout_millis) {
-    fd_set read_fds;
-    FD_ZERO(&read_fds);
-    FD_SET(fd, &read_fds);
-
-    struct timeval tv;
-    tv.tv_sec = 0;
-    tv.tv_usec = timeout_millis * 1000;
-
-    FD_SET(fd, &read_fds);
-    int s = select(fd + 1, &read_fds, NULL, NULL, &tv);
-    if (s < 0)
-        return -1;
-    return tv.tv_usec / 1000;
+// Milliseconds on the monotonic clock.
+static int64_t Millis() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
-static int ReadLine(int fd, char *result, int len, bool do_echo) {
-    int bytes_read = 0;
-    char c = 0;
-    while (c != '\n' && c != '\r' && bytes_read < len) {
-        if (read(fd, &c, 1) < 0)
-            return -1;
-        ++bytes_read;
-        *result++ = c;
-        if (do_echo) write(STDERR_FILENO, &c, 1);  // echo back.
+// Connect to "host:port"; IPv6 addresses in brackets: "[::1]:port".
+// The socket is non-blocking.
+static int OpenTCPConnection(const char *descriptor) {
+    const char *colon = strrchr(descriptor, ':');
+    std::string host(descriptor, colon);
+    if (host.size() > 2 && host[0] == '[' && host[host.size() - 1] == ']')
+        host = host.substr(1, host.size() - 2);
+    const char *port = colon + 1;
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo *addresses = NULL;
+    const int lookup = getaddrinfo(host.c_str(), port, &hints, &addresses);
+    if (lookup != 0) {
+        fprintf(stderr, "Resolving %s: %s\n", descriptor,
+                gai_strerror(lookup));
+        return -1;
+    }
+
+    int fd = -1;
+    int error = ECONNREFUSED;
+    for (struct addrinfo *a = addresses; a != NULL && fd < 0; a = a->ai_next) {
+        fd = socket(a->ai_family, a->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                    a->ai_protocol);
+        if (fd < 0) {
+            error = errno;
+            continue;
+        }
+        if (connect(fd, a->ai_addr, a->ai_addrlen) < 0) {
+            error = errno;
+            if (errno == EINPROGRESS) {
+                EventLoop loop;
+                loop.Watch(fd, EPOLLOUT);
+                socklen_t len = sizeof(error);
+                if (loop.Wait(kConnectTimeoutMs) <= 0)
+                    error = ETIMEDOUT;
+                else if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0)
+                    error = errno;
+            }
+            if (error != 0) {
+                close(fd);
+                fd = -1;
+            }
+        }
+    }
+    freeaddrinfo(addresses);
+    if (fd < 0) {
+        fprintf(stderr, "Connecting to %s: %s\n", descriptor, strerror(error));
+        return -1;
     }
-    *result = '\0';
-    return bytes_read;
+    // We send short lines and wait for short responses; don't delay them.
+    const int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    return fd;
 }
 
 /*
@@ -109,9 +162,11 @@ static int ReadLine(int fd, char *result, int len, bool do_echo) {
 
 int OpenMachineConnection(const char *descriptor) {
     if (descriptor == nullptr) return -1;
+    if (strchr(descriptor, '/') == NULL && strchr(descriptor, ':') != NULL)
+        return OpenTCPConnection(descriptor);
     const char *comma = strchrnul(descriptor, ',');
     const std::string path(descriptor, comma);
-    int fd = open(path.c_str(), O_RDWR | O_NOCTTY | O_SYNC);
+    int fd = open(path.c_str(), O_RDWR | O_NOCTTY | O_SYNC | O_NONBLOCK);
     if (fd < 0) {
         fprintf(stderr, "Opening %s: %s\n", path.c_str(), strerror(errno));
         return -1;
@@ -122,27 +177,494 @@ int OpenMachineConnection(const char *descriptor) {
     return fd;
 }
 
-int DiscardPendingInput(int fd, int timeout_ms) {
-    if (fd < 0) return 0;
-    int total_bytes = 0;
-    char buf[128];
-    while (AwaitReadReady(fd, timeout_ms) > 0) {
-        int r = read(fd, buf, sizeof(buf));
-        if (r < 0) {
-            perror("reading trouble");
+bool WriteToMachine(int fd, const char *data, size_t len, SessionLog *log,
+                    EventLoop *writable) {
+    if (log) log->Sent(data, len);
+    EventLoop *loop = writable;   // Only needed if we have to wait.
+    while (len > 0) {
+        const ssize_t written = write(fd, data, len);
+        if (written >= 0) {
+            data += written;
+            len -= written;
+            continue;
+        }
+        if (errno == EINTR) continue;
+        if (errno != EAGAIN) break;
+        if (loop == NULL) {
+            loop = new EventLoop();
+            loop->Watch(fd, EPOLLOUT);
+        }
+        if (loop->Wait(-1) < 0) break;
+    }
+    if (loop != writable) delete loop;
+    if (len > 0) {
+        perror("Writing to machine");
+        return false;
+    }
+    return true;
+}
+
+LineReader::LineReader(int fd)
+    : fd_(fd), log_(NULL), start_(0), end_(0), skip_newline_(false) {
+    loop_.Watch(fd_, EPOLLIN);
+    write_loop_.Watch(fd_, EPOLLOUT);
+}
+
+size_t LineReader::FindLineEnd() const {
+    for (size_t pos = start_; pos < end_; ++pos) {
+        const char c = buffer_[pos & (kSize - 1)];
+        if (c == '\n' || c == '\r')
+            return pos;
+    }
+    return kNotFound;
+}
+
+int LineReader::Fill(int timeout_ms) {
+    // Up to the end of the free space or the end of the buffer.
+    const size_t index = end_ & (kSize - 1);
+    const size_t room = std::min(kSize - (end_ - start_), kSize - index);
+    for (;;) {
+        const ssize_t r = read(fd_, buffer_ + index, room);
+        if (r > 0) {
+            end_ += r;
+            return r;
+        }
+        if (r == 0)
+            return -1;   // Connection closed.
+        if (errno == EINTR)
+            continue;
+        if (errno != EAGAIN)
             return -1;
+        if (timeout_ms == 0)
+            return 0;
+        const int ready = loop_.Wait(timeout_ms);
+        if (ready <= 0)
+            return ready;
+        timeout_ms = 0;   // Should be readable now.
+    }
+}
+
+int LineReader::ReadLine(char *result, size_t len, int timeout_ms) {
+    const int64_t deadline = Millis() + timeout_ms;
+    size_t line_end;
+    for (;;) {
+        if (skip_newline_ && start_ < end_) {
+            // Second part of a "\r\n" line ending.
+            if (buffer_[start_ & (kSize - 1)] == '\n') ++start_;
+            skip_newline_ = false;
+        }
+        line_end = FindLineEnd();
+        if (line_end != kNotFound)
+            break;
+        const size_t max_line = std::min(kSize, len - 2);
+        if (end_ - start_ >= max_line) {
+            line_end = start_ + max_line;   // Too long; split.
+            break;
+        }
+        int wait_ms = -1;
+        if (timeout_ms >= 0) {
+            wait_ms = std::max<int64_t>(0, deadline - Millis());
         }
-        total_bytes += r;
-        if (r > 0) write(STDERR_FILENO, buf, r);  // echo back.
+        const int r = Fill(wait_ms);
+        if (r < 0) return -1;
+        if (r == 0 && wait_ms == 0) return 0;   // Timeout.
+    }
+
+    // Copy the line, without its ending; we end it with '\n'.
+    const size_t line_len = line_end - start_;
+    for (size_t i = 0; i < line_len; ++i) {
+        result[i] = buffer_[(start_ + i) & (kSize - 1)];
+    }
+    start_ = line_end;
+    if (line_end < end_) {
+        const char ending = buffer_[line_end & (kSize - 1)];
+        if (ending == '\n' || ending == '\r') {
+            skip_newline_ = (ending == '\r');
+            ++start_;
+        }
+    }
+    result[line_len] = '\n';
+    result[line_len + 1] = '\0';
+    if (log_) log_->Received(result, line_len + 1);
+    return line_len + 1;
+}
+
+static const char kSessionMagic[] = "rpt2pnp-session\n";
+
+static void PutVarint(uint64_t value, FILE *out) {
+    while (value >= 0x80) {
+        putc((value & 0x7f) | 0x80, out);
+        value >>= 7;
+    }
+    putc(value, out);
+}
+
+static bool GetVarint(FILE *in, uint64_t *value) {
+    *value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        const int c = getc(in);
+        if (c == EOF) return false;
+        *value |= (uint64_t)(c & 0x7f) << shift;
+        if ((c & 0x80) == 0) return true;
+    }
+    return false;
+}
+
+SessionLog *SessionLog::Create(const char *filename) {
+    FILE *out = fopen(filename, "wb");
+    if (out == NULL) {
+        fprintf(stderr, "Can't create session log %s: %s\n",
+                filename, strerror(errno));
+        return NULL;
+    }
+    fwrite(kSessionMagic, 1, strlen(kSessionMagic), out);
+    return new SessionLog(out);
+}
+
+SessionLog::SessionLog(FILE *out)
+    : out_(out), last_us_(LinkStats::Micros()) {}
+
+SessionLog::~SessionLog() {
+    fclose(out_);
+}
+
+void SessionLog::Add(Direction dir, const char *data, size_t len) {
+    const int64_t now = LinkStats::Micros();
+    std::lock_guard<std::mutex> l(mutex_);
+    PutVarint(std::max<int64_t>(0, now - last_us_), out_);
+    PutVarint((uint64_t) len << 1 | dir, out_);
+    fwrite(data, 1, len, out_);
+    last_us_ = std::max(last_us_, now);
+}
+
+bool SessionLog::Read(const char *filename,
+                      const std::function<void(int64_t us, Direction dir,
+                                               const char *data,
+                                               size_t len)> &receive) {
+    FILE *in = fopen(filename, "rb");
+    if (in == NULL) {
+        fprintf(stderr, "Can't open %s: %s\n", filename, strerror(errno));
+        return false;
+    }
+    char magic[sizeof(kSessionMagic) - 1];
+    if (fread(magic, 1, sizeof(magic), in) != sizeof(magic)
+        || memcmp(magic, kSessionMagic, sizeof(magic)) != 0) {
+        fprintf(stderr, "%s: Not a session log.\n", filename);
+        fclose(in);
+        return false;
+    }
+    std::string data;
+    int64_t us = 0;
+    uint64_t delta, length;
+    while (GetVarint(in, &delta)) {
+        bool complete = GetVarint(in, &length);
+        if (complete) {
+            data.resize(length >> 1);
+            complete = data.empty()
+                || fread(&data[0], 1, data.size(), in) == data.size();
+        }
+        if (!complete) {
+            // Only the last record can be cut short, e.g. after a crash.
+            fprintf(stderr, "%s: Last record is incomplete.\n", filename);
+            break;
+        }
+        us += delta;
+        receive(us, (Direction)(length & 1), data.data(), data.size());
+    }
+    fclose(in);
+    return true;
+}
+
+LinkStats::LinkStats()
+    : start_us_(Micros()), lines_(0), bytes_(0), acknowledged_(0),
+      other_responses_(0), resend_requests_(0), waited_us_(0),
+      max_latency_us_(0), report_interval_us_(0), last_report_us_(start_us_),
+      last_lines_(0), last_bytes_(0), last_waited_us_(0) {
+    for (std::atomic<int64_t> &bucket : latency_) bucket.store(0);
+}
+
+int64_t LinkStats::Micros() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void LinkStats::Written(int lines, size_t bytes) {
+    Add(&lines_, lines);
+    Add(&bytes_, bytes);
+}
+
+void LinkStats::Acknowledged(int64_t sent_us, int64_t now_us) {
+    const int64_t latency = std::max<int64_t>(0, now_us - sent_us);
+    const int bucket = (latency <= 1) ? 0
+        : std::min(kBuckets - 1, 64 - __builtin_clzll(latency - 1));
+    Add(&latency_[bucket], 1);
+    Add(&acknowledged_, 1);
+    if (latency > max_latency_us_.load(std::memory_order_relaxed))
+        max_latency_us_.store(latency, std::memory_order_relaxed);
+}
+
+void LinkStats::OtherResponse(bool is_resend) {
+    Add(&other_responses_, 1);
+    if (is_resend) Add(&resend_requests_, 1);
+}
+
+void LinkStats::Waited(int64_t us) {
+    Add(&waited_us_, us);
+}
+
+void LinkStats::set_report_interval(int seconds) {
+    report_interval_us_ = (int64_t) seconds * 1000000;
+}
+
+int64_t LinkStats::Percentile(double fraction) const {
+    // The last bucket has no upper bound but the maximum.
+    const int64_t wanted = acknowledged_.load() * fraction;
+    const int64_t max_latency = max_latency_us_.load();
+    int64_t count = 0;
+    for (int i = 0; i < kBuckets - 1; ++i) {
+        count += latency_[i].load();
+        if (count > wanted) return std::min((int64_t) 1 << i, max_latency);
+    }
+    return max_latency;
+}
+
+static const char *FormatMicros(int64_t us, char *buffer, size_t len) {
+    if (us < 1000)
+        snprintf(buffer, len, "%dus", (int) us);
+    else if (us < 1000000)
+        snprintf(buffer, len, "%.1fms", us / 1e3);
+    else
+        snprintf(buffer, len, "%.2fs", us / 1e6);
+    return buffer;
+}
+
+void LinkStats::MaybeReport(FILE *out) {
+    if (report_interval_us_ <= 0) return;
+    const int64_t now = Micros();
+    const int64_t elapsed = now - last_report_us_;
+    if (elapsed < report_interval_us_) return;
+
+    const int64_t lines = lines_.load(), bytes = bytes_.load();
+    const int64_t waited = waited_us_.load();
+    char median[16], p99[16];
+    fprintf(out, "Link %.0fs: %.0f lines/s, %.1f kB/s, waited %.0f%%; "
+            "'ok' 50%% <= %s, 99%% <= %s; %lld other responses.\n",
+            (now - start_us_) / 1e6,
+            (lines - last_lines_) * 1e6 / elapsed,
+            (bytes - last_bytes_) * 1e3 / elapsed,
+            100.0 * (waited - last_waited_us_) / elapsed,
+            FormatMicros(Percentile(0.5), median, sizeof(median)),
+            FormatMicros(Percentile(0.99), p99, sizeof(p99)),
+            (long long) other_responses_.load());
+    last_report_us_ = now;
+    last_lines_ = lines;
+    last_bytes_ = bytes;
+    last_waited_us_ = waited;
+}
+
+void LinkStats::Print(FILE *out) const {
+    const double seconds = std::max<int64_t>(1, Micros() - start_us_) / 1e6;
+    const double waited = waited_us_.load() / 1e6;
+    fprintf(out, "Machine link: %lld lines, %lld bytes in %.1fs "
+            "(%.0f lines/s, %.1f kB/s).\n",
+            (long long) lines_.load(), (long long) bytes_.load(), seconds,
+            lines_.load() / seconds, bytes_.load() / seconds / 1e3);
+    fprintf(out, "Waited for the machine %.1fs (%.0f%%), "
+            "preparing G-Code %.1fs.\n",
+            waited, 100 * waited / seconds, seconds - waited);
+    fprintf(out, "Responses: %lld ok, %lld other (%lld resend requests).\n",
+            (long long) acknowledged_.load(),
+            (long long) other_responses_.load(),
+            (long long) resend_requests_.load());
+    if (acknowledged_.load() == 0)
+        return;
+
+    char b1[16], b2[16], b3[16], b4[16];
+    fprintf(out, "Time until 'ok': 50%% <= %s, 90%% <= %s, 99%% <= %s, "
+            "max %s\n",
+            FormatMicros(Percentile(0.5), b1, sizeof(b1)),
+            FormatMicros(Percentile(0.9), b2, sizeof(b2)),
+            FormatMicros(Percentile(0.99), b3, sizeof(b3)),
+            FormatMicros(max_latency_us_.load(), b4, sizeof(b4)));
+    int first = 0, last = kBuckets - 1;
+    while (latency_[first].load() == 0) ++first;
+    while (latency_[last].load() == 0) --last;
+    int64_t most = 0;
+    for (int i = first; i <= last; ++i)
+        most = std::max(most, latency_[i].load());
+    for (int i = first; i <= last; ++i) {
+        const int64_t count = latency_[i].load();
+        const bool open_end = (i == kBuckets - 1);
+        fprintf(out, "  %s %-8s %8lld %s\n", open_end ? "> " : "<=",
+                FormatMicros((int64_t) 1 << (open_end ? i - 1 : i),
+                             b1, sizeof(b1)),
+                (long long) count,
+                std::string(50 * count / most, '#').c_str());
+    }
+}
+
+// Send "command" and hand each line of the response to "receive", up to
+// and including the final "ok" (grbl: "ok" or "error:"). Returns 1 once
+// that arrived, 0 if it didn't within "timeout_ms" and -1 on error.
+static int Query(LineReader *machine, const char *command, int timeout_ms,
+                 const std::function<void(const char *line)> &receive) {
+    const std::string line = std::string(command) + "\n";
+    if (!machine->Write(line.data(), line.size()))
+        return -1;
+    const int64_t deadline = Millis() + timeout_ms;
+    char buffer[512];
+    for (;;) {
+        const int64_t remaining = deadline - Millis();
+        if (remaining <= 0)
+            return 0;
+        const int len = machine->ReadLine(buffer, sizeof(buffer), remaining);
+        if (len <= 0)
+            return len;
+        receive(buffer);
+        if (strncasecmp(buffer, "ok", 2) == 0
+            || strncmp(buffer, "error:", 6) == 0)
+            return 1;
+    }
+}
+
+// Remember what "line" of a response tells about the machine.
+static void ParseCapability(const char *line, MachineCapabilities *caps) {
+    const char *name = strstr(line, "FIRMWARE_NAME:");
+    int value;
+    if (strncmp(line, "Grbl ", 5) == 0) {
+        caps->grbl = true;   // "Grbl 1.1h ['$' for help]"
+        caps->firmware.assign(line, strcspn(line, "[\r\n"));
+        while (caps->firmware.back() == ' ') caps->firmware.pop_back();
+    } else if (name) {
+        name += strlen("FIRMWARE_NAME:");
+        const char *end = strstr(name, " SOURCE_CODE_URL:");
+        if (!end) end = strstr(name, " PROTOCOL_VERSION:");
+        if (!end) end = name + strcspn(name, "\r\n");
+        caps->firmware.assign(name, end - name);
+    } else if (sscanf(line, "Cap:EMERGENCY_PARSER:%d", &value) == 1) {
+        caps->emergency_parser = (value != 0);
+    } else if (sscanf(line, "Cap:RX_BUFFER_SIZE:%d", &value) == 1) {
+        caps->receive_buffer = value;
+    } else if (strncmp(line, "[VER:", 5) == 0 && caps->firmware.empty()) {
+        caps->firmware = "Grbl ";   // "[VER:1.1h.20190825:]"
+        caps->firmware.append(line + 5, strcspn(line + 5, ":]"));
+    } else if (strncmp(line, "[OPT:", 5) == 0) {
+        // grbl: "[OPT:<flags>,<planner blocks>,<receive buffer bytes>]"
+        const char *numbers = strchr(line, ',');
+        int blocks;
+        if (numbers && sscanf(numbers, ",%d,%d", &blocks, &value) == 2)
+            caps->receive_buffer = value;
+    } else if (strncasecmp(line, "ok", 2) == 0) {
+        // Marlin ADVANCED_OK: "ok N<line> P<planner> B<buffer>"
+        const char *planner = strstr(line, " P");
+        const char *buffer = strstr(line, " B");
+        if (planner && buffer) {
+            caps->advanced_ok = true;
+            caps->planner_blocks = atoi(planner + 2);
+            caps->command_buffer = atoi(buffer + 2);
+        }
+    }
+}
+
+bool DetectCapabilities(LineReader *machine, MachineCapabilities *caps) {
+    *caps = MachineCapabilities();
+    bool failed = false;   // Response with an error.
+    bool resend = false;   // .. which is a resend request.
+    auto receive = [caps, &failed, &resend](const char *line) {
+        ParseCapability(line, caps);
+        if (strncasecmp(line, "error", 5) == 0
+            || strstr(line, "Unknown command"))
+            failed = true;
+        if (strncasecmp(line, "Resend:", 7) == 0 || strncmp(line, "rs ", 3) == 0)
+            resend = true;
+    };
+
+    // Left over from before, or a greeting.
+    char buffer[512];
+    while (machine->ReadLine(buffer, sizeof(buffer), kQuietMs) > 0)
+        ParseCapability(buffer, caps);
+
+    const int64_t deadline = Millis() + kReadyTimeoutMs;
+    int probes = 0;
+    int result = 0;
+    while (result == 0 && Millis() < deadline) {
+        ++probes;
+        result = Query(machine, "M115", kProbeIntervalMs, receive);
+    }
+    if (result <= 0) {
+        fprintf(stderr, "Machine does not respond.\n");
+        return false;
+    }
+    if (probes > 1) {
+        // The earlier probes might still get an answer.
+        DiscardPendingInput(machine, kProbeIntervalMs / 2);
+    }
+
+    if (caps->grbl || failed) {
+        // grbl doesn't know M115, but tells its buffer size.
+        caps->grbl = true;
+        Query(machine, "$I", kQueryTimeoutMs, receive);
+        if (caps->receive_buffer == 0)
+            caps->receive_buffer = kDefaultReceiveBuffer;
+        return true;
+    }
+    if (caps->firmware.empty())
+        return true;   // Answers, but doesn't tell anything.
+
+    // RepRap style firmware; they usually check line numbers and checksums.
+    const char kNumbered[] = "N0 M110 N0";
+    unsigned char checksum = 0;
+    for (const char *c = kNumbered; *c; ++c) checksum ^= *c;
+    char command[32];
+    snprintf(command, sizeof(command), "%s*%d", kNumbered, checksum);
+    failed = resend = false;
+    caps->line_numbers = (Query(machine, command, kQueryTimeoutMs, receive) > 0
+                          && (!failed || resend));  // Resend: it checks.
+
+    if (caps->firmware.find("Marlin") != std::string::npos) {
+        // Define a harmless macro; without GCODE_MACROS: "Unknown command".
+        failed = false;
+        caps->macros = (Query(machine, "M810 G4 P0", kQueryTimeoutMs,
+                              receive) > 0 && !failed);
+        if (caps->receive_buffer == 0)
+            caps->receive_buffer = kDefaultReceiveBuffer;
+    }
+    return true;
+}
+
+void MachineCapabilities::Print(FILE *out) const {
+    fprintf(out, "Machine: %s",
+            firmware.empty() ? "unknown firmware" : firmware.c_str());
+    if (receive_buffer > 0)
+        fprintf(out, "; %d byte receive buffer", receive_buffer);
+    if (line_numbers) fprintf(out, "; line numbers");
+    if (macros) fprintf(out, "; macros");
+    if (emergency_parser) fprintf(out, "; emergency parser");
+    if (advanced_ok) {
+        fprintf(out, "; %d planner blocks, %d command buffers",
+                planner_blocks, command_buffer);
+    }
+    fprintf(out, "\n");
+}
+
+int DiscardPendingInput(LineReader *machine, int timeout_ms) {
+    if (machine == NULL) return 0;
+    int total_bytes = 0;
+    char buffer[512];
+    int len;
+    while ((len = machine->ReadLine(buffer, sizeof(buffer), timeout_ms)) > 0) {
+        total_bytes += len;
+        fprintf(stderr, "%s", buffer);  // echo back.
     }
     return total_bytes;
 }
 
 // 'ok' comes on a single line, maybe followed by something.
-void WaitForOkAck(int fd) {
+void WaitForOkAck(LineReader *machine) {
     char buffer[512];
     for (;;) {
-        if (ReadLine(fd, buffer, sizeof(buffer), false) < 0)
+        if (machine->ReadLine(buffer, sizeof(buffer), -1) < 0)
             break;
         if (strncasecmp(buffer, "ok", 2) == 0)
             break;
@@ -5,24 +5,214 @@
 #ifndef MACHINE_CONN_H
 #define MACHINE_CONN_H
 
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <string>
+
+#include "event-loop.h"
+
 // Open a connection to a machine. The "descriptor" is a string describing
 // the connection to the machine. This can be different ways to connect to
 // a machine.
 // Supported formats
 //   - terminal: path, optional speed "/dev/ttyUSB0,b115200"
-//   - "hostname:port"  (in fact: not yet supported, but needed for BeagleG)
+//   - TCP: "hostname:port", e.g. for BeagleG.
 //
-// Returns a bi-directional file-descriptor or -1 if opening failed.
+// Returns a bi-directional, non-blocking file-descriptor or -1 if opening
+// failed.
 int OpenMachineConnection(const char *descriptor);
 
-// While there is stuff readable on the file-descriptor, discard the input
+class SessionLog;
+
+// Write all of "data" to the machine connection "fd", waiting for it to
+// accept more as needed. If "log" is given, the data is recorded in it.
+// To wait, "writable" is used if given: a loop watching "fd" for EPOLLOUT;
+// otherwise one is created as needed.
+// Returns 'false' on error.
+bool WriteToMachine(int fd, const char *data, size_t len,
+                    SessionLog *log = NULL, EventLoop *writable = NULL);
+
+// Reads lines from a machine connection. Reads whatever is available with
+// one system call into a ring buffer and splits lines from there. Lines
+// end with '\n', '\r' or both.
+class LineReader {
+public:
+    explicit LineReader(int fd);
+
+    int fd() const { return fd_; }
+
+    // Record all lines read in "log"; also to be used by whoever writes
+    // to fd(). Not owned.
+    void set_session_log(SessionLog *log) { log_ = log; }
+    SessionLog *session_log() const { return log_; }
+
+    // Write all of "data" to the connection, recorded in the session log.
+    // Returns 'false' on error.
+    bool Write(const char *data, size_t len) {
+        return WriteToMachine(fd_, data, len, log_, &write_loop_);
+    }
+
+    // Read the next line into "buffer" of size "len"; the result ends with
+    // '\n' and is nul-terminated. Longer lines are split. Waits at most
+    // "timeout_ms" for the line to arrive, or forever with -1.
+    // Returns the length of the line, 0 on timeout or -1 on error or if the
+    // connection is closed.
+    int ReadLine(char *buffer, size_t len, int timeout_ms);
+
+    // A complete line is buffered already, so ReadLine() won't wait.
+    bool HasLine() const { return FindLineEnd() != kNotFound; }
+
+private:
+    static const size_t kSize = 4096;   // Power of two.
+    static const size_t kNotFound = (size_t) -1;
+
+    size_t FindLineEnd() const;   // Position of line ending.
+    int Fill(int timeout_ms);     // Read more; same returns as ReadLine().
+
+    const int fd_;
+    EventLoop loop_;
+    EventLoop write_loop_;        // To wait until we can write.
+    SessionLog *log_;
+    char buffer_[kSize];
+    size_t start_, end_;          // Positions in the buffer; only grow.
+    bool skip_newline_;           // Last line ended with '\r'.
+};
+
+// Statistics of the communication with a machine: how long it takes until
+// a line is acknowledged, how much goes over the wire and how long the
+// sender of the G-Code had to wait for the machine. Each counter is updated
+// by one thread, but all can be read from any thread.
+class LinkStats {
+public:
+    LinkStats();
+
+    // Microseconds on the monotonic clock, for the timestamps passed in.
+    static int64_t Micros();
+
+    // "lines" with "bytes" in total were written.
+    void Written(int lines, size_t bytes);
+
+    // A line written at "sent_us" was acknowledged at "now_us".
+    void Acknowledged(int64_t sent_us, int64_t now_us);
+
+    // A response that is not "ok": errors, resend requests, messages.
+    void OtherResponse(bool is_resend);
+
+    // The sender of the G-Code waited "us" for the machine.
+    void Waited(int64_t us);
+
+    // With "seconds" > 0, MaybeReport() prints a line that often.
+    void set_report_interval(int seconds);
+
+    // Print a line about the time since the last report, if it is time.
+    // Only to be called from one thread.
+    void MaybeReport(FILE *out);
+
+    // Print a summary of the whole session.
+    void Print(FILE *out) const;
+
+private:
+    // Latency up to 2^i microseconds; the last one all above 2^(i-1).
+    static const int kBuckets = 24;
+
+    // Upper bound of latency of "fraction" of the acknowledged lines; at
+    // most the maximum latency.
+    int64_t Percentile(double fraction) const;
+
+    static void Add(std::atomic<int64_t> *counter, int64_t value) {
+        counter->store(counter->load(std::memory_order_relaxed) + value,
+                       std::memory_order_relaxed);
+    }
+
+    const int64_t start_us_;
+    std::atomic<int64_t> lines_;
+    std::atomic<int64_t> bytes_;
+    std::atomic<int64_t> acknowledged_;
+    std::atomic<int64_t> other_responses_;
+    std::atomic<int64_t> resend_requests_;
+    std::atomic<int64_t> waited_us_;
+    std::atomic<int64_t> max_latency_us_;
+    std::atomic<int64_t> latency_[kBuckets];
+
+    // For MaybeReport()
+    int64_t report_interval_us_;
+    int64_t last_report_us_;
+    int64_t last_lines_, last_bytes_, last_waited_us_;
+};
+
+// Record of the traffic with a machine, to find out later what happened
+// or to replay it (session-replay). A compact binary file: the magic
+// "rpt2pnp-session\n", then for each write or line read
+//   varint: microseconds since the previous record, or the start.
+//   varint: length * 2 + direction (0: sent, 1: received)
+//   the data.
+// A sent record without data marks the start of the job; before it is
+// the handshake with the machine.
+// Can be used from several threads.
+class SessionLog {
+public:
+    enum Direction { SENT = 0, RECEIVED = 1 };
+
+    // Create the log "filename". Returns NULL and prints a message to
+    // stderr on error.
+    static SessionLog *Create(const char *filename);
+    ~SessionLog();
+
+    void Sent(const char *data, size_t len) { Add(SENT, data, len); }
+    void Received(const char *data, size_t len) { Add(RECEIVED, data, len); }
+    void JobStarts() { Add(SENT, "", 0); }
+
+    // Read the log "filename", calling "receive" with each record; "us" is
+    // the time since the start of the session. Returns 'false' and prints
+    // a message to stderr if it is no such log or broken.
+    static bool Read(const char *filename,
+                     const std::function<void(int64_t us, Direction dir,
+                                              const char *data,
+                                              size_t len)> &receive);
+
+private:
+    explicit SessionLog(FILE *out);
+    void Add(Direction dir, const char *data, size_t len);
+
+    FILE *const out_;
+    std::mutex mutex_;
+    int64_t last_us_;
+};
+
+// What the firmware of a machine can do, as found by DetectCapabilities().
+struct MachineCapabilities {
+    std::string firmware;           // FIRMWARE_NAME or grbl version.
+    bool grbl = false;
+    int receive_buffer = 0;         // Bytes; 0 if not known.
+    bool line_numbers = false;      // Checks line numbers and checksums.
+    bool macros = false;            // M810..M819
+    bool emergency_parser = false;  // Acts on M410 right away.
+    bool advanced_ok = false;       // "ok N<line> P<planner> B<buffer>"
+    int planner_blocks = 0;         // From advanced "ok": free when idle.
+    int command_buffer = 0;
+
+    void Print(FILE *out) const;
+};
+
+// Wait until the machine is ready and find out what its firmware can do:
+// asks with M115 (grbl: $I) until it answers, then probes for line numbers
+// and macros. Returns 'false' and prints a message to stderr if the machine
+// does not answer.
+bool DetectCapabilities(LineReader *machine, MachineCapabilities *caps);
+
+// While there is stuff readable from the machine, discard the input
 // until there is silence on the wire for "timeout_ms". Helps to get into
 // a clean state. Returns number of bytes discarded.
-int DiscardPendingInput(int fd, int timeout_ms);
+int DiscardPendingInput(LineReader *machine, int timeout_ms);
 
 // For for "ok" string that 3D printers use as 'flow control'. It is important
 // to wait for this ack after each command sent to he printer otherwise
 // commands might get lost.
-void WaitForOkAck(int fd);
+void WaitForOkAck(LineReader *machine);
 
 #endif // MACHINE_CONN_H
@@ -0,0 +1,846 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) h.zeller@acm.org. Free Software. GNU Public License v3.0 and above
+ *
+ * A stand-in for the firmware of a machine, on a pseudo terminal. For
+ * testing and measuring the connection to the machine without having one.
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <string>
+
+#include "event-loop.h"
+
+static const double kHomingFeedrate = 3000;   // mm/min
+static const double kDefaultFeedrate = 1000;  // mm/min, until we see F
+static const int kMacroSlots = 10;            // M810..M819
+static const size_t kMacroSize = 50;          // Longer ones are cut off.
+
+volatile sig_atomic_t interrupt_received = 0;
+static void InterruptHandler(int signo) {
+    interrupt_received = 1;
+}
+
+static double Seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+struct EmulatorOptions {
+    size_t receive_buffer = 128;   // Bytes.
+    size_t planner_depth = 16;     // Moves.
+    double time_scale = 1.0;       // Run this many times faster.
+    double latency = 0.001;        // Seconds until a response is sent.
+    double error_rate = 0;         // Probability that a line is corrupted.
+    double drop_rate = 0;          // Probability that a byte is lost.
+    bool flush_on_error = false;   // Discard receive buffer on resend.
+    bool grbl = false;             // Otherwise, talk like Marlin.
+    bool macros = true;            // M810..M819 (Marlin GCODE_MACROS)
+    bool advanced_ok = false;      // "ok N<line> P<planner> B<buffer>"
+};
+
+// Receives G-Code on "fd" and answers like the firmware would: lines are
+// taken out of the receive buffer when there is room in the planner and
+// acknowledged with "ok"; moves take the time their feedrate says.
+class FirmwareEmulator {
+public:
+    FirmwareEmulator(int fd, const EmulatorOptions &options, FILE *log);
+
+    // Wait until the other side sends something.
+    void AwaitConnection();
+
+    // Run until the other side hangs up or we're interrupted.
+    void Run();
+
+    void PrintStats(FILE *out) const;
+
+private:
+    // A move or dwell in the planner; "duration" in wall-clock seconds.
+    struct PlannerEntry {
+        double duration;
+    };
+
+    void Receive();
+    void QuickStop();   // Discard everything planned.
+
+    // grbl realtime commands, taken out of the data as it arrives: feed
+    // hold '!', resume '~' and soft reset 0x18. Returns the bytes kept.
+    ssize_t GrblRealtime(char *buffer, ssize_t len);
+    void Respond(const std::string &text);
+    void WriteResponses();
+    void AdvancePlanner(double now);
+    void Plan(double now, double duration);
+    void ProcessLines(double now);
+
+    // Check line number and checksum (Marlin) and remove them. Returns
+    // 'false' if the line is rejected.
+    bool CheckLineNumber(std::string *line);
+    void RequestResend(const char *reason);
+
+    // grbl commands that don't just get an "ok". Returns 'false' if "line"
+    // is none of them.
+    bool GrblCommand(const std::string &line);
+
+    // Execute the G-Code; returns 'true' if the "ok" is to be sent when
+    // the planner ran empty, as for dwell or homing.
+    bool Execute(double now, const std::string &line);
+
+    // SD card commands M20-M30, M524, with a file name "argument".
+    // Returns 'false' if "mcode" is none of them.
+    bool SDCommand(int mcode, const std::string &argument);
+
+    // While printing from the SD card: the next line of the file.
+    bool NextFileLine(std::string *line);
+
+    // Firmware macros M810-M819 (Marlin): define with commands separated
+    // by '|' in "argument", or run without. Returns 'false' if "mcode" is
+    // none of them.
+    bool MacroCommand(int mcode, const std::string &argument);
+
+    // Time to the next thing happening, in milliseconds, or -1 for none.
+    int NextTimeout(double now) const;
+
+    const int fd_;
+    const EmulatorOptions options_;
+    FILE *const log_;
+    EventLoop loop_;
+    bool hung_up_;
+
+    std::string received_;                  // The receive buffer.
+    std::deque<std::pair<double, std::string>> responses_;  // Due time, text.
+    std::string outgoing_;                  // Due; waiting to be written.
+
+    std::deque<PlannerEntry> planner_;
+    double head_done_;                      // When the first entry is done.
+    bool await_empty_planner_;              // Next line after planner done.
+    double hold_since_;                     // grbl feed hold; -1 if none.
+    bool alarm_;                            // grbl: locked until $X.
+    bool ok_after_planner_;                 // .. and "ok"; not for SD lines.
+
+    long last_line_;                        // Last good line number.
+    double position_[4];                    // X, Y, Z, E
+    bool relative_;
+    double feedrate_;
+
+    std::map<std::string, std::string> sd_files_;
+    std::string saving_to_;                 // File while M28 is active.
+    std::string sd_selected_;               // With M23.
+    size_t sd_position_;
+    bool sd_printing_;
+
+    std::string macros_[kMacroSlots];
+    std::deque<std::string> macro_lines_;   // Of the running macro.
+    bool macro_ok_;                         // "ok" when it is done.
+
+    // Statistics.
+    double start_time_;
+    long lines_;
+    long bytes_;
+    long resends_;
+    long corrupted_;
+    long overflows_;
+    long lost_bytes_;
+    long dropped_bytes_;
+    long flushed_bytes_;
+    size_t max_received_;
+    size_t max_planned_;
+    long moves_;
+    long quick_stops_;
+    long sd_lines_;
+    long macro_calls_;
+    double motion_time_;                    // Machine time; not scaled.
+    double idle_since_;                     // Planner ran empty; -1 if never.
+    double starved_time_;
+};
+
+FirmwareEmulator::FirmwareEmulator(int fd, const EmulatorOptions &options,
+                                   FILE *log)
+    : fd_(fd), options_(options), log_(log), hung_up_(false),
+      head_done_(0), await_empty_planner_(false), hold_since_(-1),
+      alarm_(false), ok_after_planner_(false),
+      last_line_(0), relative_(false), feedrate_(kDefaultFeedrate),
+      sd_position_(0), sd_printing_(false), macro_ok_(false),
+      start_time_(-1), lines_(0), bytes_(0), resends_(0), corrupted_(0),
+      overflows_(0), lost_bytes_(0), dropped_bytes_(0), flushed_bytes_(0),
+      max_received_(0), max_planned_(0),
+      moves_(0), quick_stops_(0), sd_lines_(0), macro_calls_(0),
+      motion_time_(0), idle_since_(-1), starved_time_(0) {
+    std::fill(position_, position_ + 4, 0);
+    loop_.Watch(fd_, EPOLLIN);
+    Respond(options_.grbl ? "Grbl 1.1h ['$' for help]\n" : "start\n");
+}
+
+void FirmwareEmulator::AwaitConnection() {
+    while (!interrupt_received) {
+        WriteResponses();   // The greeting.
+        if (loop_.Wait(NextTimeout(Seconds())) > 0
+            && (loop_.ready(fd_) & EPOLLIN)) {
+            return;
+        }
+    }
+}
+
+void FirmwareEmulator::Run() {
+    while (!hung_up_ && !interrupt_received) {
+        const double now = Seconds();
+        AdvancePlanner(now);
+        ProcessLines(now);
+        WriteResponses();
+        loop_.Watch(fd_, outgoing_.empty() ? EPOLLIN : EPOLLIN | EPOLLOUT);
+        if (loop_.Wait(NextTimeout(Seconds())) > 0
+            && (loop_.ready(fd_) & (EPOLLIN | EPOLLHUP))) {
+            Receive();
+        }
+    }
+}
+
+// Like a UART: what doesn't fit into the receive buffer is lost.
+void FirmwareEmulator::Receive() {
+    char buffer[4096];
+    const ssize_t r = read(fd_, buffer, sizeof(buffer));
+    if (r <= 0) {
+        if (r == 0 || (errno != EAGAIN && errno != EINTR))
+            hung_up_ = true;   // Reading the pty gives EIO then.
+        return;
+    }
+    if (start_time_ < 0) start_time_ = Seconds();
+    bytes_ += r;
+    // Like Marlin's EMERGENCY_PARSER, we look at the data as it arrives.
+    if (!options_.grbl && memmem(buffer, r, "M410", 4) != NULL)
+        QuickStop();
+    if (memmem(buffer, r, "M524", 4) != NULL) {
+        sd_printing_ = false;
+        QuickStop();
+    }
+    ssize_t kept = options_.grbl ? GrblRealtime(buffer, r) : r;
+    // A noisy line.
+    if (options_.drop_rate > 0) {
+        const ssize_t arrived = kept;
+        kept = 0;
+        for (ssize_t i = 0; i < arrived; ++i) {
+            if (drand48() < options_.drop_rate)
+                ++dropped_bytes_;
+            else
+                buffer[kept++] = buffer[i];
+        }
+    }
+    const size_t room = options_.receive_buffer - received_.size();
+    if ((size_t) kept > room) {
+        ++overflows_;
+        lost_bytes_ += kept - room;
+    }
+    received_.append(buffer, std::min((size_t) kept, room));
+    max_received_ = std::max(max_received_, received_.size());
+}
+
+ssize_t FirmwareEmulator::GrblRealtime(char *buffer, ssize_t len) {
+    ssize_t kept = 0;
+    for (ssize_t i = 0; i < len; ++i) {
+        switch (buffer[i]) {
+        case '!':
+            if (hold_since_ < 0) hold_since_ = Seconds();
+            break;
+        case '~':
+            if (hold_since_ >= 0) head_done_ += Seconds() - hold_since_;
+            hold_since_ = -1;
+            break;
+        case 0x18:
+            // Soft reset: everything received or planned is gone. Reset
+            // while moving, the position is lost.
+            if (!planner_.empty()) alarm_ = true;
+            QuickStop();
+            hold_since_ = -1;
+            await_empty_planner_ = false;
+            received_.clear();
+            kept = 0;
+            Respond("Grbl 1.1h ['$' for help]\n");
+            if (alarm_) Respond("[MSG:'$H'|'$X' to unlock]\n");
+            break;
+        default:
+            buffer[kept++] = buffer[i];
+        }
+    }
+    return kept;
+}
+
+void FirmwareEmulator::QuickStop() {
+    if (!planner_.empty()) idle_since_ = Seconds();
+    planner_.clear();
+    macro_lines_.clear();
+    ++quick_stops_;
+}
+
+void FirmwareEmulator::Respond(const std::string &text) {
+    if (options_.advanced_ok && text == "ok\n") {
+        // Like Marlin's, but with free bytes instead of command slots.
+        char buffer[64];
+        snprintf(buffer, sizeof(buffer), "ok N%ld P%zu B%zu\n", last_line_,
+                 options_.planner_depth - std::min(options_.planner_depth,
+                                                   planner_.size()),
+                 options_.receive_buffer - std::min(options_.receive_buffer,
+                                                    received_.size()));
+        responses_.push_back(std::make_pair(Seconds() + options_.latency,
+                                            std::string(buffer)));
+        return;
+    }
+    responses_.push_back(std::make_pair(Seconds() + options_.latency, text));
+}
+
+void FirmwareEmulator::WriteResponses() {
+    const double now = Seconds();
+    while (!responses_.empty() && responses_.front().first <= now) {
+        outgoing_.append(responses_.front().second);
+        responses_.pop_front();
+    }
+    while (!outgoing_.empty()) {
+        const ssize_t w = write(fd_, outgoing_.data(), outgoing_.size());
+        if (w < 0) {
+            if (errno != EAGAIN && errno != EINTR) hung_up_ = true;
+            return;
+        }
+        outgoing_.erase(0, w);
+    }
+}
+
+void FirmwareEmulator::AdvancePlanner(double now) {
+    if (hold_since_ >= 0) return;
+    while (!planner_.empty() && head_done_ <= now) {
+        planner_.pop_front();
+        if (planner_.empty())
+            idle_since_ = head_done_;
+        else
+            head_done_ += planner_.front().duration;
+    }
+}
+
+void FirmwareEmulator::Plan(double now, double duration) {
+    const PlannerEntry entry = { duration / options_.time_scale };
+    if (planner_.empty()) {
+        if (idle_since_ >= 0) starved_time_ += now - idle_since_;
+        head_done_ = now + entry.duration;
+    }
+    planner_.push_back(entry);
+    max_planned_ = std::max(max_planned_, planner_.size());
+    ++moves_;
+    motion_time_ += duration;
+}
+
+void FirmwareEmulator::ProcessLines(double now) {
+    for (;;) {
+        if (await_empty_planner_) {
+            if (!planner_.empty()) return;
+            await_empty_planner_ = false;
+            if (ok_after_planner_) Respond("ok\n");
+        }
+        if (planner_.size() >= options_.planner_depth)
+            return;
+        std::string line;
+        if (!macro_lines_.empty()) {
+            // Runs to the end before anything else is read.
+            line = macro_lines_.front();
+            macro_lines_.pop_front();
+            ok_after_planner_ = false;
+            if (Execute(now, line))
+                await_empty_planner_ = true;
+            if (macro_lines_.empty() && macro_ok_) {
+                if (await_empty_planner_) ok_after_planner_ = true;
+                else Respond("ok\n");
+            }
+            continue;
+        }
+        const size_t end = received_.find('\n');
+        if (end == std::string::npos) {
+            // Nothing from the wire; maybe from the SD card.
+            if (!sd_printing_ || !NextFileLine(&line))
+                return;
+            ++sd_lines_;
+            ok_after_planner_ = false;
+            if (Execute(now, line))
+                await_empty_planner_ = true;
+            continue;
+        }
+        line = received_.substr(0, end);
+        received_.erase(0, end + 1);
+        if (!line.empty() && line[line.size() - 1] == '\r')
+            line.resize(line.size() - 1);
+
+        if (!line.empty() && drand48() < options_.error_rate) {
+            line[lrand48() % line.size()] ^= 0x04;   // A flipped bit.
+            ++corrupted_;
+        }
+        if (!CheckLineNumber(&line))
+            continue;
+
+        const size_t comment = line.find(';');
+        if (comment != std::string::npos) line.resize(comment);
+        while (!line.empty() && isspace(line[line.size() - 1]))
+            line.resize(line.size() - 1);
+        if (line.empty()) {
+            if (options_.grbl) Respond("ok\n");   // Marlin stays quiet.
+            continue;
+        }
+        ++lines_;
+        if (log_) fprintf(log_, "%s\n", line.c_str());
+        if (!saving_to_.empty()) {
+            if (line.compare(0, 3, "M29") == 0) {
+                saving_to_.clear();
+                Respond("Done saving file.\n");
+            } else {
+                sd_files_[saving_to_].append(line).append("\n");
+            }
+            Respond("ok\n");
+            continue;
+        }
+        if (options_.grbl && GrblCommand(line))
+            continue;
+        ok_after_planner_ = true;
+        if (Execute(now, line))
+            await_empty_planner_ = true;
+        else if (macro_lines_.empty())
+            Respond("ok\n");   // Otherwise once the macro is done.
+    }
+}
+
+void FirmwareEmulator::RequestResend(const char *reason) {
+    if (options_.flush_on_error) {
+        // Like Marlin: whatever was received after the bad line is gone.
+        flushed_bytes_ += received_.size();
+        received_.clear();
+    }
+    char buffer[256];
+    snprintf(buffer, sizeof(buffer), "Error:%s, Last Line: %ld\n"
+             "Resend: %ld\nok\n", reason, last_line_, last_line_ + 1);
+    Respond(buffer);
+    ++resends_;
+}
+
+bool FirmwareEmulator::CheckLineNumber(std::string *line) {
+    const size_t star = line->rfind('*');
+    if (line->empty() || (*line)[0] != 'N') {
+        if (star != std::string::npos && !options_.grbl) {
+            RequestResend("No Line Number with checksum");
+            return false;
+        }
+        return true;
+    }
+    char *end;
+    const long number = strtol(line->c_str() + 1, &end, 10);
+    const size_t command = end - line->c_str() + (*end == ' ' ? 1 : 0);
+    if (options_.grbl) {   // Ignores line numbers and checksums.
+        line->erase(0, command);
+        const size_t grbl_star = line->rfind('*');
+        if (grbl_star != std::string::npos) line->resize(grbl_star);
+        return true;
+    }
+    if (star == std::string::npos) {
+        RequestResend("No Checksum with line number");
+        return false;
+    }
+    unsigned char checksum = 0;
+    for (size_t i = 0; i < star; ++i) checksum ^= (*line)[i];
+    if (checksum != atoi(line->c_str() + star + 1)) {
+        RequestResend("checksum mismatch");
+        return false;
+    }
+    const bool set_line_number = (line->compare(command, 4, "M110") == 0);
+    if (number != last_line_ + 1 && !set_line_number) {
+        RequestResend("Line Number is not Last Line Number+1");
+        return false;
+    }
+    last_line_ = number;
+    *line = line->substr(command, star - command);
+    return true;
+}
+
+bool FirmwareEmulator::NextFileLine(std::string *line) {
+    const std::string &file = sd_files_[sd_selected_];
+    if (sd_position_ >= file.size()) {
+        sd_printing_ = false;
+        Respond("Done printing file\n");
+        return false;
+    }
+    const size_t end = std::min(file.find('\n', sd_position_), file.size());
+    *line = file.substr(sd_position_, end - sd_position_);
+    sd_position_ = end + 1;
+    return true;
+}
+
+bool FirmwareEmulator::SDCommand(int mcode, const std::string &argument) {
+    char buffer[256];
+    switch (mcode) {
+    case 20:
+        Respond("Begin file list\n");
+        for (const auto &file : sd_files_) {
+            snprintf(buffer, sizeof(buffer), "%s %zu\n",
+                     file.first.c_str(), file.second.size());
+            Respond(buffer);
+        }
+        Respond("End file list\n");
+        return true;
+    case 21:
+        Respond("SD card ok\n");
+        return true;
+    case 23:
+        if (sd_files_.find(argument) == sd_files_.end()) {
+            snprintf(buffer, sizeof(buffer), "open failed, File: %s.\n",
+                     argument.c_str());
+            Respond(buffer);
+            return true;
+        }
+        sd_selected_ = argument;
+        sd_position_ = 0;
+        snprintf(buffer, sizeof(buffer), "File opened: %s Size: %zu\n"
+                 "File selected\n", argument.c_str(),
+                 sd_files_[argument].size());
+        Respond(buffer);
+        return true;
+    case 24:
+        sd_printing_ = !sd_selected_.empty();
+        return true;
+    case 25:
+    case 524:
+        sd_printing_ = false;
+        return true;
+    case 27:
+        if (sd_printing_) {
+            snprintf(buffer, sizeof(buffer), "SD printing byte %zu/%zu\n",
+                     sd_position_, sd_files_[sd_selected_].size());
+            Respond(buffer);
+        } else {
+            Respond("Not SD printing\n");
+        }
+        return true;
+    case 28:
+        saving_to_ = argument;
+        sd_files_[argument].clear();
+        snprintf(buffer, sizeof(buffer), "Writing to file: %s\n",
+                 argument.c_str());
+        Respond(buffer);
+        return true;
+    case 29:
+        return true;   // Not writing.
+    case 30:
+        if (sd_files_.erase(argument) == 0) {
+            snprintf(buffer, sizeof(buffer), "Deletion failed, File: %s.\n",
+                     argument.c_str());
+        } else {
+            snprintf(buffer, sizeof(buffer), "File deleted:%s\n",
+                     argument.c_str());
+        }
+        Respond(buffer);
+        return true;
+    }
+    return false;
+}
+
+bool FirmwareEmulator::MacroCommand(int mcode, const std::string &argument) {
+    if (mcode < 810 || mcode >= 810 + kMacroSlots || options_.grbl)
+        return false;
+    if (!options_.macros) {
+        Respond("echo:Unknown command: \"M" + std::to_string(mcode)
+                + (argument.empty() ? "" : " ") + argument + "\"\n");
+        return true;
+    }
+    std::string &macro = macros_[mcode - 810];
+    if (!argument.empty()) {
+        macro = argument.substr(0, kMacroSize);
+        return true;
+    }
+    if (!macro_lines_.empty())
+        return true;   // Not from within a macro.
+    for (size_t pos = 0; pos <= macro.size(); /**/) {
+        const size_t end = std::min(macro.find('|', pos), macro.size());
+        if (end > pos) macro_lines_.push_back(macro.substr(pos, end - pos));
+        pos = end + 1;
+    }
+    macro_ok_ = ok_after_planner_;
+    ++macro_calls_;
+    return true;
+}
+
+bool FirmwareEmulator::GrblCommand(const std::string &line) {
+    char buffer[128];
+    if (line == "$I") {
+        snprintf(buffer, sizeof(buffer), "[VER:1.1h.20190825:]\n"
+                 "[OPT:V,%zu,%zu]\nok\n",
+                 options_.planner_depth, options_.receive_buffer);
+        Respond(buffer);
+        return true;
+    }
+    if (line == "$X") {
+        alarm_ = false;
+        Respond("[MSG:Caution: Unlocked]\nok\n");
+        return true;
+    }
+    if (alarm_ && line[0] != '$') {
+        Respond("error:9\n");    // G-code locked out during alarm.
+        return true;
+    }
+    if (line == "M115") {
+        Respond("error:20\n");   // Unsupported command.
+        return true;
+    }
+    return false;
+}
+
+bool FirmwareEmulator::Execute(double now, const std::string &line) {
+    if (line[0] == 'M') {
+        // SD card commands have a file name, which is not G-Code.
+        char *end;
+        const int mcode = strtol(line.c_str() + 1, &end, 10);
+        while (isspace(*end)) ++end;
+        if (SDCommand(mcode, end) || MacroCommand(mcode, end))
+            return false;
+    }
+    double target[4];
+    std::copy(position_, position_ + 4, target);
+    bool axis_given[4] = { false, false, false, false };
+    bool move = false, relative_move = false;
+    bool home = false, set_position = false, dwell = false;
+    int mcode = -1;
+    double p = 0, s = 0;
+    long n = -1;
+
+    const char *pos = line.c_str();
+    while (*pos) {
+        const char letter = toupper(*pos++);
+        if (!isalpha(letter)) continue;
+        char *end;
+        const double value = strtod(pos, &end);
+        if (end == pos) continue;
+        pos = end;
+        switch (letter) {
+        case 'G':
+            switch ((int) value) {
+            case 0: case 1: move = true; relative_move = relative_; break;
+            case 4: dwell = true; break;
+            case 28: home = true; break;
+            case 90: relative_ = false; break;
+            case 91: relative_ = true; break;
+            case 92: set_position = true; break;
+            }
+            break;
+        case 'M': mcode = (int) value; break;
+        case 'F': feedrate_ = value; break;
+        case 'P': p = value; break;
+        case 'S': s = value; break;
+        case 'N': n = (long) value; break;
+        case 'X': case 'Y': case 'Z': case 'E': {
+            const int axis = (letter == 'E') ? 3 : letter - 'X';
+            target[axis] = value;
+            axis_given[axis] = true;
+            break;
+        }
+        }
+    }
+
+    if (home) {
+        const bool all = !(axis_given[0] || axis_given[1] || axis_given[2]);
+        double distance = 0;
+        for (int a = 0; a < 3; ++a) {
+            if (!all && !axis_given[a]) continue;
+            distance = std::max(distance, fabs(position_[a]));
+            position_[a] = 0;
+        }
+        Plan(now, distance / (kHomingFeedrate / 60));
+        return true;
+    }
+    if (set_position) {
+        for (int a = 0; a < 4; ++a) {
+            if (axis_given[a]) position_[a] = target[a];
+        }
+        return false;
+    }
+    if (move) {
+        double d[4];
+        for (int a = 0; a < 4; ++a) {
+            if (relative_move && axis_given[a])
+                target[a] = position_[a] + target[a];
+            d[a] = target[a] - position_[a];
+            position_[a] = target[a];
+        }
+        double distance = sqrt(d[0]*d[0] + d[1]*d[1] + d[2]*d[2]);
+        if (distance == 0) distance = fabs(d[3]);
+        if (feedrate_ > 0) Plan(now, distance / (feedrate_ / 60));
+        return false;
+    }
+    if (dwell) {
+        Plan(now, p > 0 ? p / 1000 : s);
+        return true;
+    }
+    switch (mcode) {
+    case 110:   // Set line number; also without line number and checksum.
+        if (n >= 0) last_line_ = n;
+        return false;
+    case 400:   // Finish moves.
+        return true;
+    case 115: {
+        char buffer[256];
+        snprintf(buffer, sizeof(buffer),
+                 "FIRMWARE_NAME:rpt2pnp machine-emulator (Marlin compatible) "
+                 "PROTOCOL_VERSION:1.0\n"
+                 "Cap:EMERGENCY_PARSER:1\n"
+                 "Cap:SDCARD:1\n"
+                 "Cap:RX_BUFFER_SIZE:%zu\n", options_.receive_buffer);
+        Respond(buffer);
+        return false;
+    }
+    }
+    return false;
+}
+
+int FirmwareEmulator::NextTimeout(double now) const {
+    double next = -1;
+    if (!responses_.empty())
+        next = responses_.front().first;
+    if (!planner_.empty() && hold_since_ < 0
+        && (next < 0 || head_done_ < next))
+        next = head_done_;
+    if (next < 0)
+        return -1;
+    return std::max(0, (int) ceil((next - now) * 1000));
+}
+
+void FirmwareEmulator::PrintStats(FILE *out) const {
+    const double elapsed = start_time_ < 0 ? 0 : Seconds() - start_time_;
+    fprintf(out, "Received %ld lines, %ld bytes in %.2fs; "
+            "%ld corrupted, %ld resend requests.\n",
+            lines_, bytes_, elapsed, corrupted_, resends_);
+    fprintf(out, "Receive buffer: up to %zu of %zu bytes used; "
+            "%ld overflows lost %ld bytes.\n",
+            max_received_, options_.receive_buffer, overflows_, lost_bytes_);
+    if (dropped_bytes_ > 0 || flushed_bytes_ > 0) {
+        fprintf(out, "Line noise: %ld bytes dropped; %ld bytes discarded "
+                "on resend requests.\n", dropped_bytes_, flushed_bytes_);
+    }
+    if (sd_lines_ > 0)
+        fprintf(out, "SD card: %ld lines printed.\n", sd_lines_);
+    if (macro_calls_ > 0)
+        fprintf(out, "Macros: %ld calls.\n", macro_calls_);
+    fprintf(out, "Planner: %ld moves, %.2fs machine time; up to %zu of %zu "
+            "entries used; ran empty for %.2fs; %ld quick stops.\n",
+            moves_, motion_time_, max_planned_, options_.planner_depth,
+            starved_time_, quick_stops_);
+}
+
+static int usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [options]\n"
+            "Pretends to be the firmware of a machine on a pseudo terminal.\n"
+            "Prints the terminal name to connect to, e.g. with "
+            "rpt2pnp -m<tty>,\nand runs until the connection is closed.\n"
+            "Options:\n"
+            "\t-b<bytes>: Receive buffer size. Default 128.\n"
+            "\t-p<n>    : Planner queue depth. Default 16.\n"
+            "\t-t<factor>: Run moves this many times faster. Default 1.\n"
+            "\t-l<ms>   : Latency of responses. Default 1.\n"
+            "\t-e<p>    : Corrupt lines with probability p, e.g. 0.01\n"
+            "\t-d<p>    : Drop received bytes with probability p.\n"
+            "\t-f       : Discard the receive buffer when asking for a\n"
+            "\t           resend, like Marlin.\n"
+            "\t-s<seed> : Seed for the corruption.\n"
+            "\t-g       : Behave like grbl instead of Marlin.\n"
+            "\t-M       : No firmware macros M810..M819.\n"
+            "\t-a       : Advanced 'ok' with free planner entries and\n"
+            "\t           receive buffer bytes.\n"
+            "\t-o<file> : Log received G-Code to file.\n"
+            "\t-L<link> : Create a symbolic link to the terminal.\n",
+            prog);
+    return 1;
+}
+
+int main(int argc, char *argv[]) {
+    EmulatorOptions options;
+    const char *log_filename = NULL;
+    const char *link_name = NULL;
+    long seed = 1;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "b:p:t:l:e:d:fs:gMao:L:")) != -1) {
+        switch (opt) {
+        case 'b': options.receive_buffer = atoi(optarg); break;
+        case 'p': options.planner_depth = atoi(optarg); break;
+        case 't': options.time_scale = atof(optarg); break;
+        case 'l': options.latency = atof(optarg) / 1000; break;
+        case 'e': options.error_rate = atof(optarg); break;
+        case 'd': options.drop_rate = atof(optarg); break;
+        case 'f': options.flush_on_error = true; break;
+        case 's': seed = atol(optarg); break;
+        case 'g': options.grbl = true; break;
+        case 'M': options.macros = false; break;
+        case 'a': options.advanced_ok = true; break;
+        case 'o': log_filename = optarg; break;
+        case 'L': link_name = optarg; break;
+        default:
+            return usage(argv[0]);
+        }
+    }
+    if (options.receive_buffer < 1 || options.planner_depth < 1
+        || options.time_scale <= 0) {
+        fprintf(stderr, "Invalid buffer, planner or time scale.\n");
+        return usage(argv[0]);
+    }
+    srand48(seed);
+
+    const int fd = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0 || grantpt(fd) < 0 || unlockpt(fd) < 0) {
+        perror("Creating pseudo terminal");
+        return 1;
+    }
+    const char *tty_name = ptsname(fd);
+
+    // Keep the terminal open ourselves until someone connects; reading
+    // fails while nobody has it open.
+    int tty = open(tty_name, O_RDWR | O_NOCTTY);
+    struct termios raw;
+    if (tty < 0 || tcgetattr(tty, &raw) < 0) {
+        perror(tty_name);
+        return 1;
+    }
+    cfmakeraw(&raw);
+    tcsetattr(tty, TCSANOW, &raw);
+
+    if (link_name) {
+        unlink(link_name);
+        if (symlink(tty_name, link_name) < 0) {
+            perror(link_name);
+            return 1;
+        }
+    }
+    FILE *log = NULL;
+    if (log_filename && (log = fopen(log_filename, "w")) == NULL) {
+        perror(log_filename);
+        return 1;
+    }
+    printf("%s\n", link_name ? link_name : tty_name);
+    fflush(stdout);
+
+    signal(SIGTERM, InterruptHandler);
+    signal(SIGINT, InterruptHandler);
+
+    FirmwareEmulator emulator(fd, options, log);
+    // Once the other side said something, we let go of the terminal: from
+    // then on, the connection closing ends the session.
+    emulator.AwaitConnection();
+    close(tty);
+    emulator.Run();
+    emulator.PrintStats(stderr);
+
+    if (log) fclose(log);
+    if (link_name) unlink(link_name);
+    close(fd);
+    return 0;
+}
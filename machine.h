@@ -7,17 +7,58 @@
 
 #include <stdio.h>
 
+#include <deque>
 #include <string>
 #include <set>
 #include <functional>
+#include <unordered_set>
+#include <vector>
+
+#include "gcode-compactor.h"
+#include "gcode-template.h"
+#include "pnp-config.h"
+#include "rpt2pnp.h"
 
-struct PnPConfig;
 struct Dimension;
 struct Part;
 struct Pad;
-struct Position;
 
 class Tape;
+class MotionSimulator;
+class OutputSink;
+class GCodeStreamer;
+
+// A planned operation; a run of these can be handed to a machine at once.
+// Parts, pads and tapes are referenced, not copied; they need to stay valid
+// until the machine is finished.
+struct MachineOp {
+    enum Type { PICK, PLACE, DISPENSE, DISPENSE_STROKE };
+
+    static MachineOp Pick(const Part &part, const Tape *tape, int nozzle) {
+        return MachineOp(PICK, &part, tape, nozzle, NULL, NULL);
+    }
+    static MachineOp Place(const Part &part, const Tape *tape, int nozzle) {
+        return MachineOp(PLACE, &part, tape, nozzle, NULL, NULL);
+    }
+    static MachineOp Dispense(const Part &part, const Pad &pad) {
+        return MachineOp(DISPENSE, &part, NULL, 0, &pad, NULL);
+    }
+    static MachineOp DispenseStroke(const Part &part, const PadRow &row) {
+        return MachineOp(DISPENSE_STROKE, &part, NULL, 0, NULL, &row);
+    }
+
+    Type type;
+    const Part *part;
+    const Tape *tape;    // PICK, PLACE: tape as it is at this step. Can be NULL.
+    int nozzle;          // PICK, PLACE
+    const Pad *pad;      // DISPENSE
+    const PadRow *row;   // DISPENSE_STROKE
+
+private:
+    MachineOp(Type t, const Part *p, const Tape *tp, int n,
+              const Pad *pd, const PadRow *r)
+        : type(t), part(p), tape(tp), nozzle(n), pad(pd), row(r) {}
+};
 
 // A machine provides the actions.
 class Machine {
@@ -30,75 +71,329 @@ public:
                       const std::string &init_comment,
                       const Dimension &dimension) = 0;
 
-    // Pick "part" from given "tape". Tape provides absolute positions,
+    // Pick "part" from given "tape" with the given "nozzle" (index into
+    // the configured nozzles). Tape provides absolute positions,
     // Part-position is relative to configured board origin.
     // The "tape" can be null in which case this operation might not succeed.
-    virtual void PickPart(const Part &part, const Tape *tape) = 0;
+    // With multiple nozzles, several parts are picked in a row before they
+    // are placed.
+    virtual void PickPart(const Part &part, const Tape *tape, int nozzle) = 0;
 
-    // Place "part" coming from "tape" on board.
+    // Place "part" coming from "tape" on board; it has been picked with
+    // "nozzle" before.
     // Tape provides absolute positions, Part-position is relative to
     // configured board origin.
     // The "tape" can be null in which case this operation might not succeed.
-    virtual void PlacePart(const Part &part, const Tape *tape) = 0;
+    virtual void PlacePart(const Part &part, const Tape *tape, int nozzle) = 0;
 
     // Dispense "pad".
     virtual void Dispense(const Part &part, const Pad &pad) = 0;
 
+    // Dispense a row of equally sized pads in one continuous stroke from
+    // the first to the last pad.
+    virtual void DispenseStroke(const Part &part,
+                                const std::vector<const Pad *> &row) = 0;
+
+    // Execute "count" operations in a row. The default calls the methods
+    // above for each of them; machines can override this to handle the
+    // whole run in one pass.
+    virtual void Execute(const MachineOp *ops, size_t count);
+
     // Finish - shut down machine etc.
     virtual void Finish() = 0;
+
+    // Stop as fast as possible, e.g. when interrupted, and leave the
+    // machine in a safe state. Instead of Finish(). The default finishes
+    // regularly.
+    virtual void Abort() { Finish(); }
 };
 
+// Call the single-operation methods of "machine" for each of the "ops".
+// For a final machine class, the calls are not virtual.
+template <class M>
+void ExecuteEach(M *machine, const MachineOp *ops, size_t count) {
+    for (const MachineOp *op = ops; op < ops + count; ++op) {
+        switch (op->type) {
+        case MachineOp::PICK:
+            machine->PickPart(*op->part, op->tape, op->nozzle);
+            break;
+        case MachineOp::PLACE:
+            machine->PlacePart(*op->part, op->tape, op->nozzle);
+            break;
+        case MachineOp::DISPENSE:
+            machine->Dispense(*op->part, *op->pad);
+            break;
+        case MachineOp::DISPENSE_STROKE:
+            machine->DispenseStroke(*op->part, *op->row);
+            break;
+        }
+    }
+}
+
+inline void Machine::Execute(const MachineOp *ops, size_t count) {
+    ExecuteEach(this, ops, count);
+}
+
 // A machine
-class GCodeMachine : public Machine {
+class GCodeMachine final : public Machine {
 public:
-    GCodeMachine(FILE *output, float init_ms, float area_ms);
-    GCodeMachine(int input_fd, int output_fd, float init_ms, float area_ms);
+    GCodeMachine(OutputSink *output, float init_ms, float area_ms);
+    // Send to a machine through "streamer".
+    GCodeMachine(GCodeStreamer *streamer, float init_ms, float area_ms);
+
+    // Send the G-Code line by line to "write_line"; each line includes the
+    // newline.
+    GCodeMachine(std::function<void(const char *str, size_t len)> write_line,
+                 float init_ms, float area_ms);
+
+    // State carried from one operation to the next.
+    struct State {
+        State() : last_pos_known(false),
+                  current_acceleration(0), current_z_acceleration(0) {}
+        std::vector<float> current_angle;  // Last rotation per nozzle; deg.
+        bool last_pos_known;
+        Position last_pos;       // Last XY position of the head we moved to.
+        float current_acceleration;    // Last emitted; 0 if unknown.
+        float current_z_acceleration;
+    };
+
+    // A machine writing to "write_line" with the same settings and templates
+    // as "prototype".
+    GCodeMachine(const GCodeMachine &prototype,
+                 std::function<void(const char *str, size_t len)> write_line);
 
     void set_homing(bool h) { do_homing_ = h; }
 
+    // In a dry run, only the state is updated, but nothing is sent and no
+    // messages are printed.
+    void set_dry_run(bool d) { dry_run_ = d; }
+
+    // The current state, e.g. to continue with another machine from there.
+    const State &state() const { return state_; }
+
+    // Continue a job with the given "config" at "state" without sending
+    // anything; instead of Init().
+    void Resume(const PnPConfig *config, const State &state);
+
+    // Replace built-in G-Code templates with the ones found in the file.
+    // Returns 'false' and prints a message to stderr on error.
+    bool LoadTemplates(const char *filename);
+
+    // Print all the built-in templates in the file format LoadTemplates()
+    // understands.
+    static void PrintDefaultTemplates(FILE *out);
+
+    // Compact the G-Code before sending: no comments, no repeated modal
+    // words. Default on when connected to a machine, otherwise off.
+    void set_compact(bool c) { compact_ = c; }
+    bool compact() const { return compact_; }
+
+    // Send the parts of pick, place and dispense that are the same for many
+    // operations as firmware macros (Marlin M810..M819), using up to
+    // "slots" of them; 0 to switch off. A sequence is defined as macro the
+    // second time it is seen, and called from then on. Only used with
+    // compacted G-Code.
+    void set_macro_slots(int slots);
+
+    // The firmware is grbl, which knows no M410: when interrupted, stop
+    // with its realtime commands feed hold and soft reset instead. The
+    // quick-stop template is then empty unless loaded with LoadTemplates().
+    void set_grbl(bool grbl);
+
+    // Sending to the machine failed; the job is incomplete. Reported on
+    // Finish().
+    bool failed() const { return failed_; }
+
     bool Init(const PnPConfig *config, const std::string &init_comment,
               const Dimension &dimension) override;
-    void PickPart(const Part &part, const Tape *tape) override;
-    void PlacePart(const Part &part, const Tape *tape) override;
+    void PickPart(const Part &part, const Tape *tape, int nozzle) override;
+    void PlacePart(const Part &part, const Tape *tape, int nozzle) override;
     void Dispense(const Part &part, const Pad &pad) override;
+    void DispenseStroke(const Part &part,
+                        const std::vector<const Pad *> &row) override;
+    void Execute(const MachineOp *ops, size_t count) override;
     void Finish() override;
+    void Abort() override;
 
 private:
-    GCodeMachine(std::function<void(const char *str, size_t len)> write_line,
-                 float init_ms, float area_ms);
+    // Values derived from the configuration that are the same for all
+    // operations; computed once per Execute().
+    struct RunConstants;
+    RunConstants ComputeRunConstants() const;
+
+    void EmitPick(const RunConstants &c,
+                  const Part &part, const Tape *tape, int nozzle);
+    void EmitPlace(const RunConstants &c,
+                   const Part &part, const Tape *tape, int nozzle);
+    void EmitDispense(const RunConstants &c, const Part &part, const Pad &pad);
+    void EmitDispenseStroke(const RunConstants &c, const Part &part,
+                            const std::vector<const Pad *> &row);
+
+    // "component (footprint@value)" for the comments; valid until next call.
+    const char *PrintName(const Part &part);
 
-    // Define this with empty, if you're not using gcc.
-#define PRINTF_FMT_CHECK(fmt_pos, args_pos)             \
-    __attribute__ ((format (printf, fmt_pos, args_pos)))
+    // Position on the way from the last position to "target" from which we
+    // go down to the target; "target" itself unless gliding down is
+    // configured. Positions are of the head, not the nozzle.
+    Position DescentStart(const Position &target) const;
 
-    // Send the commands to the write_line_() function, line by line.
-    void SendFormattedCommands(const char *format, ...) PRINTF_FMT_CHECK(2, 3);
+    // Motion profile for the components on the given tape.
+    const MotionProfile &ProfileFor(const Tape *tape) const;
 
-#undef PRINTF_FMT_CHECK
+    // Emit acceleration commands for the upcoming xy and z moves if
+    // they changed.
+    void SetAcceleration(const MotionProfile::Phase &xy,
+                         const MotionProfile::Phase &z);
+
+    // Expand the template (a TemplateId) with the given arguments and send
+    // the commands to the write_line_() function, line by line.
+    template <typename... Args>
+    void SendFormattedCommands(int template_id, Args... args) {
+        // Leading dummy element to not have a zero-sized array.
+        const GCodeTemplate::Arg list[] = { 0, args... };
+        SendExpanded(template_id, list + 1, sizeof...(args));
+    }
+    void SendExpanded(int template_id,
+                      const GCodeTemplate::Arg *args, size_t arg_count);
+
+    // Send the compacted lines collected in macro_run_; as a call to a
+    // firmware macro if possible.
+    void FlushMacroRun();
 
     std::function<void(const char *str, size_t len)> const write_line_;
+    OutputSink *sink_;       // If we write to a sink; synced on Finish().
+    GCodeStreamer *streamer_;  // If we talk to a machine; flushed on Finish().
     const float init_ms_;
     const float area_ms_;
     const PnPConfig *config_;
     bool do_homing_;
+    bool dry_run_;
+    bool grbl_;
+    bool failed_;
+    State state_;
+    std::string line_buffer_;       // Re-used for each line we send.
+    std::string name_buffer_;       // Re-used for names in comments.
+    bool compact_;
+    GCodeCompactor compactor_;
+    std::string compact_buffer_;
+    std::vector<GCodeTemplate> templates_;  // Indexed by TemplateId.
+
+    // Firmware macros: the body of each slot, with newlines; empty if free.
+    struct Macro {
+        std::string body;
+        uint64_t last_use;
+    };
+    std::vector<Macro> macros_;
+    std::unordered_set<std::string> macro_candidates_;  // Seen once.
+    std::string macro_run_;      // Lines collected for the next macro.
+    int macro_run_lines_;
+    uint64_t macro_clock_;
+    long macro_calls_;
+    long macro_lines_;           // Lines sent as part of macro calls.
+};
+
+// A machine that doesn't move anything but estimates how long the job takes
+// by simulating the G-Code a GCodeMachine would send. Prints the time spent
+// in each phase on Finish().
+class TimeEstimateMachine : public Machine {
+public:
+    TimeEstimateMachine(OutputSink *output, float init_ms, float area_ms);
+    ~TimeEstimateMachine();
+
+    bool Init(const PnPConfig *config, const std::string &init_comment,
+              const Dimension &dimension) override;
+    void PickPart(const Part &part, const Tape *tape, int nozzle) override;
+    void PlacePart(const Part &part, const Tape *tape, int nozzle) override;
+    void Dispense(const Part &part, const Pad &pad) override;
+    void DispenseStroke(const Part &part,
+                        const std::vector<const Pad *> &row) override;
+    void Execute(const MachineOp *ops, size_t count) override;
+    void Finish() override;
+
+    // The machine generating the G-Code we simulate, e.g. to load templates.
+    GCodeMachine *gcode_machine() { return &gcode_; }
+
+private:
+    OutputSink *const output_;
+    MotionSimulator *simulator_;
+    GCodeMachine gcode_;
+    int picks_;
+    int dispense_count_;
+};
+
+// A machine emitting the same G-Code as the GCodeMachine, but formatting it
+// on multiple threads. The operations are recorded with a snapshot of their
+// tape and emitted on Finish(): the job is split into chunks, a dry run
+// determines the machine state at the start of each chunk, then chunks
+// are formatted in parallel into their own buffers and written in order.
+class ParallelGCodeMachine : public Machine {
+public:
+    ParallelGCodeMachine(OutputSink *output, float init_ms, float area_ms,
+                         int threads);
+    ~ParallelGCodeMachine();
+
+    bool Init(const PnPConfig *config, const std::string &init_comment,
+              const Dimension &dimension) override;
+    void PickPart(const Part &part, const Tape *tape, int nozzle) override;
+    void PlacePart(const Part &part, const Tape *tape, int nozzle) override;
+    void Dispense(const Part &part, const Pad &pad) override;
+    void DispenseStroke(const Part &part,
+                        const std::vector<const Pad *> &row) override;
+    void Execute(const MachineOp *ops, size_t count) override;
+    void Finish() override;
+
+    // Settings and templates to emit G-Code with.
+    GCodeMachine *gcode_machine() { return &prototype_; }
+
+private:
+    // Remember operation for later; with a copy of the tape and pad row,
+    // as these might change or go away.
+    void Record(const MachineOp &op);
+
+    // Write "buffer" to the output; compacted if requested.
+    void Write(const std::string &buffer, GCodeCompactor *compactor);
+
+    OutputSink *const output_;
+    const int threads_;
+    GCodeMachine prototype_;
+    const PnPConfig *config_;
+    std::string init_comment_;
+    Dimension dimension_;
+    std::vector<MachineOp> operations_;
+    std::deque<Tape> tapes_;       // Snapshots referenced by operations_.
+    std::deque<PadRow> rows_;
 };
 
 // A machine simulation that just shows the oiutput in postscript.
-class PostScriptMachine : public Machine {
+class PostScriptMachine final : public Machine {
 public:
-    PostScriptMachine(FILE *output);
+    PostScriptMachine(OutputSink *output);
 
     bool Init(const PnPConfig *config, const std::string &init_comment,
               const Dimension &dimension) override;
-    void PickPart(const Part &part, const Tape *tape) override;
-    void PlacePart(const Part &part, const Tape *tape) override;
+    void PickPart(const Part &part, const Tape *tape, int nozzle) override;
+    void PlacePart(const Part &part, const Tape *tape, int nozzle) override;
     void Dispense(const Part &part, const Pad &pad) override;
+    void DispenseStroke(const Part &part,
+                        const std::vector<const Pad *> &row) override;
+    void Execute(const MachineOp *ops, size_t count) override;
     void Finish() override;
 
 private:
-    FILE *const output_;
+    // Print outline of part the first time we dispense on it.
+    void PrintDispensePart(const Part &part);
+
+    // Draw the path of the head from the last position to "pos"; each
+    // batch of picks and places gets its own color.
+    void PrintTrip(const Position &pos, bool is_pick);
+
+    OutputSink *const output_;
     const PnPConfig *config_;
     std::set<const Part *> dispense_parts_printed_;
+    std::set<const Part *> picked_parts_;
+    int batch_;                 // Number of current pick/place batch.
+    bool last_was_pick_;
+    Position trip_pos_;         // Last position on the trip path.
 };
 
 #endif  // MACHINE_H_
@@ -10,6 +10,7 @@
 #include <signal.h>
 
 #include <algorithm>
+#include <deque>
 #include <functional>
 #include <string>
 #include <vector>
@@ -22,7 +23,10 @@
 #include "machine.h"
 #include "rpt-parser.h"
 #include "rpt2pnp.h"
+#include "sd-card-job.h"
+#include "gcode-streamer.h"
 #include "machine-connection.h"
+#include "output-sink.h"
 #include "terminal-jog-config.h"
 
 volatile sig_atomic_t interrupt_received = 0;
@@ -36,6 +40,13 @@ static void InterruptHandler(int signo) {
 static const float minimum_milliseconds = 50;
 static const float area_to_milliseconds = 25;  // mm^2 to milliseconds.
 
+// Rows of pads that are dispensed in one stroke with -s.
+static const int stroke_min_pads = 3;
+static const float stroke_max_pitch = 1.3;    // mm. Up to SOIC 1.27mm pitch.
+
+// Firmware macros to use if the machine has them; Marlin default.
+static const int default_macro_slots = 5;
+
 static int usage(const char *prog) {
     fprintf(stderr, "Usage: %s [-l|-d|-p] <options> <rpt-file>\n"
             "Options:\n"
@@ -48,9 +59,33 @@ static int usage(const char *prog) {
             "\n[Output]\n"
             "\tDefault output is gcode to stdout\n"
             "\t-P      : Preview: Output as PostScript instead of GCode.\n"
-            "\t-O<file>: Output to specified file instead of stdout\n"
+            "\t-E      : Estimate time the job takes instead of GCode.\n"
+            "\t-O<file>: Output to specified file instead of stdout.\n"
+            "\t          Files ending in .gz are gzip compressed.\n"
+            "\t-M      : Write -O file through a memory mapping.\n"
+            "\t-k      : Compact GCode: no comments, no repeated modal words.\n"
+            "\t          Always done when connected to the machine.\n"
+            "\t-F<n>   : Send recurring parts of pick, place and dispense\n"
+            "\t          as firmware macros M810.. using up to n of them\n"
+            "\t          (Marlin GCODE_MACROS). Implies -k; not with -j.\n"
+            "\t          Default 5 if the machine has macros; -F0: off.\n"
+            "\t-j<n>   : Format GCode output with n threads.\n"
             "\t-m<tty> : Directly connect to machine. "
             "Sample \"/dev/ttyACM0,b115200\"\n"
+            "\t          or via network with host:port, e.g. "
+            "\"beagleg:4444\"\n"
+            "\t-w<bytes>: Stream to machine, keeping up to this many bytes\n"
+            "\t          in its receive buffer. Default: as the machine\n"
+            "\t          reports; if unknown 0: wait for 'ok' after each line.\n"
+            "\t-n      : Send line numbers and checksums to the machine;\n"
+            "\t          resend lines it didn't receive correctly. Default\n"
+            "\t          when streaming with -w and the machine checks them.\n"
+            "\t-i<sec> : Print statistics of the machine connection\n"
+            "\t          every sec seconds.\n"
+            "\t-u<file>: Upload job to SD card of the machine as file\n"
+            "\t          and print it from there.\n"
+            "\t-R<file>: Record everything sent to and received from the\n"
+            "\t          machine with timestamps, for session-replay.\n"
             "\n[Choice of components to handle]\n"
             "\t-b      : Handle back-of-board (default: front)\n"
             "\t-x<list>: Comma-separated list of component references "
@@ -63,6 +98,11 @@ static int usage(const char *prog) {
             "\t-D<init-ms,area-to-ms> : Milliseconds to leave pressure on to\n"
             "\t            dispense. init-ms is initial offset, area-to-ms is\n"
             "\t            milliseconds per mm^2 area covered.\n"
+            "\t-s          : Dispense rows of fine-pitch pads in one\n"
+            "\t            continuous stroke instead of individual dots.\n"
+            "\t-g <file>   : Read G-Code templates from file.\n"
+            "\t-G          : Print built-in G-Code templates to stdout; use\n"
+            "\t            as starting point for a template file.\n"
             "\n[Homer config]\n"
             "\t-H          : Create homer configuration template to stdout.\n"
             "\t-C <config> : Use homer config created via homer from -H\n",
@@ -103,6 +143,25 @@ void CreateConfigTemplate(const Board& board) {
 
     printf("Board:\norigin: %.0f %.0f 1.6 # x/y/z origin of the board; (z=thickness).\n\n", origin_x, origin_y);
 
+    printf("# Motion profiles: speed in mm/s and optional acceleration in "
+           "mm/s^2\n# for moving empty (travel), with component (loaded) "
+           "and up/down (descent).\n# 'default' is used for all tapes "
+           "without 'profile:', 'dispense' for dispensing.\n");
+    printf("#Motion-Profile: default\n#travel:  1000 3000\n#loaded:  100\n"
+           "#descent: 66\n");
+    printf("#Motion-Profile: heavy\n#loaded:  30 500\n\n");
+
+    printf("# Nozzles of the pick-n-place head; default is one nozzle. With\n"
+           "# multiple, parts for all of them are picked before placing.\n"
+           "# x/y offset relative to first nozzle, the axes for up/down and\n"
+           "# rotation, the M42 pin for vacuum and optionally the one to blow\n"
+           "# (only the offset is needed with a single nozzle)\n");
+    printf("#Nozzle: 0 0  Z E 6 8\n#Nozzle: 20 0 A B 9 10\n\n");
+
+    printf("# Glide down diagonally from this many mm before each pick and "
+           "place\n# instead of descending vertically. Only without tall "
+           "parts around.\n#Glide-Down: 10\n\n");
+
     printf("# Where the tray with all the tapes start.\n");
     printf("Tape-Tray-Origin: 0 %.1f 0\n\n", origin_y + board.dimension().h);
 
@@ -111,6 +170,8 @@ void CreateConfigTemplate(const Board& board) {
     printf("# e.g. smd0805@100n smd0805@0.1uF, then you can just put them\n");
     printf("# space delimited behind each Tape:\n");
     printf("#   Tape: smd0805@100n smd0805@0.1uF\n");
+    printf("# The same component can also be on multiple tapes; the closest\n");
+    printf("# tape is used, and others once it is exhausted.\n");
     printf("# Each Tape section requires\n");
     printf("#   'origin:', which is the (x/y/z) position (relative to "
            "Tape-Tray-Origin) of\n");
@@ -119,6 +180,10 @@ void CreateConfigTemplate(const Board& board) {
     printf("# Also there are the following optional parameters\n");
     printf("#angle: 0     # Optional: Default rotation of component on tape.\n");
     printf("#count: 1000  # Optional: available count on tape\n");
+    printf("#symmetry: 360 # Optional: rotational symmetry of component in "
+           "degrees:\n#              360, 180, 90 or auto (from pads). "
+           "Allows for less rotation.\n");
+    printf("#profile: heavy # Optional: Motion-Profile to use\n");
     printf("\n");
 
     int ypos = 0;
@@ -179,28 +244,92 @@ void CreateHomerInstruction(const Board &board) {
     }
 }
 
-void SolderDispense(const Board &board, Machine *machine) {
+// Hand the planned operations to the machine in runs of this many. Between
+// runs, we check if we got interrupted.
+static const size_t kOperationsPerRun = 16;
+
+static void ExecuteOperations(const std::vector<MachineOp> &ops,
+                              Machine *machine) {
+    for (size_t start = 0; start < ops.size(); start += kOperationsPerRun) {
+        if (interrupt_received)
+            break;
+        machine->Execute(ops.data() + start,
+                         std::min(kOperationsPerRun, ops.size() - start));
+    }
+}
+
+void SolderDispense(const Board &board, bool use_strokes, Machine *machine) {
+    // Rows are represented by their first pad in the list to optimize.
+    std::vector<PadRow> rows;
+    std::map<const Pad *, const PadRow *> row_starting_with;
     OptimizeList all_pads;
     for (const Part *part : board.parts()) {
+        std::set<const Pad *> in_row;
+        if (use_strokes) {
+            for (const PadRow &row : FindPadRows(*part, stroke_min_pads,
+                                                 stroke_max_pitch)) {
+                rows.push_back(row);
+                in_row.insert(row.begin(), row.end());
+                all_pads.push_back(std::make_pair(part, row.front()));
+            }
+        }
         for (const Pad &pad : part->pads) {
-            all_pads.push_back(std::make_pair(part, &pad));
+            if (in_row.find(&pad) == in_row.end())
+                all_pads.push_back(std::make_pair(part, &pad));
         }
     }
+    for (const PadRow &row : rows) {
+        row_starting_with[row.front()] = &row;
+    }
     OptimizeParts(&all_pads);
 
+    std::vector<MachineOp> ops;
+    ops.reserve(all_pads.size());
     for (const auto &p : all_pads) {
-        if (interrupt_received)
-            break;
-        machine->Dispense(*p.first, *p.second);
+        const auto found_row = row_starting_with.find(p.second);
+        if (found_row != row_starting_with.end()) {
+            ops.push_back(MachineOp::DispenseStroke(*p.first,
+                                                    *found_row->second));
+        } else {
+            ops.push_back(MachineOp::Dispense(*p.first, *p.second));
+        }
     }
+    ExecuteOperations(ops, machine);
 }
 
-static Tape *FindTapeForPart(const PnPConfig *config, const Part *part) {
+static const PnPConfig::TapeList *FindTapesForPart(const PnPConfig *config,
+                                                   const Part *part) {
     const std::string key = part->footprint + "@" + part->value;
     auto found = config->tape_for_component.find(key);
-    if (found == config->tape_for_component.end())
+    if (found == config->tape_for_component.end() || found->second.empty())
         return NULL;
-    return found->second;
+    return &found->second;
+}
+
+// Find the tape to pick "part" from that results in the shortest travel
+// from "current_pos" via the tape to the placement position. Tapes that are
+// exhausted are skipped; if all of them are, the first tape is returned so
+// that the machine can report the problem.
+static Tape *FindTapeForPart(const PnPConfig *config, const Part *part,
+                             const Position &current_pos) {
+    const PnPConfig::TapeList *tapes = FindTapesForPart(config, part);
+    if (tapes == NULL)
+        return NULL;
+    const Position target = config->board.origin + part->pos;
+    Tape *result = NULL;
+    float shortest = -1;
+    for (Tape *tape : *tapes) {
+        Position tape_pos;
+        if (!tape->GetPos(&tape_pos.x, &tape_pos.y))
+            continue;  // exhausted.
+        const float travel = Distance(current_pos, tape_pos)
+            + Distance(tape_pos, target);
+        if (shortest < 0 || travel < shortest) {
+            result = tape;
+            shortest = travel;
+        }
+    }
+    return result ? result : tapes->front();
 }
 
 struct ComponentHeightComparator {
@@ -217,33 +346,105 @@ struct ComponentHeightComparator {
     }
 
     float GetHeight(const Part *part) {
-        const Tape *tape = FindTapeForPart(config_, part);
-        return tape == NULL ? -1 : tape->height();
+        const PnPConfig::TapeList *tapes = FindTapesForPart(config_, part);
+        return tapes == NULL ? -1 : tapes->front()->height();
     }
     const PnPConfig *config_;
 };
+// A part on its way from the tape to the board.
+struct LoadedPart {
+    const Part *part;
+    Tape *tape;
+    int nozzle;
+};
+
+// With multiple nozzles, we pick up to one part per nozzle before placing
+// all of them on the board in one trip.
 void PickNPlace(const PnPConfig *config, const Board &board, Machine *machine) {
     // TODO: lowest height components first to not knock over bigger ones.
     std::vector<const Part *> list(board.parts());
     if (config) {
         std::sort(list.begin(), list.end(), ComponentHeightComparator(config));
     }
-    for (const Part *part : list) {
-        if (interrupt_received)
-            break;
+    const size_t nozzles = config ? config->nozzles.size() : 1;
+
+    // The whole job is planned before it is executed. Tapes advance while
+    // planning, so operations get a snapshot of the tape at their step.
+    std::vector<MachineOp> ops;
+    std::deque<Tape> tape_snapshots;
+    auto snapshot = [&tape_snapshots](const Tape *tape) -> const Tape * {
+        if (tape == NULL) return NULL;
+        tape_snapshots.push_back(*tape);
+        return &tape_snapshots.back();
+    };
+    Position current_pos;  // We start out at the home position.
+    for (size_t batch_start = 0; batch_start < list.size();
+         batch_start += nozzles) {
+        // Pick the batch in the order of the closest tape.
+        std::vector<const Part *> to_pick(
+            list.begin() + batch_start,
+            list.begin() + std::min(list.size(), batch_start + nozzles));
+        std::vector<LoadedPart> loaded;
+        while (!to_pick.empty()) {
+            size_t best = 0;
+            Tape *tape = NULL;
+            if (config) {
+                float shortest = -1;
+                for (size_t i = 0; i < to_pick.size(); ++i) {
+                    Tape *candidate = FindTapeForPart(config, to_pick[i],
+                                                      current_pos);
+                    Position tape_pos = current_pos;
+                    if (candidate) candidate->GetPos(&tape_pos.x, &tape_pos.y);
+                    const float travel = Distance(current_pos, tape_pos);
+                    if (shortest < 0 || travel < shortest) {
+                        best = i;
+                        tape = candidate;
+                        shortest = travel;
+                    }
+                }
+                if (tape == NULL) {
+                    fprintf(stderr, "No tape for '%s'\n",
+                            to_pick[best]->component_name.c_str());
+                } else {
+                    tape->GetPos(&current_pos.x, &current_pos.y);
+                }
+            }
+            const LoadedPart picked = { to_pick[best], tape,
+                                        (int)loaded.size() };
+            ops.push_back(MachineOp::Pick(*picked.part, snapshot(picked.tape),
+                                          picked.nozzle));
+            if (tape) tape->Advance();
+            loaded.push_back(picked);
+            to_pick.erase(to_pick.begin() + best);
+        }
 
-        Tape *tape = NULL;
-        if (config) {
-            tape = FindTapeForPart(config, part);
-            if (tape == NULL) {
-                fprintf(stderr, "No tape for '%s'\n",
-                        part->component_name.c_str());
+        // Place lowest parts first, among these the closest.
+        const Position origin = config ? config->board.origin : Position();
+        while (!loaded.empty()) {
+            size_t best = 0;
+            for (size_t i = 1; i < loaded.size(); ++i) {
+                const float height = loaded[i].tape
+                    ? loaded[i].tape->height() : -1;
+                const float best_height = loaded[best].tape
+                    ? loaded[best].tape->height() : -1;
+                if (height > best_height)
+                    continue;
+                if (height < best_height
+                    || (Distance(current_pos, origin + loaded[i].part->pos)
+                        < Distance(current_pos,
+                                   origin + loaded[best].part->pos))) {
+                    best = i;
+                }
             }
+            const LoadedPart &placing = loaded[best];
+            ops.push_back(MachineOp::Place(*placing.part,
+                                           snapshot(placing.tape),
+                                           placing.nozzle));
+            current_pos = origin + placing.part->pos;
+            loaded.erase(loaded.begin() + best);
         }
-        machine->PickPart(*part, tape);
-        machine->PlacePart(*part, tape);
-        if (tape) tape->Advance();
     }
+    ExecuteOperations(ops, machine);
 }
 
 std::set<std::string> ParseCommaSeparated(const char *start) {
@@ -272,6 +473,7 @@ int main(int argc, char *argv[]) {
 
     enum OutputOption {
         OUT_POSTSCRIPT,
+        OUT_ESTIMATE,
         OUT_GCODE,
         OUT_MACHINE,
     } out_option = OUT_GCODE;
@@ -280,27 +482,43 @@ int main(int argc, char *argv[]) {
     float area_ms = area_to_milliseconds;
     const char *config_filename = NULL;
     const char *simple_config_filename = NULL;
+    const char *template_filename = NULL;
     bool handle_top_of_board = true;
     bool do_origin_finder = false;
+    bool dispense_strokes = false;
+    bool compact_gcode = false;
+    int macro_slots = -1;      // -1: if the machine has them.
+    int threads = 1;
     std::set<std::string> blacklist;
-    FILE *output = NULL;
+    const char *output_filename = NULL;
+    bool output_mmap = false;
+    const char *machine_descriptor = NULL;
+    const char *session_log_filename = NULL;
     int tty_fd = -1;
+    LineReader *machine_connection = NULL;   // Reading from tty_fd.
+    SessionLog *session_log = NULL;
+    MachineCapabilities capabilities;
+    int stream_window = -1;    // -1: from the capabilities.
+    bool line_numbers = false;
+    int report_interval = 0;
+    const char *sd_filename = NULL;
 
     int opt;
-    while ((opt = getopt(argc, argv, "Pc:C:D:tlHpdbx:O:m:a")) != -1) {
+    while ((opt = getopt(argc, argv, "PEc:C:D:stlHpdbx:O:Mm:R:akF:g:Gj:w:ni:u:")) != -1) {
         switch (opt) {
         case 'P':
             out_option = OUT_POSTSCRIPT;
             break;
+        case 'E':
+            out_option = OUT_ESTIMATE;
+            break;
         case 'm':
-            tty_fd = OpenMachineConnection(optarg);
-            if (tty_fd < 0) {
-                fprintf(stderr, "Can't connect to machine. Exiting.\n");
-                return 1;
-            }
-            DiscardPendingInput(tty_fd, 1000);  // Start with clean slate.
+            machine_descriptor = strdup(optarg);
             out_option = OUT_MACHINE;
             break;
+        case 'R':
+            session_log_filename = strdup(optarg);
+            break;
         case 'c':
             config_filename = strdup(optarg);
             break;
@@ -308,21 +526,65 @@ int main(int argc, char *argv[]) {
             simple_config_filename = strdup(optarg);
             break;
         case 'D':
-            if (2 != sscanf(optarg, "%f,%f", &start_ms, &area_ms)) {
+            if (2 != sscanf(optarg, "%f,%f", &start_ms, &area_ms)
+                || start_ms < 0 || area_ms < 0) {
                 fprintf(stderr, "Invalid -D spec\n");
                 return usage(argv[0]);
             }
             break;
         case 'O':
-            output = fopen(optarg, "w");
-            if (output == NULL) {
-                perror("Couldn't open requested output file for write");
-                return 1;
-            }
+            output_filename = strdup(optarg);
+            break;
+        case 'M':
+            output_mmap = true;
             break;
         case 'a':
             do_origin_finder = true;
             break;
+        case 's':
+            dispense_strokes = true;
+            break;
+        case 'k':
+            compact_gcode = true;
+            break;
+        case 'F':
+            macro_slots = atoi(optarg);
+            if (macro_slots < 0 || macro_slots > 10) {
+                fprintf(stderr, "Invalid -F macro count; 0..10\n");
+                return usage(argv[0]);
+            }
+            compact_gcode = (macro_slots > 0) || compact_gcode;
+            break;
+        case 'g':
+            template_filename = strdup(optarg);
+            break;
+        case 'j':
+            threads = atoi(optarg);
+            if (threads < 1) {
+                fprintf(stderr, "Invalid -j thread count\n");
+                return usage(argv[0]);
+            }
+            break;
+        case 'w':
+            stream_window = atoi(optarg);
+            if (stream_window < 0) {
+                fprintf(stderr, "Invalid -w window size\n");
+                return usage(argv[0]);
+            }
+            break;
+        case 'n':
+            line_numbers = true;
+            break;
+        case 'i':
+            report_interval = atoi(optarg);
+            break;
+        case 'u':
+            sd_filename = strdup(optarg);
+            line_numbers = true;   // Nothing corrupted goes to the file.
+            break;
+        case 'G':
+            GCodeMachine::PrintDefaultTemplates(stdout);
+            return 0;
         case 't':
             do_operation = OP_CONFIG_TEMPLATE;
             break;
@@ -353,16 +615,61 @@ int main(int argc, char *argv[]) {
         return usage(argv[0]);
     }
 
-    if (output != NULL && out_option == OUT_MACHINE) {
+    if (output_filename != NULL && out_option == OUT_MACHINE) {
         fprintf(stderr, "Machine output is chosen with -m. "
                 "But also output file with -O. Choose only one.\n\n");
         return usage(argv[0]);
     }
 
-    if (output == NULL) {
-        output = stdout;
+    if (sd_filename != NULL && out_option != OUT_MACHINE) {
+        fprintf(stderr, "Upload to SD card with -u needs a machine "
+                "connection with -m.\n\n");
+        return usage(argv[0]);
+    }
+
+    if (session_log_filename != NULL && out_option != OUT_MACHINE) {
+        fprintf(stderr, "Recording the session with -R needs a machine "
+                "connection with -m.\n\n");
+        return usage(argv[0]);
+    }
+
+    if (macro_slots > 0 && threads > 1) {
+        fprintf(stderr, "Firmware macros with -F can't be used with "
+                "multiple threads (-j).\n\n");
+        return usage(argv[0]);
     }
 
+    if (out_option == OUT_MACHINE) {
+        tty_fd = OpenMachineConnection(machine_descriptor);
+        if (tty_fd < 0) {
+            fprintf(stderr, "Can't connect to machine. Exiting.\n");
+            return 1;
+        }
+        machine_connection = new LineReader(tty_fd);
+        if (session_log_filename != NULL) {
+            session_log = SessionLog::Create(session_log_filename);
+            if (session_log == NULL)
+                return 1;
+            machine_connection->set_session_log(session_log);
+        }
+        if (!DetectCapabilities(machine_connection, &capabilities)) {
+            fprintf(stderr, "Can't talk to machine. Exiting.\n");
+            return 1;
+        }
+        capabilities.Print(stderr);
+        if (session_log) session_log->JobStarts();
+
+        // What we didn't get told, we configure as the machine can do.
+        if (stream_window < 0 && capabilities.receive_buffer > 0)
+            stream_window = capabilities.receive_buffer - 1;
+        if (stream_window > 0 && capabilities.line_numbers)
+            line_numbers = true;
+        if (macro_slots < 0 && capabilities.macros)
+            macro_slots = default_macro_slots;
+    }
+    stream_window = std::max(stream_window, 0);
+    macro_slots = std::max(macro_slots, 0);
+
     const char *rpt_file = argv[optind];
 
     Board::ReadFilter inclusion_filter
@@ -419,27 +726,72 @@ int main(int argc, char *argv[]) {
     }
 
     if (do_origin_finder) {
-        if (!TerminalJogConfig(board, tty_fd, config))
+        if (!TerminalJogConfig(board, machine_connection, config))
+            return 1;
+    }
+
+    OutputSink *output = NULL;
+    if (out_option != OUT_MACHINE) {
+        output = OpenOutputSink(output_filename, output_mmap);
+        if (output == NULL)
             return 1;
     }
 
     Machine *machine = NULL;
+    GCodeMachine *gcode_machine = NULL;  // If we emit G-Code.
+    GCodeStreamer *streamer = NULL;      // If connected to a machine.
+    SDCardJob *sd_job = NULL;            // If uploading to the SD card.
     switch (out_option) {
     case OUT_GCODE:
-        machine = new GCodeMachine(output, start_ms, area_ms);
+        if (threads > 1) {
+            ParallelGCodeMachine *parallel = new ParallelGCodeMachine(
+                output, start_ms, area_ms, threads);
+            gcode_machine = parallel->gcode_machine();
+            machine = parallel;
+        } else {
+            gcode_machine = new GCodeMachine(output, start_ms, area_ms);
+            machine = gcode_machine;
+        }
+        gcode_machine->set_compact(compact_gcode);
+        gcode_machine->set_macro_slots(macro_slots);
         break;
     case OUT_POSTSCRIPT:
         machine = new PostScriptMachine(output);
         break;
+    case OUT_ESTIMATE: {
+        TimeEstimateMachine *estimate
+            = new TimeEstimateMachine(output, start_ms, area_ms);
+        gcode_machine = estimate->gcode_machine();
+        machine = estimate;
+        break;
+    }
     case OUT_MACHINE:
-        machine = new GCodeMachine(tty_fd, tty_fd, start_ms, area_ms);
+        streamer = new GCodeStreamer(machine_connection, stream_window);
+        streamer->set_line_numbers(line_numbers);
+        streamer->stats()->set_report_interval(report_interval);
+        streamer->set_interrupt(&interrupt_received);
+        if (sd_filename)
+            sd_job = new SDCardJob(streamer, sd_filename);
+        if (!streamer->StartIOThread())
+            return 1;
+        if (sd_job && !sd_job->BeginUpload())
+            return 1;
+        gcode_machine = new GCodeMachine(streamer, start_ms, area_ms);
         if (do_origin_finder) {
             // If we manually found the origin, don't do unnecessary homing.
-            static_cast<GCodeMachine*>(machine)->set_homing(false);
+            gcode_machine->set_homing(false);
         }
+        gcode_machine->set_macro_slots(macro_slots);
+        gcode_machine->set_grbl(capabilities.grbl);
+        machine = gcode_machine;
         break;
     }
 
+    if (template_filename != NULL && gcode_machine != NULL
+        && !gcode_machine->LoadTemplates(template_filename)) {
+        return 1;
+    }
+
     signal(SIGTERM, InterruptHandler);
     signal(SIGINT, InterruptHandler);
 
@@ -453,15 +805,43 @@ int main(int argc, char *argv[]) {
     }
 
     if (do_operation == OP_DISPENSING) {
-        SolderDispense(board, machine);
+        SolderDispense(board, dispense_strokes, machine);
     }
     else if (do_operation == OP_PICKNPLACE) {
         PickNPlace(config, board, machine);
     }
 
-    machine->Finish();
+    // While uploading to the SD card, nothing runs yet: there is nothing
+    // to stop when interrupted, but the partial job is to be removed.
+    if (!interrupt_received)
+        machine->Finish();
+    else if (!sd_job)
+        machine->Abort();
+
+    bool success = true;
+    if (sd_job) {
+        if (interrupt_received || gcode_machine->failed()) {
+            success = sd_job->CancelUpload();   // Don't leave half a job.
+        } else if (!sd_job->EndUpload()) {
+            success = false;
+        } else if (!sd_job->Run(&interrupt_received)) {
+            if (interrupt_received)
+                machine->Abort();   // Stop the machine and make it safe.
+            else
+                success = false;
+        }
+    }
 
+    if (gcode_machine && gcode_machine->failed())
+        success = false;
     delete machine;
+    delete sd_job;
+    delete streamer;
+    delete machine_connection;
+    delete session_log;
     delete config;
-    return 0;
+    if (output != NULL && !output->Close())
+        return 1;
+    delete output;
+    return success ? 0 : 1;
 }
@@ -0,0 +1,327 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) h.zeller@acm.org. Free Software. GNU Public License v3.0 and above
+ */
+
+#include "motion-simulator.h"
+
+#include <ctype.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "pnp-config.h"
+
+// Machine limits, roughly what a typical Marlin configuration has. The
+// G-Code can change them with M201, M203 and M204.
+#define SIM_MAX_XY_SPEED 1000           // mm/s
+#define SIM_MAX_Z_SPEED 100
+#define SIM_MAX_ROTATION_SPEED 200
+#define SIM_MAX_XY_ACCEL 3000           // mm/s^2
+#define SIM_MAX_Z_ACCEL 500
+#define SIM_MAX_ROTATION_ACCEL 2000
+#define SIM_DEFAULT_ACCEL 1000          // Until changed with M204
+#define SIM_DEFAULT_FEEDRATE 25         // mm/s until the first F
+#define SIM_HOMING_SPEED 50             // mm/s
+#define SIM_JUNCTION_DEVIATION 0.05     // mm
+#define SIM_MIN_PLANNER_SPEED 0.05      // mm/s
+#define SIM_BLOCK_BUFFER_SIZE 16        // Look-ahead of planner.
+
+static int AxisIndex(char letter) { return toupper(letter) - 'A'; }
+
+MotionSimulator::MotionSimulator(const PnPConfig *config)
+    : acceleration_(SIM_DEFAULT_ACCEL),
+      feedrate_(SIM_DEFAULT_FEEDRATE),
+      relative_(false), solenoid_on_(false),
+      have_last_(false), last_nominal_speed_(0), exit_speed_(0) {
+    for (int i = 0; i < kAxisLetters; ++i) {
+        kind_[i] = AXIS_NONE;
+        position_[i] = 0;
+        last_unit_[i] = 0;
+    }
+    kind_[AxisIndex('X')] = kind_[AxisIndex('Y')] = AXIS_XY;
+    kind_[AxisIndex('Z')] = AXIS_Z;
+    for (char axis : { 'E', 'A', 'B', 'C' }) {
+        kind_[AxisIndex(axis)] = AXIS_ROTATION;
+    }
+    if (config) {
+        for (const NozzleConfig &n : config->nozzles) {
+            kind_[AxisIndex(n.z_axis[0])] = AXIS_Z;
+            kind_[AxisIndex(n.rotation_axis[0])] = AXIS_ROTATION;
+        }
+    }
+    for (int i = 0; i < kAxisLetters; ++i) {
+        switch (kind_[i]) {
+        case AXIS_XY:
+            max_speed_[i] = SIM_MAX_XY_SPEED;
+            max_accel_[i] = SIM_MAX_XY_ACCEL;
+            break;
+        case AXIS_Z:
+            max_speed_[i] = SIM_MAX_Z_SPEED;
+            max_accel_[i] = SIM_MAX_Z_ACCEL;
+            break;
+        default:
+            max_speed_[i] = SIM_MAX_ROTATION_SPEED;
+            max_accel_[i] = SIM_MAX_ROTATION_ACCEL;
+            break;
+        }
+    }
+    for (double &t : time_) t = 0;
+}
+
+const char *MotionSimulator::PhaseName(Phase p) {
+    switch (p) {
+    case PHASE_XY:       return "XY travel";
+    case PHASE_Z:        return "Z travel";
+    case PHASE_ROTATION: return "Rotation";
+    case PHASE_DWELL:    return "Dwell";
+    case PHASE_DISPENSE: return "Dispense";
+    case NUM_PHASES:     break;
+    }
+    return "";
+}
+
+double MotionSimulator::total_time() const {
+    double result = 0;
+    for (double t : time_) result += t;
+    return result;
+}
+
+void MotionSimulator::ProcessLine(const char *line, size_t len) {
+    // Collect the words of the line, skipping comments.
+    struct Word { char letter; double value; };
+    Word words[32];
+    int word_count = 0;
+    const char *end = line + len;
+    for (const char *pos = line; pos < end && word_count < 32; /**/) {
+        if (*pos == ';') break;
+        if (*pos == '(') {
+            while (pos < end && *pos != ')') ++pos;
+            ++pos;
+            continue;
+        }
+        if (!isalpha(*pos)) {
+            ++pos;
+            continue;
+        }
+        char *number_end;
+        words[word_count].letter = toupper(*pos);
+        words[word_count].value = strtod(pos + 1, &number_end);
+        pos = std::max(number_end, (char*) pos + 1);
+        ++word_count;
+    }
+
+    double target[kAxisLetters];
+    bool is_move = false;
+    bool move_relative = relative_;
+    for (int w = 0; w < word_count; ++w) {
+        const int code = (int) words[w].value;
+        if (words[w].letter == 'G') {
+            switch (code) {
+            case 0: case 1:
+                is_move = true;
+                move_relative = relative_;
+                break;
+            case 4: {
+                double seconds = 0;
+                for (int p = 0; p < word_count; ++p) {
+                    if (words[p].letter == 'P') seconds = words[p].value / 1000;
+                    if (words[p].letter == 'S') seconds = words[p].value;
+                }
+                Dwell(seconds);
+                break;
+            }
+            case 28: {
+                // Homing: move the given axes (or X, Y, Z) to zero.
+                std::copy(position_, position_ + kAxisLetters, target);
+                bool any_axis = false;
+                for (int p = 0; p < word_count; ++p) {
+                    const int axis = AxisIndex(words[p].letter);
+                    if (kind_[axis] == AXIS_NONE) continue;
+                    target[axis] = 0;
+                    any_axis = true;
+                }
+                if (!any_axis) {
+                    target[AxisIndex('X')] = target[AxisIndex('Y')] = 0;
+                    target[AxisIndex('Z')] = 0;
+                }
+                Move(target, SIM_HOMING_SPEED);
+                Flush();
+                break;
+            }
+            case 90: relative_ = false; break;
+            case 91: relative_ = true; break;
+            case 92:
+                for (int p = 0; p < word_count; ++p) {
+                    const int axis = AxisIndex(words[p].letter);
+                    if (kind_[axis] != AXIS_NONE)
+                        position_[axis] = words[p].value;
+                }
+                break;
+            }
+        } else if (words[w].letter == 'M') {
+            switch (code) {
+            case 106: solenoid_on_ = true; break;
+            case 107: solenoid_on_ = false; break;
+            case 400: Flush(); break;
+            case 201: case 203:
+                for (int p = 0; p < word_count; ++p) {
+                    const int axis = AxisIndex(words[p].letter);
+                    if (kind_[axis] == AXIS_NONE) continue;
+                    (code == 201 ? max_accel_ : max_speed_)[axis]
+                        = words[p].value;
+                }
+                break;
+            case 204:
+                for (int p = 0; p < word_count; ++p) {
+                    if (words[p].letter == 'S' || words[p].letter == 'P')
+                        acceleration_ = words[p].value;
+                }
+                break;
+            }
+        }
+    }
+
+    if (!is_move)
+        return;
+    std::copy(position_, position_ + kAxisLetters, target);
+    for (int w = 0; w < word_count; ++w) {
+        const char letter = words[w].letter;
+        if (letter == 'F') {
+            feedrate_ = words[w].value / 60.0;
+            continue;
+        }
+        const int axis = AxisIndex(letter);
+        if (kind_[axis] == AXIS_NONE) continue;
+        target[axis] = move_relative
+            ? position_[axis] + words[w].value
+            : words[w].value;
+    }
+    Move(target, feedrate_);
+}
+
+void MotionSimulator::Move(const double *target, double feedrate) {
+    Segment s;
+    double delta[kAxisLetters];
+    double cartesian_sq = 0, rotation = 0;
+    bool has_xy = false, has_z = false;
+    for (int i = 0; i < kAxisLetters; ++i) {
+        delta[i] = target[i] - position_[i];
+        position_[i] = target[i];
+        if (delta[i] == 0) continue;
+        switch (kind_[i]) {
+        case AXIS_XY: has_xy = true; cartesian_sq += delta[i] * delta[i]; break;
+        case AXIS_Z:  has_z = true;  cartesian_sq += delta[i] * delta[i]; break;
+        case AXIS_ROTATION: rotation = std::max(rotation, fabs(delta[i])); break;
+        case AXIS_NONE: break;
+        }
+    }
+    // Like in firmware: rotation-only moves are measured in rotation units.
+    s.length = cartesian_sq > 0 ? sqrt(cartesian_sq) : rotation;
+    if (s.length <= 0)
+        return;
+
+    s.nominal_speed = feedrate;
+    s.acceleration = acceleration_;
+    for (int i = 0; i < kAxisLetters; ++i) {
+        s.unit[i] = delta[i] / s.length;
+        const double fraction = fabs(s.unit[i]);
+        if (fraction == 0) continue;
+        s.nominal_speed = std::min(s.nominal_speed, max_speed_[i] / fraction);
+        s.acceleration = std::min(s.acceleration, max_accel_[i] / fraction);
+    }
+    s.phase = solenoid_on_ ? PHASE_DISPENSE
+        : has_xy ? PHASE_XY
+        : has_z ? PHASE_Z
+        : PHASE_ROTATION;
+
+    // Junction speed with the previous segment from junction deviation.
+    s.max_entry_speed = 0;
+    if (have_last_) {
+        double cos_theta = 0;
+        for (int i = 0; i < kAxisLetters; ++i)
+            cos_theta -= last_unit_[i] * s.unit[i];
+        double junction_speed = SIM_MIN_PLANNER_SPEED;
+        if (cos_theta < 0.999999) {
+            cos_theta = std::max(cos_theta, -0.999999);
+            const double sin_theta_d2 = sqrt(0.5 * (1.0 - cos_theta));
+            junction_speed = sqrt(s.acceleration * SIM_JUNCTION_DEVIATION
+                                  * sin_theta_d2 / (1.0 - sin_theta_d2));
+        }
+        s.max_entry_speed = std::min(junction_speed,
+                                     std::min(s.nominal_speed,
+                                              last_nominal_speed_));
+    }
+    s.entry_speed = s.max_entry_speed;
+
+    std::copy(s.unit, s.unit + kAxisLetters, last_unit_);
+    last_nominal_speed_ = s.nominal_speed;
+    have_last_ = true;
+
+    pending_.push_back(s);
+    if (pending_.size() > SIM_BLOCK_BUFFER_SIZE)
+        PlanAndExecute(1);
+}
+
+void MotionSimulator::Dwell(double seconds) {
+    Flush();
+    time_[solenoid_on_ ? PHASE_DISPENSE : PHASE_DWELL] += seconds;
+}
+
+void MotionSimulator::Flush() {
+    PlanAndExecute(pending_.size());
+    have_last_ = false;  // Machine comes to a stop.
+    exit_speed_ = 0;
+}
+
+// Re-plan the look-ahead buffer assuming we have to stop at its end, then
+// execute the first "count" segments.
+void MotionSimulator::PlanAndExecute(size_t count) {
+    const size_t n = pending_.size();
+    if (n == 0) return;
+
+    // Backward pass: make sure we can always decelerate to the next entry.
+    double next_entry = 0;
+    for (size_t i = n; i-- > 0; /**/) {
+        Segment &s = pending_[i];
+        s.entry_speed = std::min(s.max_entry_speed,
+                                 sqrt(next_entry * next_entry
+                                      + 2 * s.acceleration * s.length));
+        next_entry = s.entry_speed;
+    }
+
+    // Forward pass: we can't accelerate faster than possible.
+    pending_[0].entry_speed = std::min(pending_[0].entry_speed, exit_speed_);
+    for (size_t i = 0; i + 1 < n; ++i) {
+        const Segment &s = pending_[i];
+        pending_[i+1].entry_speed
+            = std::min(pending_[i+1].entry_speed,
+                       sqrt(s.entry_speed * s.entry_speed
+                            + 2 * s.acceleration * s.length));
+    }
+
+    // Execute with trapezoidal velocity profiles.
+    for (size_t i = 0; i < count; ++i) {
+        const Segment &s = pending_.front();
+        const double v0 = s.entry_speed;
+        const double v1 = (pending_.size() > 1) ? pending_[1].entry_speed : 0;
+        const double a = s.acceleration;
+        const double accel_dist = (s.nominal_speed * s.nominal_speed
+                                   - v0 * v0) / (2 * a);
+        const double decel_dist = (s.nominal_speed * s.nominal_speed
+                                   - v1 * v1) / (2 * a);
+        double t;
+        if (accel_dist + decel_dist <= s.length) {
+            t = (s.nominal_speed - v0) / a + (s.nominal_speed - v1) / a
+                + (s.length - accel_dist - decel_dist) / s.nominal_speed;
+        } else {
+            // Triangle: never reach nominal speed.
+            const double peak = sqrt((2 * a * s.length + v0 * v0 + v1 * v1) / 2);
+            t = (peak - v0) / a + (peak - v1) / a;
+        }
+        time_[s.phase] += t;
+        exit_speed_ = v1;
+        pending_.pop_front();
+    }
+}
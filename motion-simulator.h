@@ -0,0 +1,80 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) h.zeller@acm.org. Free Software. GNU Public License v3.0 and above
+ */
+
+#ifndef MOTION_SIMULATOR_H
+#define MOTION_SIMULATOR_H
+
+#include <stddef.h>
+
+#include <deque>
+
+struct PnPConfig;
+
+// Simulates the time it takes a firmware to execute G-Code. Moves are
+// planned like e.g. Marlin does: trapezoidal velocity profiles, junction
+// speeds from junction deviation and a limited look-ahead buffer.
+// Understands G0/G1/G4/G28/G90/G91/G92, M106/M107 (dispense solenoid) and
+// M201/M203/M204 to modify limits.
+class MotionSimulator {
+public:
+    enum Phase {
+        PHASE_XY,        // Moves involving X or Y.
+        PHASE_Z,         // Moves only of needle up/down axes.
+        PHASE_ROTATION,  // Moves only of rotation axes.
+        PHASE_DWELL,     // Waiting with G4.
+        PHASE_DISPENSE,  // Everything while the dispense solenoid is on.
+        NUM_PHASES
+    };
+
+    // The "config" is used to learn about the axis letters used by nozzles.
+    // Can be NULL.
+    explicit MotionSimulator(const PnPConfig *config);
+
+    // Process one line of G-Code.
+    void ProcessLine(const char *line, size_t len);
+
+    // Execute all moves still in the look-ahead buffer.
+    void Flush();
+
+    // Simulated time in seconds.
+    double time(Phase p) const { return time_[p]; }
+    double total_time() const;
+    static const char *PhaseName(Phase p);
+
+private:
+    enum AxisKind { AXIS_NONE, AXIS_XY, AXIS_Z, AXIS_ROTATION };
+    static const int kAxisLetters = 26;
+
+    struct Segment {
+        double length;         // mm
+        double nominal_speed;  // mm/s
+        double acceleration;   // mm/s^2
+        double max_entry_speed;
+        double entry_speed;
+        double unit[kAxisLetters];  // direction
+        Phase phase;
+    };
+
+    void Move(const double *target, double feedrate);
+    void Dwell(double seconds);
+    void PlanAndExecute(size_t count);
+
+    AxisKind kind_[kAxisLetters];
+    double max_speed_[kAxisLetters];   // mm/s per axis
+    double max_accel_[kAxisLetters];   // mm/s^2 per axis
+    double position_[kAxisLetters];
+    double acceleration_;              // M204
+    double feedrate_;                  // mm/s
+    bool relative_;
+    bool solenoid_on_;
+    // The last segment we planned; new segments join it at a junction.
+    bool have_last_;
+    double last_nominal_speed_;
+    double last_unit_[kAxisLetters];
+    double exit_speed_;                // of the last executed segment.
+    std::deque<Segment> pending_;
+    double time_[NUM_PHASES];
+};
+
+#endif  // MOTION_SIMULATOR_H
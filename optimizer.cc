@@ -10,6 +10,9 @@
 #include <math.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <set>
+
 #include "board.h"  // definition of Part
 
 static float euklid(float a, float b) { return sqrtf(a*a + b*b); }
@@ -62,3 +65,77 @@ void OptimizeParts(OptimizeList *list) {
     }
 }
 
+
+// Pads closer than this are considered on the same line or the same size.
+static const float kPadRowEpsilon = 0.01;
+
+static bool SameSize(const Pad *a, const Pad *b) {
+    return fabsf(a->size.w - b->size.w) < kPadRowEpsilon
+        && fabsf(a->size.h - b->size.h) < kPadRowEpsilon;
+}
+
+// Find rows along one axis. With "along_x", pads need to share the same
+// y-coordinate and are sorted by x; otherwise the other way around.
+static void FindRowsAlongAxis(const Part &part, bool along_x,
+                              size_t min_pads, float max_pitch,
+                              std::set<const Pad *> *used,
+                              std::vector<PadRow> *result) {
+    auto along = [along_x](const Pad *p) {
+        return along_x ? p->pos.x : p->pos.y;
+    };
+    auto across = [along_x](const Pad *p) {
+        return along_x ? p->pos.y : p->pos.x;
+    };
+
+    std::set<const Pad *> visited;
+    for (const Pad &seed : part.pads) {
+        if (used->count(&seed) || visited.count(&seed))
+            continue;
+        // All pads of the same size on the same line as the seed.
+        PadRow line;
+        for (const Pad &p : part.pads) {
+            if (used->count(&p) || !SameSize(&seed, &p)
+                || fabsf(across(&seed) - across(&p)) >= kPadRowEpsilon)
+                continue;
+            line.push_back(&p);
+            visited.insert(&p);
+        }
+        std::sort(line.begin(), line.end(),
+                  [&along](const Pad *a, const Pad *b) {
+                      return along(a) < along(b);
+                  });
+
+        // Split into runs with constant pitch.
+        size_t start = 0;
+        while (start < line.size()) {
+            size_t end = start + 1;
+            const float pitch = (end < line.size())
+                ? along(line[end]) - along(line[start]) : 0;
+            if (pitch > kPadRowEpsilon && pitch <= max_pitch) {
+                while (end < line.size()
+                       && fabsf(along(line[end]) - along(line[end-1]) - pitch)
+                       < kPadRowEpsilon) {
+                    ++end;
+                }
+            }
+            if (end - start >= min_pads) {
+                PadRow row(line.begin() + start, line.begin() + end);
+                used->insert(row.begin(), row.end());
+                result->push_back(row);
+                start = end;
+            } else {
+                ++start;
+            }
+        }
+    }
+}
+
+std::vector<PadRow> FindPadRows(const Part &part, size_t min_pads,
+                                float max_pitch) {
+    std::vector<PadRow> result;
+    if (min_pads < 2) min_pads = 2;
+    std::set<const Pad *> used;
+    FindRowsAlongAxis(part, true, min_pads, max_pitch, &used, &result);
+    FindRowsAlongAxis(part, false, min_pads, max_pitch, &used, &result);
+    return result;
+}
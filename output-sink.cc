@@ -0,0 +1,270 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) h.zeller@acm.org. Free Software. GNU Public License v3.0 and above
+ */
+
+#include "output-sink.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <string>
+
+static const size_t kBufferSize = 1 << 20;
+static const size_t kMmapGrowSize = 16 << 20;
+
+// Write all of "data" to "fd", dealing with short writes.
+static bool WriteFully(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        const ssize_t written = write(fd, data, len);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            perror("Writing output");
+            return false;
+        }
+        data += written;
+        len -= written;
+    }
+    return true;
+}
+
+bool OutputSink::Printf(const char *format, ...) {
+    char buffer[1024];
+    va_list ap;
+    va_start(ap, format);
+    const int len = vsnprintf(buffer, sizeof(buffer), format, ap);
+    va_end(ap);
+    if (len < 0) return false;
+    if ((size_t)len < sizeof(buffer))
+        return Write(buffer, len);
+
+    // Rare; long text.
+    std::string long_buffer(len + 1, '\0');
+    va_start(ap, format);
+    vsnprintf(&long_buffer[0], len + 1, format, ap);
+    va_end(ap);
+    return Write(long_buffer.data(), len);
+}
+
+namespace {
+// Collects data in a large buffer and writes it with few write() calls.
+class BufferedSink : public OutputSink {
+public:
+    BufferedSink(int fd, bool close_fd)
+        : fd_(fd), close_fd_(close_fd), buffer_(new char[kBufferSize]),
+          fill_(0), ok_(true) {}
+    ~BufferedSink() {
+        Close();
+        delete [] buffer_;
+    }
+
+    bool Write(const char *data, size_t len) override {
+        if (fill_ + len > kBufferSize) {
+            Sync();
+            if (len >= kBufferSize)
+                return ok_ = ok_ && WriteFully(fd_, data, len);
+        }
+        memcpy(buffer_ + fill_, data, len);
+        fill_ += len;
+        return ok_;
+    }
+
+    bool Sync() override {
+        ok_ = ok_ && WriteFully(fd_, buffer_, fill_);
+        fill_ = 0;
+        return ok_;
+    }
+
+    bool Close() override {
+        if (fd_ < 0) return ok_;
+        Sync();
+        if (close_fd_ && close(fd_) != 0) {
+            perror("Closing output");
+            ok_ = false;
+        }
+        fd_ = -1;
+        return ok_;
+    }
+
+private:
+    int fd_;
+    const bool close_fd_;
+    char *const buffer_;
+    size_t fill_;
+    bool ok_;
+};
+
+// Writes a regular file through a memory mapping, growing the file as
+// needed. The file is truncated to the actual size on Close().
+class MmapSink : public OutputSink {
+public:
+    explicit MmapSink(int fd)
+        : fd_(fd), map_(NULL), mapped_size_(0), size_(0), ok_(true) {}
+    ~MmapSink() { Close(); }
+
+    bool Write(const char *data, size_t len) override {
+        if (!ok_) return false;
+        if (size_ + len > mapped_size_ && !Grow(size_ + len))
+            return false;
+        memcpy(map_ + size_, data, len);
+        size_ += len;
+        return true;
+    }
+
+    bool Sync() override {
+        if (ok_ && map_ && msync(map_, size_, MS_ASYNC) != 0) {
+            perror("Syncing output");
+            ok_ = false;
+        }
+        return ok_;
+    }
+
+    bool Close() override {
+        if (fd_ < 0) return ok_;
+        if (map_) munmap(map_, mapped_size_);
+        map_ = NULL;
+        if (ftruncate(fd_, size_) != 0) {
+            perror("Truncating output");
+            ok_ = false;
+        }
+        if (close(fd_) != 0) {
+            perror("Closing output");
+            ok_ = false;
+        }
+        fd_ = -1;
+        return ok_;
+    }
+
+private:
+    bool Grow(size_t needed) {
+        size_t new_size = mapped_size_;
+        while (new_size < needed) new_size += kMmapGrowSize;
+        if (map_) munmap(map_, mapped_size_);
+        map_ = NULL;
+        if (ftruncate(fd_, new_size) != 0) {
+            perror("Growing output");
+            return ok_ = false;
+        }
+        void *map = mmap(NULL, new_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                         fd_, 0);
+        if (map == MAP_FAILED) {
+            perror("Mapping output");
+            return ok_ = false;
+        }
+        map_ = (char *) map;
+        mapped_size_ = new_size;
+        return true;
+    }
+
+    int fd_;
+    char *map_;
+    size_t mapped_size_;
+    size_t size_;         // Bytes written.
+    bool ok_;
+};
+
+// Streams gzip compressed data.
+class GzipSink : public OutputSink {
+public:
+    explicit GzipSink(int fd)
+        : fd_(fd), output_(new char[kBufferSize]), ok_(true) {
+        memset(&stream_, 0, sizeof(stream_));
+        // 15 window bits + 16: write gzip header instead of plain zlib.
+        if (deflateInit2(&stream_, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                         15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            fprintf(stderr, "Can't initialize gzip compression\n");
+            ok_ = false;
+        }
+        stream_.next_out = (Bytef *) output_;
+        stream_.avail_out = kBufferSize;
+    }
+    ~GzipSink() {
+        Close();
+        delete [] output_;
+    }
+
+    bool Write(const char *data, size_t len) override {
+        stream_.next_in = (Bytef *) data;
+        stream_.avail_in = len;
+        return Deflate(Z_NO_FLUSH);
+    }
+
+    bool Sync() override { return Deflate(Z_SYNC_FLUSH); }
+
+    bool Close() override {
+        if (fd_ < 0) return ok_;
+        Deflate(Z_FINISH);
+        deflateEnd(&stream_);
+        if (close(fd_) != 0) {
+            perror("Closing output");
+            ok_ = false;
+        }
+        fd_ = -1;
+        return ok_;
+    }
+
+private:
+    // Compress all pending input. Compressed data is collected in the
+    // output buffer and only written when it is full or we are asked to
+    // flush.
+    bool Deflate(int flush) {
+        if (!ok_) return false;
+        for (;;) {
+            if (deflate(&stream_, flush) == Z_STREAM_ERROR) {
+                fprintf(stderr, "gzip compression failed\n");
+                return ok_ = false;
+            }
+            if (stream_.avail_out > 0)
+                break;  // All input consumed and flushed as requested.
+            if (!WriteOutput())
+                return false;
+        }
+        return flush == Z_NO_FLUSH || WriteOutput();
+    }
+
+    bool WriteOutput() {
+        const size_t len = kBufferSize - stream_.avail_out;
+        ok_ = ok_ && WriteFully(fd_, output_, len);
+        stream_.next_out = (Bytef *) output_;
+        stream_.avail_out = kBufferSize;
+        return ok_;
+    }
+
+    int fd_;
+    z_stream stream_;
+    char *const output_;
+    bool ok_;
+};
+}  // namespace
+
+static bool HasSuffix(const char *str, const char *suffix) {
+    const size_t len = strlen(str);
+    const size_t suffix_len = strlen(suffix);
+    return len >= suffix_len && strcmp(str + len - suffix_len, suffix) == 0;
+}
+
+OutputSink *OpenOutputSink(const char *filename, bool use_mmap) {
+    if (filename == NULL)
+        return new BufferedSink(STDOUT_FILENO, false);
+
+    // mmap() needs read access to the file.
+    const int fd = open(filename, (use_mmap ? O_RDWR : O_WRONLY)
+                        | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Couldn't open %s for writing: %s\n",
+                filename, strerror(errno));
+        return NULL;
+    }
+    if (HasSuffix(filename, ".gz"))
+        return new GzipSink(fd);
+    struct stat st;
+    if (use_mmap && fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+        return new MmapSink(fd);
+    return new BufferedSink(fd, true);
+}
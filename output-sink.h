@@ -0,0 +1,40 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) h.zeller@acm.org. Free Software. GNU Public License v3.0 and above
+ *
+ * Where the machine output goes to.
+ */
+
+#ifndef PNP_OUTPUT_SINK_H
+#define PNP_OUTPUT_SINK_H
+
+#include <stddef.h>
+
+// An output the machines write to. Implementations buffer generously;
+// data is only guaranteed to reach its destination after Sync() or
+// Close().
+class OutputSink {
+public:
+    virtual ~OutputSink() {}
+
+    // Write "len" bytes. Returns 'false' on error.
+    virtual bool Write(const char *data, size_t len) = 0;
+
+    // Push out all data written so far. Returns 'false' on error.
+    virtual bool Sync() = 0;
+
+    // Write all remaining data and close. Returns 'false' on error.
+    // No writes are allowed after that.
+    virtual bool Close() = 0;
+
+    // Convenience: write printf()-formatted text.
+    bool Printf(const char *format, ...)
+        __attribute__ ((format (printf, 2, 3)));
+};
+
+// Open a sink writing to "filename", or stdout if that is NULL.
+// Files ending with ".gz" are gzip compressed. With "use_mmap", regular
+// files are written via memory mapping instead of write() calls.
+// Returns NULL and prints a message to stderr on error.
+OutputSink *OpenOutputSink(const char *filename, bool use_mmap);
+
+#endif  // PNP_OUTPUT_SINK_H
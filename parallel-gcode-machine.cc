@@ -0,0 +1,185 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) h.zeller@acm.org. Free Software. GNU Public License v3.0 and above
+ */
+
+#include "machine.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "output-sink.h"
+#include "tape.h"
+
+// Fewer operations than this in a chunk are not worth a thread.
+static const size_t kMinOperationsPerChunk = 64;
+
+// Chunks per thread; more, smaller chunks allow to start writing earlier.
+static const size_t kChunksPerThread = 4;
+
+ParallelGCodeMachine::ParallelGCodeMachine(OutputSink *output,
+                                           float init_ms, float area_ms,
+                                           int threads)
+    : output_(output), threads_(std::max(1, threads)),
+      prototype_([](const char *, size_t) {}, init_ms, area_ms),
+      config_(NULL) {}
+
+// Out of line, as the header only forward-declares Tape.
+ParallelGCodeMachine::~ParallelGCodeMachine() {}
+
+bool ParallelGCodeMachine::Init(const PnPConfig *config,
+                                const std::string &init_comment,
+                                const Dimension &dimension) {
+    if (config == NULL) {
+        fprintf(stderr, "Need configuration\n");
+        return false;
+    }
+    config_ = config;
+    init_comment_ = init_comment;
+    dimension_ = dimension;
+    return true;
+}
+
+void ParallelGCodeMachine::Record(const MachineOp &op) {
+    operations_.push_back(op);
+    MachineOp &recorded = operations_.back();
+    if (op.tape) {
+        tapes_.push_back(*op.tape);
+        recorded.tape = &tapes_.back();
+    }
+    if (op.row) {
+        rows_.push_back(*op.row);
+        recorded.row = &rows_.back();
+    }
+}
+
+void ParallelGCodeMachine::PickPart(const Part &part, const Tape *tape,
+                                    int nozzle) {
+    Record(MachineOp::Pick(part, tape, nozzle));
+}
+
+void ParallelGCodeMachine::PlacePart(const Part &part, const Tape *tape,
+                                     int nozzle) {
+    Record(MachineOp::Place(part, tape, nozzle));
+}
+
+void ParallelGCodeMachine::Dispense(const Part &part, const Pad &pad) {
+    Record(MachineOp::Dispense(part, pad));
+}
+
+void ParallelGCodeMachine::DispenseStroke(const Part &part,
+                                          const std::vector<const Pad *> &row) {
+    Record(MachineOp::DispenseStroke(part, row));
+}
+
+void ParallelGCodeMachine::Execute(const MachineOp *ops, size_t count) {
+    operations_.reserve(operations_.size() + count);
+    for (size_t i = 0; i < count; ++i) {
+        Record(ops[i]);
+    }
+}
+
+void ParallelGCodeMachine::Write(const std::string &buffer,
+                                 GCodeCompactor *compactor) {
+    if (compactor == NULL) {
+        output_->Write(buffer.data(), buffer.size());
+        return;
+    }
+    // Compaction depends on the state of all lines before, so happens here
+    // in order.
+    std::string line;
+    const char *pos = buffer.data();
+    const char *const end = pos + buffer.size();
+    while (pos < end) {
+        const char *eol = (const char *) memchr(pos, '\n', end - pos);
+        const char *next = eol ? eol + 1 : end;
+        if (compactor->Compact(pos, next - pos, &line))
+            output_->Write(line.data(), line.size());
+        pos = next;
+    }
+}
+
+void ParallelGCodeMachine::Finish() {
+    if (config_ == NULL) return;
+    const size_t op_count = operations_.size();
+    const size_t chunks = std::max<size_t>(
+        1, std::min(threads_ * kChunksPerThread,
+                    op_count / kMinOperationsPerChunk));
+
+    // Operations [chunk_start[i], chunk_start[i+1]) are in chunk i.
+    std::vector<size_t> chunk_start(chunks + 1);
+    for (size_t i = 0; i <= chunks; ++i) {
+        chunk_start[i] = i * op_count / chunks;
+    }
+
+    // Dry run to know the state each chunk starts with. This is cheap, the
+    // expensive part is formatting.
+    std::vector<GCodeMachine::State> start_state(chunks);
+    GCodeMachine planner(prototype_, [](const char *, size_t) {});
+    planner.set_dry_run(true);
+    planner.Init(config_, init_comment_, dimension_);
+    for (size_t i = 0; i < chunks; ++i) {
+        start_state[i] = planner.state();
+        planner.Execute(operations_.data() + chunk_start[i],
+                        chunk_start[i + 1] - chunk_start[i]);
+    }
+
+    std::vector<std::string> buffers(chunks);
+    std::vector<char> done(chunks, false);
+    std::mutex done_mutex;
+    std::condition_variable done_changed;
+    std::atomic<size_t> next_chunk(0);
+
+    auto worker = [&]() {
+        size_t chunk;
+        while ((chunk = next_chunk++) < chunks) {
+            std::string *const buffer = &buffers[chunk];
+            GCodeMachine machine(prototype_,
+                                 [buffer](const char *str, size_t len) {
+                                     buffer->append(str, len);
+                                 });
+            machine.set_compact(false);  // Needs all previous lines.
+            if (chunk == 0) {
+                machine.Init(config_, init_comment_, dimension_);
+            } else {
+                machine.Resume(config_, start_state[chunk]);
+            }
+            machine.Execute(operations_.data() + chunk_start[chunk],
+                            chunk_start[chunk + 1] - chunk_start[chunk]);
+            if (chunk == chunks - 1) {
+                machine.Finish();
+            }
+            std::unique_lock<std::mutex> l(done_mutex);
+            done[chunk] = true;
+            done_changed.notify_all();
+        }
+    };
+    const size_t thread_count = std::min<size_t>(threads_, chunks);
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < thread_count; ++i) {
+        threads.push_back(std::thread(worker));
+    }
+
+    // Write chunks in order as soon as they are done.
+    GCodeCompactor compactor;
+    for (size_t i = 0; i < chunks; ++i) {
+        {
+            std::unique_lock<std::mutex> l(done_mutex);
+            done_changed.wait(l, [&]() { return done[i] != 0; });
+        }
+        Write(buffers[i], prototype_.compact() ? &compactor : NULL);
+        std::string().swap(buffers[i]);  // Free memory early.
+    }
+    output_->Sync();
+    for (std::thread &t : threads) t.join();
+
+    if (prototype_.compact() && compactor.bytes_in() > 0) {
+        fprintf(stderr, "Compacted G-Code: %zu bytes instead of %zu "
+                "(%.0f%%)\n", compactor.bytes_out(), compactor.bytes_in(),
+                100.0 * compactor.bytes_out() / compactor.bytes_in());
+    }
+}
@@ -6,6 +6,8 @@
 
 #include <stdio.h>
 #include <math.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include <fstream>
 #include <iostream>
@@ -18,6 +20,38 @@
 
 #define TYPICAL_BOARD_THICKNESS 1.6
 
+// Default speeds in mm/s
+#define PNP_TO_TAPE_SPEED 1000      // moving needle to tape
+#define PNP_TO_BOARD_SPEED 100      // moving component from tape to board
+#define PNP_Z_SPEED (4000 / 60.0)   // moving needle down and up.
+
+#define DISP_MOVE_SPEED 400         // move dispensing unit to next pad
+#define DISP_DISPENSE_SPEED 100     // speed when doing the dispensing down/up
+
+PnPConfig::PnPConfig() : nozzles(1) {
+    MotionProfile &pnp = motion_profiles["default"];
+    pnp.travel = { PNP_TO_TAPE_SPEED, 0 };
+    pnp.loaded = { PNP_TO_BOARD_SPEED, 0 };
+    pnp.descent = { PNP_Z_SPEED, 0 };
+
+    // Dispensing never carries a component; 'loaded' is the max stroke speed.
+    MotionProfile &dispense = motion_profiles["dispense"];
+    dispense.travel = { DISP_MOVE_SPEED, 0 };
+    dispense.loaded = { DISP_MOVE_SPEED, 0 };
+    dispense.descent = { DISP_DISPENSE_SPEED, 0 };
+}
+
+// Parse "<speed> [<acceleration>]" of a motion profile phase.
+static bool ParsePhase(const char *buffer, MotionProfile::Phase *phase) {
+    float speed, acceleration = 0;
+    if (sscanf(buffer, "%f %f", &speed, &acceleration) < 1 || speed <= 0
+        || acceleration < 0)
+        return false;
+    phase->speed = speed;
+    phase->acceleration = acceleration;
+    return true;
+}
+
 PnPConfig *ParsePnPConfiguration(const std::string& filename) {
     std::unique_ptr<PnPConfig> result(new PnPConfig());
 
@@ -27,6 +61,9 @@ PnPConfig *ParsePnPConfiguration(const std::string& filename) {
     std::string token;
     float x, y, z;
     Tape* current_tape = NULL;
+    MotionProfile *current_profile = NULL;
+    bool have_nozzle_config = false;
+    int first_partial_nozzle = 0;    // Line of a nozzle with default axes.
     int line = 1;
     Position tape_tray_origin;
     float tape_tray_height = 0.0f;
@@ -45,8 +82,10 @@ PnPConfig *ParsePnPConfiguration(const std::string& filename) {
 
         if (token == "Board:") {
             if (current_tape) current_tape = NULL;
+            current_profile = NULL;
         } else if (token == "Tape-Tray-Origin:") {
             if (current_tape) current_tape = NULL;
+            current_profile = NULL;
             if (2 > sscanf(buffer, "%f %f %f",
                            &tape_tray_origin.x,
                            &tape_tray_origin.y,
@@ -55,7 +94,73 @@ PnPConfig *ParsePnPConfiguration(const std::string& filename) {
                         filename.c_str(), line, buffer);
                 return NULL;
             }
+        } else if (token == "Glide-Down:") {
+            current_tape = NULL;
+            current_profile = NULL;
+            if (1 != sscanf(buffer, "%f", &result->glide_distance)
+                || result->glide_distance < 0) {
+                fprintf(stderr, "%s:%d: Parse problem glide-down distance: "
+                        "'%s'\n", filename.c_str(), line, buffer);
+                return NULL;
+            }
+        } else if (token == "Nozzle:") {
+            current_tape = NULL;
+            current_profile = NULL;
+            NozzleConfig nozzle;
+            char z_axis[8] = "Z", rotation_axis[8] = "E";
+            const int fields = sscanf(buffer, "%f %f %7s %7s %d %d",
+                                      &nozzle.offset.x, &nozzle.offset.y,
+                                      z_axis, rotation_axis,
+                                      &nozzle.vacuum_pin, &nozzle.blow_pin);
+            if (2 > fields) {
+                fprintf(stderr, "%s:%d: Parse problem nozzle: '%s'\n",
+                        filename.c_str(), line, buffer);
+                return NULL;
+            }
+            if (fields < 5 && first_partial_nozzle == 0)
+                first_partial_nozzle = line;
+            nozzle.z_axis = z_axis;
+            nozzle.rotation_axis = rotation_axis;
+            // The first configured nozzle replaces the default one.
+            if (!have_nozzle_config) result->nozzles.clear();
+            have_nozzle_config = true;
+            result->nozzles.push_back(nozzle);
+        } else if (token == "Motion-Profile:") {
+            current_tape = NULL;
+            char name[256];
+            if (1 != sscanf(buffer, "%255s", name)) {
+                fprintf(stderr, "%s:%d: Motion-Profile needs a name\n",
+                        filename.c_str(), line);
+                return NULL;
+            }
+            // Start out with the defaults, so only differences are needed;
+            // profiles that exist already (e.g. "dispense") with their own.
+            auto found = result->motion_profiles.find(name);
+            if (found == result->motion_profiles.end()) {
+                const MotionProfile defaults = result->default_profile();
+                found = result->motion_profiles.insert({name, defaults}).first;
+            }
+            current_profile = &found->second;
+        } else if (token == "travel:" || token == "loaded:"
+                   || token == "descent:") {
+            if (!current_profile) {
+                fprintf(stderr, "%s:%d: %s without Motion-Profile\n",
+                        filename.c_str(), line, token.c_str());
+                return NULL;
+            }
+            MotionProfile::Phase *phase = (token == "travel:")
+                ? &current_profile->travel
+                : (token == "loaded:")
+                ? &current_profile->loaded
+                : &current_profile->descent;
+            if (!ParsePhase(buffer, phase)) {
+                fprintf(stderr, "%s:%d: Parse problem %s expected "
+                        "<speed> [<acceleration>]: '%s'\n",
+                        filename.c_str(), line, token.c_str(), buffer);
+                return NULL;
+            }
         } else if (token == "Tape:") {
+            current_profile = NULL;
             current_tape = new Tape();
             current_tape->SetAngle(90);
             // This tape is valid for multiple values/footprints possibly.
@@ -64,8 +169,12 @@ PnPConfig *ParsePnPConfiguration(const std::string& filename) {
             std::string all_the_names = buffer;
             std::stringstream parts(all_the_names);
             while (!parts.eof()) {
+                token.clear();
                 parts >> token;
-                result->tape_for_component[token] = current_tape;
+                if (token.empty()) continue;
+                PnPConfig::TapeList &tapes = result->tape_for_component[token];
+                if (tapes.empty() || tapes.back() != current_tape)
+                    tapes.push_back(current_tape);
             }
         } else if (token == "origin:") {
             if (current_tape) {
@@ -116,6 +225,39 @@ PnPConfig *ParsePnPConfiguration(const std::string& filename) {
                 return NULL;
             }
             current_tape->SetAngle(x);
+        } else if (token == "symmetry:") {
+            if (!current_tape) {
+                std::cerr << "Symmetry without tape.";
+                return NULL;
+            }
+            char value[32];
+            const int symmetry = atoi(buffer);
+            if (1 == sscanf(buffer, "%31s", value)
+                && strcmp(value, "auto") == 0) {
+                current_tape->SetSymmetry(Tape::kSymmetryAuto);
+            } else if (symmetry == 90 || symmetry == 180 || symmetry == 360) {
+                current_tape->SetSymmetry(symmetry);
+            } else {
+                fprintf(stderr, "%s:%d: Parse problem symmetry, expected "
+                        "one of 90, 180, 360 or auto: '%s'.\n",
+                        filename.c_str(), line, buffer);
+                return NULL;
+            }
+        } else if (token == "profile:") {
+            if (!current_tape) {
+                std::cerr << "Profile without tape.";
+                return NULL;
+            }
+            char name[256];
+            if (1 != sscanf(buffer, "%255s", name)
+                || result->motion_profiles.find(name)
+                == result->motion_profiles.end()) {
+                fprintf(stderr, "%s:%d: Unknown motion profile '%s'. "
+                        "Needs to be defined before use.\n",
+                        filename.c_str(), line, buffer);
+                return NULL;
+            }
+            current_tape->SetMotionProfile(&result->motion_profiles[name]);
         } else if (token == "count:") {
             if (!current_tape) {
                 std::cerr << "Count without tape.";
@@ -135,6 +277,53 @@ PnPConfig *ParsePnPConfiguration(const std::string& filename) {
         }
     }
 
+    // Each nozzle needs to be moved, turned and switched on its own,
+    // otherwise picking a part would dip or drop the ones already held.
+    const std::vector<NozzleConfig> &nozzles = result->nozzles;
+    if (nozzles.size() > 1 && first_partial_nozzle != 0) {
+        fprintf(stderr, "%s:%d: With multiple nozzles, each needs "
+                "<x> <y> <z-axis> <rotation-axis> <vacuum-pin>\n",
+                filename.c_str(), first_partial_nozzle);
+        return NULL;
+    }
+    for (size_t i = 0; i < nozzles.size(); ++i) {
+        for (size_t j = 0; j < i; ++j) {
+            const char *shared = NULL;
+            if (nozzles[i].z_axis == nozzles[j].z_axis)
+                shared = "z-axis";
+            else if (nozzles[i].rotation_axis == nozzles[j].rotation_axis)
+                shared = "rotation axis";
+            else if (nozzles[i].vacuum_pin == nozzles[j].vacuum_pin)
+                shared = "vacuum pin";
+            if (shared) {
+                fprintf(stderr, "%s: Nozzle %zu and %zu have the same %s\n",
+                        filename.c_str(), j + 1, i + 1, shared);
+                return NULL;
+            }
+        }
+    }
+
+    // Phases without acceleration go back to the one of the default profile;
+    // without that, the firmware would keep whatever was set last.
+    const MotionProfile &defaults = result->default_profile();
+    for (const auto &profile : result->motion_profiles) {
+        const MotionProfile &p = profile.second;
+        const char *missing = NULL;
+        if ((p.travel.acceleration > 0 || p.loaded.acceleration > 0)
+            && defaults.travel.acceleration == 0)
+            missing = "travel";
+        else if (p.descent.acceleration > 0
+                 && defaults.descent.acceleration == 0)
+            missing = "descent";
+        if (missing) {
+            fprintf(stderr, "%s: Motion-Profile %s sets an acceleration; "
+                    "then the default profile needs a %s acceleration to "
+                    "go back to\n", filename.c_str(), profile.first.c_str(),
+                    missing);
+            return NULL;
+        }
+    }
+
     // Let's assume that for now
     result->bed_level = 0;
 
@@ -178,20 +367,22 @@ PnPConfig *ParseSimplePnPConfiguration(const Board &board,
                 t->SetAngle(90);
 
                 t->SetFirstComponentPosition(x, y, z);
-                result->tape_for_component[designator] = t;
+                // Another tape1 for the same designator adds another tape.
+                result->tape_for_component[designator].push_back(t);
             } else {
                 PnPConfig::PartToTapeMap::iterator found;
                 found = result->tape_for_component.find(designator);
                 if (found != result->tape_for_component.end()) {
-                    Tape *t = found->second;
+                    // Refers to the most recently started tape.
+                    Tape *t = found->second.back();
                     const int advance = tape_idx - 1;
                     float old_x, old_y;
                     t->GetPos(&old_x, &old_y);
                     const float dx = (x - old_x) / advance;
                     const float dy = (y - old_y) / advance;
-                    found->second->SetComponentSpacing(dx, dy);
+                    t->SetComponentSpacing(dx, dy);
                     fprintf(stderr, "Δ=%.2fmm ∡=%5.1f° %s\n",
-                            sqrt(dx*dx + dy*dy), found->second->angle(),
+                            sqrt(dx*dx + dy*dy), t->angle(),
                             designator);
                 }
             }
@@ -218,8 +409,10 @@ PnPConfig *ParseSimplePnPConfiguration(const Board &board,
 
     // Cross check
     float lowest_value = result->board.top;
-    for (const auto &t : result->tape_for_component) {
-        lowest_value = std::min(lowest_value, t.second->height());
+    for (const auto &tapes : result->tape_for_component) {
+        for (const Tape *t : tapes.second) {
+            lowest_value = std::min(lowest_value, t->height());
+        }
     }
     if (lowest_value < result->bed_level) {
         fprintf(stderr, "Mmh, looks like there are things _below_ bed-level?\n"
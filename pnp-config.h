@@ -6,19 +6,45 @@
 
 #include <string>
 #include <map>
+#include <vector>
 
 #include "rpt2pnp.h"
 
 class Tape;
 class Board;
 
+// Speed and acceleration for the different phases of moving the needle.
+struct MotionProfile {
+    struct Phase {
+        float speed;         // mm/s
+        float acceleration;  // mm/s^2. 0: leave firmware setting unchanged.
+    };
+    Phase travel;   // Moving without component on the needle.
+    Phase loaded;   // Moving while carrying a component.
+    Phase descent;  // Moving the needle down and up.
+};
+
+// A vacuum nozzle of the pick-n-place head.
+struct NozzleConfig {
+    Position offset;                    // XY relative to the first nozzle.
+    std::string z_axis = "Z";           // G-Code axis moving it up/down.
+    std::string rotation_axis = "E";    // G-Code axis rotating it.
+    int vacuum_pin = 6;                 // M42 pin switching vacuum.
+    int blow_pin = 8;                   // M42 pin to blow off component.
+};
+
 // (for now: simple) configuration for the setup needed to do pick-n-place.
 // TODO:
 //  - reference position on board
 //  - multiple boards
 //  - different board-height for dispense-needle and pick'n place
 struct PnPConfig {
-    typedef std::map<std::string, Tape*> PartToTapeMap;
+    PnPConfig();
+
+    // There can be multiple tapes with the same component, so that we can
+    // choose the closest and have a fallback once a tape is exhausted.
+    typedef std::vector<Tape*> TapeList;
+    typedef std::map<std::string, TapeList> PartToTapeMap;
     struct BoardConfig {
         Position origin;  // TODO: potentially rotation...
         float top = 0;    // Z position of top-surface of board.
@@ -27,6 +53,27 @@ struct PnPConfig {
     BoardConfig board;
     PartToTapeMap tape_for_component;
 
+    // Nozzles of the head; always at least one. With multiple nozzles,
+    // several parts are picked before they are all placed in one trip.
+    std::vector<NozzleConfig> nozzles;
+
+    // Motion profiles by name. The "default" profile is used for tapes that
+    // don't reference any, "dispense" for dispensing; both always exist.
+    std::map<std::string, MotionProfile> motion_profiles;
+    const MotionProfile &default_profile() const {
+        return motion_profiles.at("default");
+    }
+    const MotionProfile &dispense_profile() const {
+        return motion_profiles.at("dispense");
+    }
+
+    // Horizontal distance before the target of a pick or place from which
+    // the nozzle glides down diagonally from travel height instead of
+    // descending vertically. It then passes low over whatever is near the
+    // target, so this is only for boards and tapes without tall parts.
+    // 0: off.
+    float glide_distance = 0;
+
     // Baseline. All z-coordinates in board and tape are larger than this.
     float bed_level = -1;
 };
@@ -6,6 +6,9 @@
 
 #include <math.h>
 
+#include <algorithm>
+
+#include "output-sink.h"
 #include "pnp-config.h"
 #include "tape.h"
 #include "board.h"
@@ -86,6 +89,22 @@ static const char ps_preamble[] = R"(
 % Stack: <diameter>
 /pp { 0.2 setlinewidth 0 360 arc stroke } def
 
+% DispenseStroke, from the current point that 'm' left on the stack.
+% Stack: <x0> <y0> <x1> <y1> <width>
+/ds {
+  gsave 1 setlinecap setlinewidth
+  4 2 roll moveto lineto stroke
+  grestore
+} def
+
+% Path of the head on one pick-and-place trip; a color per batch.
+% Stack: <r> <g> <b> <x0> <y0> <x1> <y1>
+/trip {
+  gsave 0.2 setlinewidth [1 0.5] 0 setdash
+  4 2 roll moveto lineto setrgbcolor stroke
+  grestore
+} def
+
 % Move, show path.
 % Stack: <x> <y>
 /m {
@@ -101,7 +120,13 @@ static const char ps_preamble[] = R"(
 /Helvetica findfont 1.5 scalefont setfont  % Small font
 )";
 
-PostScriptMachine::PostScriptMachine(FILE *output) : output_(output) {}
+// Colors to distinguish batches of picks and places.
+static const char *const kBatchColors[] = {
+    "0 0.6 0", "0.8 0 0.8", "0 0.6 0.8", "0.8 0.5 0", "0.4 0.4 1", "0.6 0.3 0"
+};
+
+PostScriptMachine::PostScriptMachine(OutputSink *output)
+    : output_(output), batch_(0), last_was_pick_(false) {}
 
 bool PostScriptMachine::Init(const PnPConfig *config,
                              const std::string &init_comment,
@@ -111,85 +136,109 @@ bool PostScriptMachine::Init(const PnPConfig *config,
         config_ = new PnPConfig();
     }
     dispense_parts_printed_.clear();
+    picked_parts_.clear();
+    batch_ = 0;
+    last_was_pick_ = false;
     const float mm_to_point = 1 / 25.4 * 72.0;
     if (config_->tape_for_component.size() == 0) {
-        fprintf(output_,
+        output_->Printf(
                 "%%!PS-Adobe-3.0\n%%%%BoundingBox: %.0f %.0f %.0f %.0f\n\n",
                 config_->board.origin.x * mm_to_point,
                 config_->board.origin.y * mm_to_point,
                 board_dim.w * mm_to_point, board_dim.h * mm_to_point);
     } else {
-        fprintf(output_,
+        output_->Printf(
                 "%%!PS-Adobe-3.0\n%%%%BoundingBox: %.0f %.0f %.0f %.0f\n\n",
                 0 * mm_to_point, 0 * mm_to_point,
                 300 * mm_to_point, 300 * mm_to_point);
     }
-    fprintf(output_, "%% %s\n", init_comment.c_str());
-    fprintf(output_, "%s", ps_preamble);
+    output_->Printf("%% %s\n", init_comment.c_str());
+    output_->Printf("%s", ps_preamble);
 
     // Draw board
-    fprintf(output_, "%.1f %.1f %.1f %.1f rect\n", board_dim.w, board_dim.h,
-            config_->board.origin.x, config_->board.origin.y);
-    fprintf(output_, "%.1f %.1f moveto (%.1fmm) show\n",
-            config_->board.origin.x + board_dim.w + 1,
-            config_->board.origin.y + board_dim.h / 2,
-            board_dim.h);
-    fprintf(output_, "%.1f %.1f moveto (%.1fmm) show\n",
-            config_->board.origin.x + board_dim.w / 2,
-            config_->board.origin.y - 2,
-            board_dim.w);
+    output_->Printf("%.1f %.1f %.1f %.1f rect\n", board_dim.w, board_dim.h,
+                    config_->board.origin.x, config_->board.origin.y);
+    output_->Printf("%.1f %.1f moveto (%.1fmm) show\n",
+                    config_->board.origin.x + board_dim.w + 1,
+                    config_->board.origin.y + board_dim.h / 2,
+                    board_dim.h);
+    output_->Printf("%.1f %.1f moveto (%.1fmm) show\n",
+                    config_->board.origin.x + board_dim.w / 2,
+                    config_->board.origin.y - 2,
+                    board_dim.w);
 
 #if 0
-    fprintf(output_, "%.1f %.1f showmark\n",
-            config_->board.origin.x, config_->board.origin.y);
+    output_->Printf("%.1f %.1f showmark\n",
+                    config_->board.origin.x, config_->board.origin.y);
 #endif
     // Push a currentpoint on stack (dispense draws a line from here)
-    fprintf(output_, "%.1f %.1f moveto %.1f %.1f grid\n",
-            config_->board.origin.x, config_->board.origin.y,
-            board_dim.w, board_dim.h);
+    output_->Printf("%.1f %.1f moveto %.1f %.1f grid\n",
+                    config_->board.origin.x, config_->board.origin.y,
+                    board_dim.w, board_dim.h);
     return true;
 }
 
-static void PrintPads(FILE *output,
+static void PrintPads(OutputSink *output,
                       const Part &part, float offset_x, float offset_y,
                       float angle){
     // Print pads first, so that the bounding box is nice and black.
-    fprintf(output, "%%pads\n");
-    fprintf(output, "gsave\n %.3f %.3f translate %.3f rotate\n",
-            offset_x, offset_y, angle);
+    output->Printf("%%pads\n");
+    output->Printf("gsave\n %.3f %.3f translate %.3f rotate\n",
+                   offset_x, offset_y, angle);
     for (const Pad &pad : part.pads) {
-        fprintf(output, " 0.7 0.9 0 setrgbcolor\n");
-        fprintf(output, " %.3f %.3f %.3f %.3f fillrect\n",
-                pad.size.w, pad.size.h,
-                pad.pos.x - pad.size.w/2,
-                pad.pos.y - pad.size.h/2);
-        fprintf(output, " 0 0 0 setrgbcolor\n");
-        fprintf(output, " %.3f %.3f moveto (%s) show stroke\n",
-                pad.pos.x - pad.size.w/2,
-                pad.pos.y - pad.size.h/2,
-                pad.name.c_str());
+        output->Printf(" 0.7 0.9 0 setrgbcolor\n");
+        output->Printf(" %.3f %.3f %.3f %.3f fillrect\n",
+                       pad.size.w, pad.size.h,
+                       pad.pos.x - pad.size.w/2,
+                       pad.pos.y - pad.size.h/2);
+        output->Printf(" 0 0 0 setrgbcolor\n");
+        output->Printf(" %.3f %.3f moveto (%s) show stroke\n",
+                       pad.pos.x - pad.size.w/2,
+                       pad.pos.y - pad.size.h/2,
+                       pad.name.c_str());
+    }
+    output->Printf(" stroke\ngrestore\n");
+}
+
+void PostScriptMachine::PrintTrip(const Position &pos, bool is_pick) {
+    if (is_pick && !last_was_pick_) {
+        ++batch_;  // Picking after placing: a new trip starts.
+    } else {
+        const int colors = sizeof(kBatchColors) / sizeof(kBatchColors[0]);
+        output_->Printf("%s %.3f %.3f %.3f %.3f trip\n",
+                        kBatchColors[batch_ % colors],
+                        trip_pos_.x, trip_pos_.y, pos.x, pos.y);
+    }
+    if (!is_pick) {
+        output_->Printf("%.3f %.3f moveto (#%d) show\n",
+                        pos.x + 0.5, pos.y - 1.5, batch_);
     }
-    fprintf(output, " stroke\ngrestore\n");
+    trip_pos_ = pos;
+    last_was_pick_ = is_pick;
 }
 
-void PostScriptMachine::PickPart(const Part &part, const Tape *tape) {
+void PostScriptMachine::PickPart(const Part &part, const Tape *tape,
+                                 int nozzle) {
     if (tape == NULL) return;
     float tx, ty;
     if (tape->GetPos(&tx, &ty)) {
+        picked_parts_.insert(&part);
+        PrintTrip(Position(tx, ty), true);
         // Print component on tape
         PrintPads(output_, part, tx, ty, tape->angle());
-        fprintf(output_, "%.3f %.3f   %.3f %.3f %s (%s) %.3f %.3f %.3f pc\n",
-                part.bounding_box.p1.x - part.bounding_box.p0.x,
-                part.bounding_box.p1.y - part.bounding_box.p0.y,
-                part.bounding_box.p0.x, part.bounding_box.p0.y,
-                PICK_COLOR,
-                part.component_name.c_str(),
-                tape->angle(),
-                tx, ty);
+        output_->Printf("%.3f %.3f   %.3f %.3f %s (%s) %.3f %.3f %.3f pc\n",
+                        part.bounding_box.p1.x - part.bounding_box.p0.x,
+                        part.bounding_box.p1.y - part.bounding_box.p0.y,
+                        part.bounding_box.p0.x, part.bounding_box.p0.y,
+                        PICK_COLOR,
+                        part.component_name.c_str(),
+                        tape->angle(),
+                        tx, ty);
     }
 }
 
-void PostScriptMachine::PlacePart(const Part &part, const Tape *tape) {
+void PostScriptMachine::PlacePart(const Part &part, const Tape *tape,
+                                  int nozzle) {
     // Print pads first, so that the bounding box is nice and black.
     PrintPads(output_, part,
               config_->board.origin.x + part.pos.x,
@@ -198,35 +247,41 @@ void PostScriptMachine::PlacePart(const Part &part, const Tape *tape) {
 
     // Not available parts because tape is not there or exhausted are still
     // visualized, but with a warning color.
-    const char *const color = (tape != NULL && tape->parts_available())
-        ? PLACE_COLOR
-        : PLACE_MISSING_PART;
-    fprintf(output_, "%.3f %.3f   %.3f %.3f %s (%s) %.3f %.3f %.3f pc\n",
-            part.bounding_box.p1.x - part.bounding_box.p0.x,
-            part.bounding_box.p1.y - part.bounding_box.p0.y,
-            part.bounding_box.p0.x, part.bounding_box.p0.y,
-            color,
-            //(part.footprint + "@" + part.value) +
-            part.component_name.c_str(),
-            part.angle,
-            part.pos.x + config_->board.origin.x,
-            part.pos.y + config_->board.origin.y);
+    const bool was_picked = picked_parts_.find(&part) != picked_parts_.end();
+    const char *const color = was_picked ? PLACE_COLOR : PLACE_MISSING_PART;
+    if (was_picked) {
+        PrintTrip(config_->board.origin + part.pos, false);
+    }
+    output_->Printf("%.3f %.3f   %.3f %.3f %s (%s) %.3f %.3f %.3f pc\n",
+                    part.bounding_box.p1.x - part.bounding_box.p0.x,
+                    part.bounding_box.p1.y - part.bounding_box.p0.y,
+                    part.bounding_box.p0.x, part.bounding_box.p0.y,
+                    color,
+                    //(part.footprint + "@" + part.value) +
+                    part.component_name.c_str(),
+                    part.angle,
+                    part.pos.x + config_->board.origin.x,
+                    part.pos.y + config_->board.origin.y);
 }
 
-void PostScriptMachine::Dispense(const Part &part, const Pad &pad) {
+void PostScriptMachine::PrintDispensePart(const Part &part) {
     if (dispense_parts_printed_.find(&part) == dispense_parts_printed_.end()) {
         // First time we see this component.
-        fprintf(output_, "%.3f %.3f   %.3f %.3f %s (%s) %.3f %.3f %.3f pc\n",
-                part.bounding_box.p1.x - part.bounding_box.p0.x,
-                part.bounding_box.p1.y - part.bounding_box.p0.y,
-                part.bounding_box.p0.x, part.bounding_box.p0.y,
-                DISPENSE_PART_COLOR,
-                part.component_name.c_str(),
-                part.angle,
-                part.pos.x + config_->board.origin.x,
-                part.pos.y + config_->board.origin.y);
+        output_->Printf("%.3f %.3f   %.3f %.3f %s (%s) %.3f %.3f %.3f pc\n",
+                        part.bounding_box.p1.x - part.bounding_box.p0.x,
+                        part.bounding_box.p1.y - part.bounding_box.p0.y,
+                        part.bounding_box.p0.x, part.bounding_box.p0.y,
+                        DISPENSE_PART_COLOR,
+                        part.component_name.c_str(),
+                        part.angle,
+                        part.pos.x + config_->board.origin.x,
+                        part.pos.y + config_->board.origin.y);
         dispense_parts_printed_.insert(&part);
     }
+}
+
+void PostScriptMachine::Dispense(const Part &part, const Pad &pad) {
+    PrintDispensePart(part);
 
     // TODO: so this part looks like we shouldn't have to do it here.
     const float angle = 2 * M_PI * part.angle / 360.0;
@@ -237,11 +292,27 @@ void PostScriptMachine::Dispense(const Part &part, const Pad &pad) {
     const float pad_y = pad.pos.y;
     const float x = part_x + pad_x * cos(angle) - pad_y * sin(angle);
     const float y = part_y + pad_x * sin(angle) + pad_y * cos(angle);
-    fprintf(output_, "%.3f %.3f m %.3f pp \n%.3f %.3f moveto ",
-            x, y, sqrtf(area / M_PI), x, y);
+    output_->Printf("%.3f %.3f m %.3f pp \n%.3f %.3f moveto ",
+                    x, y, sqrtf(area / M_PI), x, y);
+
+}
+
+void PostScriptMachine::DispenseStroke(const Part &part,
+                                       const std::vector<const Pad *> &row) {
+    PrintDispensePart(part);
+    const Position start = config_->board.origin
+        + part.padAbsPos(*row.front());
+    const Position end = config_->board.origin + part.padAbsPos(*row.back());
+    const float width = std::min(row.front()->size.w, row.front()->size.h);
+    output_->Printf("%.3f %.3f m %.3f %.3f %.3f ds \n%.3f %.3f moveto ",
+                    start.x, start.y, end.x, end.y, width, end.x, end.y);
+}
 
+void PostScriptMachine::Execute(const MachineOp *ops, size_t count) {
+    ExecuteEach(this, ops, count);
 }
 
 void PostScriptMachine::Finish() {
-    fprintf(output_, "showpage\n");
+    output_->Printf("showpage\n");
+    output_->Sync();
 }
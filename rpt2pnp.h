@@ -44,4 +44,14 @@ float Distance(const Position& a, const Position& b);
 typedef std::vector<std::pair<const Part *, const Pad *> > OptimizeList;
 void OptimizeParts(OptimizeList *list);
 
+// A row of equally sized, equally spaced pads on a straight line, in the
+// order they are to be visited. Typical for SOIC or QFP footprints.
+typedef std::vector<const Pad *> PadRow;
+
+// Find rows of at least "min_pads" pads on "part" that are no more than
+// "max_pitch" apart. These can be dispensed in one continuous stroke instead
+// of individual dots. A pad is part of at most one row.
+std::vector<PadRow> FindPadRows(const Part &part, size_t min_pads,
+                                float max_pitch);
+
 #endif // RPT2PNP_H
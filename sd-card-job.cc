@@ -0,0 +1,129 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) h.zeller@acm.org. Free Software. GNU Public License v3.0 and above
+ */
+
+#include "sd-card-job.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "gcode-streamer.h"
+
+// How often we ask for the progress while the machine prints.
+static const int kProgressPollSeconds = 2;
+
+SDCardJob::SDCardJob(GCodeStreamer *streamer, const std::string &filename)
+    : streamer_(streamer), filename_(filename), failed_(false),
+      uploading_(false), selected_(false), printing_(false), done_(false),
+      bytes_done_(0), bytes_total_(0) {
+    streamer_->set_message_handler([this](const char *line) {
+            HandleMessage(line);
+        });
+}
+
+void SDCardJob::HandleMessage(const char *line) {
+    long done, total;
+    if (strncmp(line, "open failed", 11) == 0) {
+        failed_ = true;
+    } else if (strncmp(line, "Writing to file", 15) == 0) {
+        uploading_ = true;
+    } else if (strncmp(line, "File selected", 13) == 0) {
+        selected_ = true;
+    } else if (strncmp(line, "Not SD printing", 15) == 0) {
+        printing_ = false;
+    } else if (strncmp(line, "Done printing file", 18) == 0) {
+        done_ = true;
+    } else if (sscanf(line, "SD printing byte %ld/%ld", &done, &total) == 2) {
+        bytes_done_ = done;
+        bytes_total_ = total;
+    } else if (strncmp(line, "File opened", 11) == 0
+               || strncmp(line, "Done saving file", 16) == 0
+               || strncmp(line, "File deleted", 12) == 0) {
+        // Expected; nothing to do.
+    } else {
+        fprintf(stderr, "%s", line);
+    }
+}
+
+bool SDCardJob::Command(const char *command) {
+    const std::string line = std::string(command) + "\n";
+    return streamer_->Send(line.data(), line.size()) && streamer_->Flush();
+}
+
+bool SDCardJob::BeginUpload() {
+    const std::string command = "M28 " + filename_;
+    if (!Command(command.c_str()) || failed_ || !uploading_) {
+        fprintf(stderr, "Can't write %s to the SD card of the machine.\n",
+                filename_.c_str());
+        return false;
+    }
+    fprintf(stderr, "Uploading job to %s on the SD card.\n", filename_.c_str());
+    return true;
+}
+
+bool SDCardJob::EndUpload() {
+    const std::string command = "M29 " + filename_;
+    uploading_ = false;
+    if (!Command(command.c_str())) {
+        fprintf(stderr, "Can't close %s on the SD card of the machine.\n",
+                filename_.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool SDCardJob::CancelUpload() {
+    streamer_->Abort("");   // Nothing to stop; lines only go to the file.
+    const std::string close_file = "M29 " + filename_;
+    const std::string delete_file = "M30 " + filename_;
+    uploading_ = false;
+    fprintf(stderr, "Deleting the partial upload %s from the SD card.\n",
+            filename_.c_str());
+    if (!Command(close_file.c_str()) || !Command(delete_file.c_str())) {
+        fprintf(stderr, "Can't delete %s from the SD card of the machine.\n",
+                filename_.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool SDCardJob::Run(volatile sig_atomic_t *interrupted) {
+    const std::string command = "M23 " + filename_;
+    if (!Command(command.c_str()) || failed_ || !selected_) {
+        fprintf(stderr, "Can't open %s on the SD card of the machine.\n",
+                filename_.c_str());
+        return false;
+    }
+    printing_ = true;
+    if (!Command("M24")) {
+        if (!*interrupted) {
+            fprintf(stderr, "Can't start printing %s from the SD card.\n",
+                    filename_.c_str());
+        }
+        return false;
+    }
+    fprintf(stderr, "Printing %s from the SD card.\n", filename_.c_str());
+
+    while (!done_ && printing_) {
+        if (*interrupted) {
+            fprintf(stderr, "\nCancelling the print from the SD card.\n");
+            streamer_->Abort("M524\n");
+            return false;
+        }
+        sleep(kProgressPollSeconds);   // A signal ends this early.
+        if (!Command("M27")) {
+            if (*interrupted) continue;
+            fprintf(stderr, "\nLost track of printing %s from the SD card.\n",
+                    filename_.c_str());
+            return false;
+        }
+        if (bytes_total_ > 0) {
+            fprintf(stderr, "\rSD printing %3.0f%% (%ld of %ld bytes)",
+                    100.0 * bytes_done_ / bytes_total_,
+                    bytes_done_.load(), bytes_total_.load());
+        }
+    }
+    fprintf(stderr, "\nDone printing %s.\n", filename_.c_str());
+    return true;
+}
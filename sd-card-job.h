@@ -0,0 +1,67 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) h.zeller@acm.org. Free Software. GNU Public License v3.0 and above
+ *
+ * Running a job from the SD card of the machine.
+ */
+
+#ifndef PNP_SD_CARD_JOB_H
+#define PNP_SD_CARD_JOB_H
+
+#include <signal.h>
+
+#include <atomic>
+#include <string>
+
+class GCodeStreamer;
+
+// Instead of streaming the job to the machine while it runs, it is uploaded
+// to a file on the SD card of the firmware (M28/M29) and then printed from
+// there (M23/M24), without any round trips to the host. Progress is polled
+// with M27.
+//
+// Uses the message handler of the streamer; create before its I/O thread
+// is started.
+class SDCardJob {
+public:
+    SDCardJob(GCodeStreamer *streamer, const std::string &filename);
+
+    // Everything sent after this goes to the file instead of being executed.
+    // Returns 'false' and prints a message to stderr on error.
+    bool BeginUpload();
+
+    // Close the file. Returns 'false' and prints a message to stderr on
+    // error.
+    bool EndUpload();
+
+    // Instead of EndUpload(), e.g. when interrupted: drop what is not sent
+    // yet, close the file and delete it, so that no partial job is left on
+    // the SD card. Returns 'false' and prints a message to stderr on error.
+    bool CancelUpload();
+
+    // Print the file and wait until the machine is done, printing the
+    // progress. Once "*interrupted" is set, the print is cancelled (M524),
+    // and 'false' is returned; the machine then still needs to be stopped
+    // and put into a safe state. Otherwise, returns 'false' and prints a
+    // message to stderr on error.
+    bool Run(volatile sig_atomic_t *interrupted);
+
+private:
+    // Responses of the machine, from the I/O thread of the streamer.
+    void HandleMessage(const char *line);
+
+    // Send a command and wait for its "ok". Returns 'false' on error.
+    bool Command(const char *command);
+
+    GCodeStreamer *const streamer_;
+    const std::string filename_;
+
+    std::atomic<bool> failed_;        // "open failed"
+    std::atomic<bool> uploading_;     // "Writing to file"
+    std::atomic<bool> selected_;      // "File selected"
+    std::atomic<bool> printing_;      // Not "Not SD printing"
+    std::atomic<bool> done_;          // "Done printing file"
+    std::atomic<long> bytes_done_;    // "SD printing byte 123/4567"
+    std::atomic<long> bytes_total_;
+};
+
+#endif  // PNP_SD_CARD_JOB_H
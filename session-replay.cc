@@ -0,0 +1,285 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) h.zeller@acm.org. Free Software. GNU Public License v3.0 and above
+ *
+ * Replays a session with a machine recorded with rpt2pnp -R: G-Code is
+ * streamed to a stand-in for the machine that answers with the timing
+ * recorded, to compare ways of streaming without the machine.
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <deque>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "event-loop.h"
+#include "gcode-streamer.h"
+#include "machine-connection.h"
+
+// What we learn from a recorded session.
+struct Recording {
+    std::vector<std::string> lines;     // Sent; without line numbers.
+    int64_t latency_us = 0;             // Shortest time to an "ok".
+    std::vector<int64_t> service_us;    // Machine time per line.
+    int64_t duration_us = 0;            // First line sent to last "ok".
+    long acknowledged = 0;
+    long resends = 0;
+};
+
+// Split off "N12 " and "*34" of a line sent with line number and checksum.
+// Returns the line number, or -1 if there is none.
+static long StripLineNumber(std::string *line) {
+    if (line->size() < 2 || (*line)[0] != 'N' || !isdigit((*line)[1]))
+        return -1;
+    char *end;
+    const long number = strtol(line->c_str() + 1, &end, 10);
+    const size_t star = line->rfind('*');
+    if (star != std::string::npos) line->resize(star);
+    line->erase(0, end - line->c_str() + (*end == ' ' ? 1 : 0));
+    return number;
+}
+
+// The shortest time from sending a line to its "ok" is taken as the
+// latency of the link, which overlaps with the machine working when lines
+// are streamed. The time the machine took for a line is from when it
+// arrived, or when the machine acknowledged the line before, whichever is
+// later, to its "ok". Lines the machine rejected (resend requests) don't
+// count. Only the job counts: the handshake before it might have lines
+// without "ok", e.g. while the machine was still starting up.
+static bool ReadRecording(const char *filename, Recording *r) {
+    struct Ack {
+        int64_t sent_us, previous_ok_us, ok_us;
+    };
+    std::vector<Ack> acks;
+    std::deque<int64_t> in_flight;   // When the lines were sent.
+    int64_t first_sent = -1;
+    int64_t previous_ok = 0;
+    long last_number = -1;           // To skip lines sent again.
+    bool after_resend = false;
+    const bool success = SessionLog::Read(
+        filename, [&](int64_t us, SessionLog::Direction dir,
+                      const char *data, size_t len) {
+            if (dir == SessionLog::SENT && len == 0) {
+                // The job starts; forget the handshake.
+                *r = Recording();
+                acks.clear();
+                in_flight.clear();
+                first_sent = -1;
+                previous_ok = 0;
+                last_number = -1;
+                after_resend = false;
+                return;
+            }
+            if (dir == SessionLog::SENT) {
+                // One write can have several lines.
+                for (size_t pos = 0; pos < len; /**/) {
+                    const char *end = (const char *) memchr(data + pos, '\n',
+                                                            len - pos);
+                    const size_t line_end = end ? end - data : len;
+                    std::string line(data + pos, line_end - pos);
+                    pos = line_end + 1;
+                    in_flight.push_back(us);
+                    if (first_sent < 0) first_sent = us;
+                    const long number = StripLineNumber(&line);
+                    if (line.compare(0, 4, "M110") == 0) {
+                        // Our own streamer sets the line number.
+                        const size_t n = line.find('N');
+                        if (n != std::string::npos)
+                            last_number = atol(line.c_str() + n + 1);
+                        continue;
+                    }
+                    if (number >= 0) {
+                        if (number <= last_number) continue;  // Resent.
+                        last_number = number;
+                    }
+                    r->lines.push_back(line);
+                }
+                return;
+            }
+            if (strncasecmp(data, "Resend:", 7) == 0
+                || strncmp(data, "rs ", 3) == 0) {
+                after_resend = true;
+                ++r->resends;
+                return;
+            }
+            const bool is_ok = (strncasecmp(data, "ok", 2) == 0
+                                || strncmp(data, "error:", 6) == 0);
+            if (!is_ok || in_flight.empty())
+                return;
+            const int64_t sent = in_flight.front();
+            in_flight.pop_front();
+            if (!after_resend)
+                acks.push_back({ sent, previous_ok, us });
+            after_resend = false;
+            previous_ok = us;
+            r->duration_us = us - first_sent;
+            ++r->acknowledged;
+        });
+    if (acks.empty())
+        return success;
+    r->latency_us = acks[0].ok_us - acks[0].sent_us;
+    for (const Ack &a : acks)
+        r->latency_us = std::min(r->latency_us, a.ok_us - a.sent_us);
+    for (const Ack &a : acks) {
+        const int64_t start = std::max(a.sent_us + r->latency_us,
+                                       a.previous_ok_us);
+        r->service_us.push_back(std::max<int64_t>(0, a.ok_us - start));
+    }
+    return success;
+}
+
+// Stands in for the machine on "fd": each line is acknowledged with "ok"
+// once it had its turn for the next of the recorded service times, plus
+// the latency. Runs until the connection is closed.
+static void ReplayMachine(int fd, int64_t latency_us,
+                          const std::vector<int64_t> &service_us) {
+    EventLoop loop;
+    loop.Watch(fd, EPOLLIN);
+    std::deque<int64_t> due_us;   // Of the "ok"s to send.
+    int64_t machine_done = 0;
+    size_t next_service = 0;
+    size_t partial = 0;           // Bytes of the line not complete yet.
+    char buffer[4096];
+    for (;;) {
+        int64_t now = LinkStats::Micros();
+        while (!due_us.empty() && due_us.front() <= now) {
+            due_us.pop_front();
+            if (!WriteToMachine(fd, "ok\n", 3))
+                return;
+        }
+        const int64_t timeout = due_us.empty()
+            ? -1 : std::max<int64_t>(1, due_us.front() - now);
+        if (loop.WaitMicros(timeout) <= 0)
+            continue;
+        const ssize_t r = read(fd, buffer, sizeof(buffer));
+        if (r == 0 || (r < 0 && errno != EAGAIN && errno != EINTR))
+            return;   // Closed.
+        now = LinkStats::Micros();
+        for (ssize_t i = 0; i < r; ++i) {
+            if (buffer[i] != '\n') {
+                ++partial;
+                continue;
+            }
+            if (partial == 0) continue;   // Empty lines don't get an "ok".
+            partial = 0;
+            // Recorded sessions with fewer lines are repeated.
+            const int64_t service = service_us.empty()
+                ? 0 : service_us[next_service++ % service_us.size()];
+            machine_done = std::max(now, machine_done) + service;
+            due_us.push_back(machine_done + latency_us);
+        }
+    }
+}
+
+// Lines of the G-Code file "filename".
+static bool ReadGCode(const char *filename, std::vector<std::string> *lines) {
+    FILE *in = fopen(filename, "r");
+    if (in == NULL) {
+        fprintf(stderr, "Can't open %s: %s\n", filename, strerror(errno));
+        return false;
+    }
+    char buffer[1024];
+    while (fgets(buffer, sizeof(buffer), in)) {
+        const size_t len = strcspn(buffer, "\r\n");
+        lines->push_back(std::string(buffer, len));
+    }
+    fclose(in);
+    return true;
+}
+
+static int usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [options] <session-log> [<gcode-file>]\n"
+            "Replays a session with a machine recorded with rpt2pnp -R:\n"
+            "streams the G-Code file (default: the lines sent in the\n"
+            "session) to a stand-in for the machine that acknowledges each\n"
+            "line taking as long as the machine did.\n"
+            "Options:\n"
+            "\t-w<bytes>: Stream, keeping up to this many bytes in the\n"
+            "\t          receive buffer. Default 0: wait for 'ok' after\n"
+            "\t          each line.\n"
+            "\t-n       : Send line numbers and checksums.\n"
+            "\t-i<sec>  : Print statistics every sec seconds.\n",
+            prog);
+    return 1;
+}
+
+int main(int argc, char *argv[]) {
+    int window = 0;
+    bool line_numbers = false;
+    int report_interval = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "w:ni:")) != -1) {
+        switch (opt) {
+        case 'w': window = atoi(optarg); break;
+        case 'n': line_numbers = true; break;
+        case 'i': report_interval = atoi(optarg); break;
+        default:
+            return usage(argv[0]);
+        }
+    }
+    if (optind >= argc || window < 0)
+        return usage(argv[0]);
+
+    Recording recording;
+    if (!ReadRecording(argv[optind], &recording))
+        return 1;
+    fprintf(stderr, "Session: %ld lines acknowledged in %.2fs; "
+            "%ld resend requests; %.2fms latency.\n", recording.acknowledged,
+            recording.duration_us / 1e6, recording.resends,
+            recording.latency_us / 1e3);
+    std::vector<std::string> lines;
+    if (optind + 1 < argc) {
+        if (!ReadGCode(argv[optind + 1], &lines))
+            return 1;
+    } else {
+        lines.swap(recording.lines);
+    }
+
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        perror("socketpair");
+        return 1;
+    }
+    for (int fd : fds) fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    std::thread machine(ReplayMachine, fds[1], recording.latency_us,
+                        std::cref(recording.service_us));
+
+    LineReader connection(fds[0]);
+    GCodeStreamer *streamer = new GCodeStreamer(&connection, window);
+    streamer->set_line_numbers(line_numbers);
+    streamer->stats()->set_report_interval(report_interval);
+    if (!streamer->StartIOThread())
+        return 1;
+    const int64_t start = LinkStats::Micros();
+    bool success = true;
+    std::string line;
+    for (const std::string &l : lines) {
+        if (l.empty() || l[0] == ';' || l[0] == '(')
+            continue;
+        line.assign(l).append("\n");
+        if (!(success = streamer->Send(line.data(), line.size())))
+            break;
+    }
+    success = success && streamer->Flush();
+    const int64_t duration_us = LinkStats::Micros() - start;
+    streamer->stats()->Print(stderr);
+    delete streamer;
+    close(fds[0]);
+    machine.join();
+    close(fds[1]);
+
+    fprintf(stderr, "Replayed in %.2fs (session: %.2fs).\n",
+            duration_us / 1e6, recording.duration_us / 1e6);
+    return success ? 0 : 1;
+}
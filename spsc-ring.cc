@@ -0,0 +1,58 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) h.zeller@acm.org. Free Software. GNU Public License v3.0 and above
+ */
+
+#include "spsc-ring.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+static size_t RoundUpToPowerOfTwo(size_t n) {
+    size_t result = 64;
+    while (result < n) result *= 2;
+    return result;
+}
+
+SpscRing::SpscRing(size_t capacity)
+    : buffer_(RoundUpToPowerOfTwo(capacity)), mask_(buffer_.size() - 1),
+      head_(0), tail_(0) {}
+
+void SpscRing::CopyIn(size_t pos, const void *data, size_t len) {
+    const size_t index = pos & mask_;
+    const size_t first = std::min(len, buffer_.size() - index);
+    memcpy(&buffer_[index], data, first);
+    memcpy(&buffer_[0], (const char *) data + first, len - first);
+}
+
+void SpscRing::CopyOut(size_t pos, void *data, size_t len) const {
+    const size_t index = pos & mask_;
+    const size_t first = std::min(len, buffer_.size() - index);
+    memcpy(data, &buffer_[index], first);
+    memcpy((char *) data + first, &buffer_[0], len - first);
+}
+
+bool SpscRing::Push(uint32_t tag, const char *data, size_t len) {
+    if (free_space() < RecordSize(len))
+        return false;
+    const size_t tail = tail_.load(std::memory_order_relaxed);
+    const Header header = { tag, (uint32_t) len };
+    CopyIn(tail, &header, sizeof(header));
+    CopyIn(tail + sizeof(header), data, len);
+    tail_.store(tail + RecordSize(len), std::memory_order_release);
+    return true;
+}
+
+bool SpscRing::Pop(uint32_t *tag, std::string *data) {
+    const size_t head = head_.load(std::memory_order_relaxed);
+    if (head == tail_.load(std::memory_order_acquire))
+        return false;
+    Header header;
+    CopyOut(head, &header, sizeof(header));
+    data->resize(header.len);
+    if (header.len > 0)
+        CopyOut(head + sizeof(header), &(*data)[0], header.len);
+    *tag = header.tag;
+    head_.store(head + RecordSize(header.len), std::memory_order_release);
+    return true;
+}
@@ -0,0 +1,68 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) h.zeller@acm.org. Free Software. GNU Public License v3.0 and above
+ *
+ * Lock-free queue between two threads.
+ */
+
+#ifndef PNP_SPSC_RING_H
+#define PNP_SPSC_RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+// A queue of records (byte strings with a tag) from exactly one producer
+// thread to exactly one consumer thread, without locks. Neither side
+// blocks: Push() returns 'false' if there is no room, Pop() if there is
+// nothing to read; waiting is up to the caller.
+class SpscRing {
+public:
+    // Capacity in bytes; rounded up to a power of two.
+    explicit SpscRing(size_t capacity);
+
+    // Producer: append a record of "len" bytes with "tag".
+    bool Push(uint32_t tag, const char *data, size_t len);
+
+    // Producer: bytes a record of "len" bytes needs in the ring.
+    static size_t RecordSize(size_t len) { return sizeof(Header) + len; }
+
+    // Producer: bytes free right now.
+    size_t free_space() const {
+        return buffer_.size()
+            - (tail_.load(std::memory_order_relaxed)
+               - head_.load(std::memory_order_acquire));
+    }
+
+    // Consumer: take the oldest record; its content replaces "data".
+    bool Pop(uint32_t *tag, std::string *data);
+
+    // Consumer: nothing to read.
+    bool empty() const {
+        return head_.load(std::memory_order_relaxed)
+            == tail_.load(std::memory_order_acquire);
+    }
+
+private:
+    struct Header {
+        uint32_t tag;
+        uint32_t len;
+    };
+
+    void CopyIn(size_t pos, const void *data, size_t len);
+    void CopyOut(size_t pos, void *data, size_t len) const;
+
+    std::vector<char> buffer_;
+    const size_t mask_;
+
+    // Positions only ever grow; index into buffer_ is position & mask_.
+    // Kept apart, as each is written by another thread and they should not
+    // share a cache line.
+    std::atomic<size_t> head_;   // Next to read; by consumer.
+    char padding_[64];
+    std::atomic<size_t> tail_;   // Next to write; by producer.
+};
+
+#endif  // PNP_SPSC_RING_H
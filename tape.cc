@@ -11,6 +11,7 @@ Tape::Tape()
     : x_(0), y_(0), z_(0),
       dx_(0), dy_(0),
       angle_(0), slant_angle_(0),
+      symmetry_(360), motion_profile_(NULL),
       count_(1000) {
 }
 
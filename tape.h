@@ -9,8 +9,13 @@
 
 #include <string>
 
+struct MotionProfile;
+
 class Tape {
 public:
+    // Symmetry value meaning: infer from pad geometry of the part.
+    static const int kSymmetryAuto = 0;
+
     Tape();
 
     void SetFirstComponentPosition(float x, float y, float z);
@@ -18,6 +23,18 @@ public:
     void SetNumberComponents(int n);
     void SetAngle(float a) { angle_ = a; }
 
+    // Rotational symmetry of the components on this tape in degrees;
+    // rotating a component by this angle results in the same placement.
+    // 360 for polarized parts (default), 180 for e.g. resistors, 90 for
+    // square parts without polarity. Or kSymmetryAuto.
+    void SetSymmetry(int degrees) { symmetry_ = degrees; }
+    int symmetry() const { return symmetry_; }
+
+    // Motion profile to use for components of this tape, e.g. slower for
+    // heavy ones. Not owned. NULL for the default profile.
+    void SetMotionProfile(const MotionProfile *p) { motion_profile_ = p; }
+    const MotionProfile *motion_profile() const { return motion_profile_; }
+
     // Return angle, including slant
     float angle() const { return angle_ + slant_angle_; }
 
@@ -36,6 +53,8 @@ private:
     float x_, y_, z_;
     float dx_, dy_;
     float angle_, slant_angle_;
+    int symmetry_;
+    const MotionProfile *motion_profile_;
     int count_;
 };
 
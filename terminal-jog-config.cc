@@ -56,10 +56,10 @@ static const Part *FindPartClosestTo(const Board::PartList& list,
 #define PRINTF_FMT_CHECK(fmt_pos, args_pos)   \
     __attribute__ ((format (printf, fmt_pos, args_pos)))
 
-static void SendMachineLine(int machine_fd, const char *msg, ...)
+static void SendMachineLine(LineReader *machine, const char *msg, ...)
     PRINTF_FMT_CHECK(2, 3);
 
-static void SendMachineLine(int machine_fd, const char *format, ...) {
+static void SendMachineLine(LineReader *machine, const char *format, ...) {
     char *buffer = NULL;
     va_list ap;
     va_start(ap, format);
@@ -67,8 +67,8 @@ static void SendMachineLine(int machine_fd, const char *format, ...) {
     va_end(ap);
 
     assert(buffer[len-1] == '\n');  // Always use \n in cmds
-    write(machine_fd, buffer, len);
-    WaitForOkAck(machine_fd);
+    machine->Write(buffer, len);
+    WaitForOkAck(machine);
     free(buffer);
 }
 
@@ -115,7 +115,7 @@ static int getChar() {
 
 // Start out at given position and jog machine to where the actual positions
 // are.
-static bool JogTo(int machine_fd, Position *out, float *z) {
+static bool JogTo(LineReader *machine, Position *out, float *z) {
     const Position start_pos = *out;
     const float start_z = *z - kSafeHovering;
     const float kSmallJog = 0.1;
@@ -130,7 +130,7 @@ static bool JogTo(int machine_fd, Position *out, float *z) {
     bool success = false;
     bool done = false;
     while (!done) {
-        SendMachineLine(machine_fd, "G1 X%.3f Y%.3f Z%.3f\n",
+        SendMachineLine(machine, "G1 X%.3f Y%.3f Z%.3f\n",
                         out->x, out->y, *z);
         for (int i = 0; i < 50; ++i) write(STDERR_FILENO, "\x08", 1);
         const Position delta = *out - start_pos;
@@ -197,7 +197,7 @@ static bool JogTo(int machine_fd, Position *out, float *z) {
         }
     }
     fprintf(stderr, "\n-----------------------------------------\n");
-    SendMachineLine(machine_fd, "M84\n");
+    SendMachineLine(machine, "M84\n");
     if (!success) {
         fprintf(stderr, "Aborting requested.\n");
     }
@@ -208,8 +208,9 @@ static void PrintPos(const char *msg, const Position &p) {
     fprintf(stderr, "%s(%.1f, %.1f)\n", msg, p.x, p.y);
 }
 
-bool TerminalJogConfig(const Board &board, int machine_fd, PnPConfig *config) {
-    if (machine_fd < 0) {
+bool TerminalJogConfig(const Board &board, LineReader *machine,
+                       PnPConfig *config) {
+    if (machine == NULL) {
         fprintf(stderr, "In order to do the jog ajustment, you need to "
                 "be connected to the machine (-m option).\n");
         return false;
@@ -217,12 +218,12 @@ bool TerminalJogConfig(const Board &board, int machine_fd, PnPConfig *config) {
 
     //PrintPos("Initial board origin from config: ", config->board.origin);
 
-    SendMachineLine(machine_fd, "G28 Y0\n");
+    SendMachineLine(machine, "G28 Y0\n");
     // The Printrbot simple complains if its phantom probe is too close to board
-    SendMachineLine(machine_fd, "G91 G1 Y-10 G90\n");
-    SendMachineLine(machine_fd, "G28 X0\n");
-    SendMachineLine(machine_fd, "G28 Z0\n");
-    SendMachineLine(machine_fd, "G1 Z%.1f\n", kSafeHovering);
+    SendMachineLine(machine, "G91 G1 Y-10 G90\n");
+    SendMachineLine(machine, "G28 X0\n");
+    SendMachineLine(machine, "G28 Z0\n");
+    SendMachineLine(machine, "G1 Z%.1f\n", kSafeHovering);
 
     const Part *board_part = FindPartClosestTo(board.parts(), Position(0, 0));
     if (board_part == nullptr) {
@@ -239,7 +240,7 @@ bool TerminalJogConfig(const Board &board, int machine_fd, PnPConfig *config) {
             board_part->component_name.c_str(), pad_pos.x, pad_pos.y);
     Position new_pos = pad_pos;
     float z = config->board.top + kSafeHovering;
-    if (!JogTo(machine_fd, &new_pos, &z))
+    if (!JogTo(machine, &new_pos, &z))
         return false;
 
     // Set the new values.
@@ -263,13 +264,13 @@ bool TerminalJogConfig(const Board &board, int machine_fd, PnPConfig *config) {
             board_part->pads[0].name.c_str(),
             board_part->component_name.c_str(), pad_pos.x, pad_pos.y);
 
-    SendMachineLine(machine_fd, "G1 Z%.3f\n", z + 10);
-    SendMachineLine(machine_fd, "G1 X%.3f Y%.3f\n", pad_pos.x, pad_pos.y);
-    SendMachineLine(machine_fd, "G1 Z%.3f\n", z);
+    SendMachineLine(machine, "G1 Z%.3f\n", z + 10);
+    SendMachineLine(machine, "G1 X%.3f Y%.3f\n", pad_pos.x, pad_pos.y);
+    SendMachineLine(machine, "G1 Z%.3f\n", z);
 
     fprintf(stderr, "\n[ OK ? RETURN. Otherwise: CTRL-C]\n");
 
     getchar();
-    SendMachineLine(machine_fd, "G1 Z%.3f\n", config->board.top+kSafeHovering);
+    SendMachineLine(machine, "G1 Z%.3f\n", config->board.top+kSafeHovering);
     return true;
 }
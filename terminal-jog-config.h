@@ -8,10 +8,13 @@
 #include "board.h"
 #include "pnp-config.h"
 
+class LineReader;
+
 // Provide a very simple UI on the terminal to jog the machine to
 // various places on the board to determine origins.
 // Modifies config.
 // Returns 'true' if the user accepts the resulting config.
-bool TerminalJogConfig(const Board &board, int machine_fd, PnPConfig *config);
+bool TerminalJogConfig(const Board &board, LineReader *machine,
+                       PnPConfig *config);
 
 #endif // TERMINAL_JOG_CONFIG_H